@@ -1,249 +1,92 @@
-// Use the newer ALSA API
-#define ALSA_PCM_NEW_HW_PARAMS_API
-
-#include <alsa/asoundlib.h>
+#include "capture_pipeline.h"
+#include "capture_stats.h"
+#include "wav_sink.h"
 #include <stdio.h>
 #include <stdint.h>
-
-struct WaveHeader
-{
-    char RIFF_marker[4];
-    uint32_t file_size;
-    char filetype_header[4];
-    char format_marker[4];
-    uint32_t data_header_length;
-    uint16_t format_type;
-    uint16_t number_of_channels;
-    uint32_t sample_rate;
-    uint32_t bytes_per_second;
-    uint16_t bytes_per_frame;
-    uint16_t bits_per_sample;
-};
-
-// Generate wave header
-struct WaveHeader *genericWAVHeader(uint32_t sample_rate, uint16_t bit_depth, uint16_t channels)
-{
-    struct WaveHeader *hdr;
-    hdr = (WaveHeader*) malloc(sizeof(*hdr));
-    if (!hdr)
-        return NULL;
-
-    memcpy(&hdr->RIFF_marker, "RIFF", 4);
-    memcpy(&hdr->filetype_header, "WAVE", 4);
-    memcpy(&hdr->format_marker, "fmt ", 4);
-    hdr->data_header_length = 16;
-    hdr->format_type = 1;
-    hdr->number_of_channels = channels;
-    hdr->sample_rate = sample_rate;
-    hdr->bytes_per_second = sample_rate * channels * bit_depth / 8;
-    hdr->bytes_per_frame = channels * bit_depth / 8;
-    hdr->bits_per_sample = bit_depth;
-
-    return hdr;
-}
-
-// Write wav header to file
-int writeWAVHeader(int fd, struct WaveHeader *hdr)
-{
-    if (!hdr)
-        return -1;
-
-    write(fd, &hdr->RIFF_marker, 4);
-    write(fd, &hdr->file_size, 4);
-    write(fd, &hdr->filetype_header, 4);
-    write(fd, &hdr->format_marker, 4);
-    write(fd, &hdr->data_header_length, 4);
-    write(fd, &hdr->format_type, 2);
-    write(fd, &hdr->number_of_channels, 2);
-    write(fd, &hdr->sample_rate, 4);
-    write(fd, &hdr->bytes_per_second, 4);
-    write(fd, &hdr->bytes_per_frame, 2);
-    write(fd, &hdr->bits_per_sample, 2);
-    write(fd, "data", 4);
-
-    uint32_t data_size = hdr->file_size + 8 - 44;
-    write(fd, &data_size, 4);
-
-    return 0;
-}
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
 
 int main(int argc, char *argv[]) {
-    int err;
-    int size;
-    snd_pcm_t *handle;
-    snd_pcm_hw_params_t *params;
-    int dir;
-    snd_pcm_uframes_t frames = 32;
-    char *device = (char*) "default";
-    char *buffer;
-    int filedesc;
+    long err;
+    CaptureInput input;
+    WavSink sink;
+    std::vector<const char *> args;
+    bool mapped = false;
+    bool index = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--mmap"))
+            mapped = true;
+        else if (!strcmp(argv[i], "--index"))
+            index = true;
+        else
+            args.push_back(argv[i]);
+    }
 
     // Read file name
-    if (argc != 2)
+    if (args.size() != 1 && args.size() != 2)
     {
-        fprintf(stderr, "Usage: %s (output file name)\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--mmap] [--index] (output file name) [capture source]\n", argv[0]);
         return -1;
     }
-    char* fileName = argv[1];
-    strcat(fileName, ".wav");
+    std::string fileName = std::string(args[0]) + ".wav";
 
     // Settings
-    unsigned int sample_rate = 44100; // CD Quality
-    unsigned int bits_per_sample = 16; // As we are using S16_LE forma
-    unsigned int number_of_channels = 2; // stereo
     uint32_t duration = 5000; // duration to record in milliseconds
 
-    printf("Capture device is %s\n", device);
-
-    /* Generate WAV Header */
-    struct WaveHeader* hdr = genericWAVHeader(sample_rate, bits_per_sample, number_of_channels);
-    if (!hdr)
-    {
-        fprintf(stderr, "Error allocating WAV header.\n");
+    CaptureSource *source = create_capture_source(args.size() == 2 ? args[1] : "alsa");
+    if (!source)
         return -1;
-    }
 
-    /* Open PCM device for recording (capture). */
-    err = snd_pcm_open(&handle, device, SND_PCM_STREAM_CAPTURE, 0);
+    err = input.open(source, 32);
     if (err)
-    {
-        fprintf(stderr, "Unable to open PCM device: %s\n", snd_strerror(err));
         return err;
-    }
-
-    /* Allocate a hardware parameters object. */
-    snd_pcm_hw_params_alloca(&params);
-
-    /* Fill it in with default values. */
-    snd_pcm_hw_params_any(handle, params);
 
-    /* ### Set the desired hardware parameters. ### */
+    if (index)
+        sink.set_index((fileName + ".idx").c_str());
 
-    /* Interleaved mode */
-    err = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
-    if (err)
-    {
-        fprintf(stderr, "Error setting interleaved mode: %s\n", snd_strerror(err));
-        snd_pcm_close(handle);
-        return err;
-    }
-
-    /* Signed capture format (16-bit little-endian format) */
-    if (bits_per_sample == 16) err = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
-    else err = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_U8);
-    if (err)
-    {
-        fprintf(stderr, "Error setting format: %s\n", snd_strerror(err));
-        snd_pcm_close(handle);
-        return err;
-    }
-
-    /* Setting number of channels */
-    err = snd_pcm_hw_params_set_channels(handle, params, number_of_channels);
-    if (err)
-    {
-        fprintf(stderr, "Error setting channels: %s\n", snd_strerror(err));
-        snd_pcm_close(handle);
-        return err;
-    }
-
-    /* Setting sampling rate */
-    err = snd_pcm_hw_params_set_rate_near(handle, params, &sample_rate, &dir);
-    if (err)
-    {
-        fprintf(stderr, "Error setting sampling rate (%d): %s\n", sample_rate, snd_strerror(err));
-        snd_pcm_close(handle);
-        return err;
-    }
-
-    /* Set period size*/
-    err = snd_pcm_hw_params_set_period_size_near(handle, params, &frames, &dir);
-    if (err)
-    {
-        fprintf(stderr, "Error setting period size: %s\n", snd_strerror(err));
-        snd_pcm_close(handle);
-        return err;
-    }
-
-    /* Write the parameters to the driver */
-    err = snd_pcm_hw_params(handle, params);
-    if (err < 0)
-    {
-        fprintf(stderr, "Unable to set HW parameters: %s\n", snd_strerror(err));
-        snd_pcm_close(handle);
-        return err;
-    }
-
-    /* Use a buffer large enough to hold one period (Find number of frames in one period) */
-    err = snd_pcm_hw_params_get_period_size(params, &frames, &dir);
-    if (err)
-    {
-        fprintf(stderr, "Error retrieving period size: %s\n", snd_strerror(err));
-        snd_pcm_close(handle);
-        return err;
-    }
-
-    /* Allocating buffer in number of bytes per period (2 bytes/sample, 2 channels) */
-    size = frames * bits_per_sample / 8 * number_of_channels; 
-    buffer = (char *) malloc(size);
-    if (!buffer)
-    {
-        fprintf(stdout, "Buffer error.\n");
-        snd_pcm_close(handle);
-        return -1;
-    }
-
-    unsigned int period_time;
-    err = snd_pcm_hw_params_get_period_time(params, &period_time, &dir);
-    if (err)
-    {
-        fprintf(stderr, "Error retrieving period time: %s\n", snd_strerror(err));
-        snd_pcm_close(handle);
-        free(buffer);
-        return err;
-    }
-
-    unsigned int bytes_per_frame = bits_per_sample / 8 * number_of_channels;
-    uint32_t pcm_data_size = period_time * bytes_per_frame * duration / 1000;
-
-    filedesc = open(fileName, O_WRONLY | O_CREAT, 0644);
-
-    err = writeWAVHeader(filedesc, hdr);
+    /* Periods are small; the sink collects them into 1 MB writes, or copies them into a mapping sized for the recording */
+    if (mapped)
+        err = sink.open_mapped(fileName.c_str(), source->sample_rate(), source->channels(), source->bits_per_sample(),
+                               (uint64_t) duration * source->sample_rate() / 1000 * source->bytes_per_frame());
+    else
+        err = sink.open(fileName.c_str(), source->sample_rate(), source->channels(), source->bits_per_sample());
     if (err)
     {
         fprintf(stderr, "Error writing .wav header.");
-        snd_pcm_close(handle);
-        free(buffer);
-        close(filedesc);
         return err;
     }
 
-    printf("Sample rate: %d Hz\n", sample_rate);
-    printf("Channels: %d\n", number_of_channels);
     printf("Duration: %d millisecs\n", duration);
 
-    for(int i = duration * 1000 / period_time; i > 0; i--)
+    for(uint64_t i = (uint64_t) duration * source->sample_rate() / 1000 / input.frames(); i > 0; i--)
     {
-        err = snd_pcm_readi(handle, buffer, frames);
-        // if (err == -EPIPE) fprintf(stderr, "Overrun occurred: %d\n", err);
-        // if (err) err = snd_pcm_recover(handle, err, 0);
+        err = input.read();
+        if (err == 0 && source->at_end())
+            break;
         // Still an error, need to exit.
         if (err <= 0)
         {
-            fprintf(stderr, "Error occured while recording: %s\n", snd_strerror(err));
-            snd_pcm_close(handle);
-            free(buffer);
-            close(filedesc);
+            fprintf(stderr, "Error occured while recording: %s\n", strerror(-err));
+            sink.close();
             return err;
         }
-        write(filedesc, buffer, size);
+        /* The period has just been read, so it began its length ago */
+        sink.set_clock(realtime_ns() - err * 1000000000LL / source->sample_rate());
+        err = sink.write(input.buffer(), err * source->bytes_per_frame());
+        if (err)
+            break;
     }
 
-    close(filedesc);
-    snd_pcm_drain(handle);
-    snd_pcm_close(handle);
-    free(buffer);
+    if (!err)
+        err = sink.close();
+    input.close();
 
-    printf("Finished writing to %s\n", fileName);
+    if (err)
+        return err;
+    printf("Finished writing %llu bytes to %s in %llu writes\n", (unsigned long long) sink.data_size(),
+           fileName.c_str(), (unsigned long long) sink.write_calls());
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,340 @@
+#include "async_file_sink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define ASYNC_SINK_PAGE_SIZE 4096
+
+AsyncFileSink::AsyncFileSink()
+{
+    fd = -1;
+    direct = false;
+    preallocated = 0;
+    buffer_size = 0;
+    current = -1;
+    next_offset = 0;
+    logical_size = 0;
+    dropped = 0;
+    written = 0;
+    error = 0;
+    use_uring = false;
+#ifdef HAVE_LIBURING
+    in_flight = 0;
+#endif
+    stopping = false;
+}
+
+AsyncFileSink::~AsyncFileSink()
+{
+    close();
+}
+
+int AsyncFileSink::open(const char *path, bool want_direct, uint64_t preallocate, size_t size, int count)
+{
+    if (count < 2)
+        count = 2;
+    buffer_size = (size + ASYNC_SINK_PAGE_SIZE - 1) / ASYNC_SINK_PAGE_SIZE * ASYNC_SINK_PAGE_SIZE;
+    if (buffer_size < ASYNC_SINK_PAGE_SIZE)
+        buffer_size = ASYNC_SINK_PAGE_SIZE;
+    current = -1;
+    next_offset = 0;
+    logical_size = 0;
+    dropped = 0;
+    written = 0;
+    error = 0;
+    stopping = false;
+    queue.clear();
+
+    /* Page-aligned, which both O_DIRECT and registered buffers want */
+    buffers.assign(count, Buffer());
+    for (Buffer &buffer: buffers) {
+        if (posix_memalign((void **) &buffer.data, ASYNC_SINK_PAGE_SIZE, buffer_size)) {
+            buffer.data = NULL;
+            fprintf(stderr, "Could not allocate the file sink buffers\n");
+            close();
+            return -ENOMEM;
+        }
+        buffer.length = 0;
+        buffer.done = 0;
+        buffer.offset = 0;
+        buffer.state = BUFFER_FREE;
+    }
+
+    direct = want_direct;
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+    if (fd < 0 && direct && errno == EINVAL) {
+        /* tmpfs and some network filesystems refuse O_DIRECT */
+        fprintf(stderr, "%s does not support direct I/O, using the page cache\n", path);
+        direct = false;
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        int err = -errno;
+        fprintf(stderr, "Could not create %s: %s\n", path, strerror(errno));
+        close();
+        return err;
+    }
+
+    /* Reserve the blocks without changing the size; close() gives back what was not used */
+    preallocated = 0;
+    if (preallocate) {
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, preallocate) == 0)
+            preallocated = preallocate;
+        else
+            fprintf(stderr, "Could not preallocate %s: %s\n", path, strerror(errno));
+    }
+
+    use_uring = false;
+#ifdef HAVE_LIBURING
+    in_flight = 0;
+    if (io_uring_queue_init(count * 2, &ring, 0) == 0) {
+        std::vector<struct iovec> iovecs(count);
+        for (int i = 0; i < count; i++) {
+            iovecs[i].iov_base = buffers[i].data;
+            iovecs[i].iov_len = buffer_size;
+        }
+        if (io_uring_register_buffers(&ring, iovecs.data(), count) == 0)
+            use_uring = true;
+        else
+            io_uring_queue_exit(&ring);
+    }
+#endif
+    if (!use_uring)
+        thread = std::thread(&AsyncFileSink::writer, this);
+    return 0;
+}
+
+int AsyncFileSink::take_buffer()
+{
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (!use_uring)
+        lock.lock();
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (buffers[i].state == BUFFER_FREE) {
+            buffers[i].state = BUFFER_FILLING;
+            buffers[i].length = 0;
+            buffers[i].done = 0;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Bytes write() can take without waiting: the rest of the current buffer and every free one */
+size_t AsyncFileSink::free_space()
+{
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (!use_uring)
+        lock.lock();
+    size_t space = current >= 0 ? buffer_size - buffers[current].length : 0;
+    for (const Buffer &buffer: buffers) {
+        if (buffer.state == BUFFER_FREE)
+            space += buffer_size;
+    }
+    return space;
+}
+
+void AsyncFileSink::submit(int index)
+{
+    Buffer *buffer = &buffers[index];
+
+    /* Only the last buffer can be partial; O_DIRECT needs it padded and close() truncates the padding */
+    if (direct && buffer->length % ASYNC_SINK_PAGE_SIZE) {
+        size_t padded = (buffer->length + ASYNC_SINK_PAGE_SIZE - 1) / ASYNC_SINK_PAGE_SIZE * ASYNC_SINK_PAGE_SIZE;
+        memset(buffer->data + buffer->length, 0, padded - buffer->length);
+        buffer->length = padded;
+    }
+    buffer->offset = next_offset;
+    next_offset += buffer->length;
+
+#ifdef HAVE_LIBURING
+    if (use_uring) {
+        buffer->state = BUFFER_WRITING;
+        queue_uring_write(index);
+        return;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(mutex);
+    buffer->state = BUFFER_WRITING;
+    queue.push_back(index);
+    queued.notify_one();
+}
+
+int AsyncFileSink::write(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *) data;
+
+    if (fd < 0)
+        return -EBADF;
+    if (error)
+        return error;
+
+#ifdef HAVE_LIBURING
+    if (use_uring)
+        reap(false);
+#endif
+    /* The disk is behind: losing the write beats stalling capture, and losing all of it keeps frames whole */
+    if (free_space() < size) {
+        dropped += size;
+        return 0;
+    }
+    /* Buffers only come free in the meantime, so every take below succeeds */
+    while (size) {
+        if (current < 0)
+            current = take_buffer();
+        Buffer *buffer = &buffers[current];
+        size_t chunk = buffer_size - buffer->length < size ? buffer_size - buffer->length : size;
+        memcpy(buffer->data + buffer->length, p, chunk);
+        buffer->length += chunk;
+        logical_size += chunk;
+        p += chunk;
+        size -= chunk;
+        if (buffer->length == buffer_size) {
+            submit(current);
+            current = -1;
+        }
+    }
+    return 0;
+}
+
+void AsyncFileSink::write_buffer(Buffer *buffer)
+{
+    while (buffer->done < buffer->length) {
+        ssize_t ret = pwrite(fd, buffer->data + buffer->done, buffer->length - buffer->done,
+                             buffer->offset + buffer->done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            int expected = 0;
+            error.compare_exchange_strong(expected, ret < 0 ? -errno : -EIO);
+            return;
+        }
+        buffer->done += ret;
+        written += ret;
+    }
+}
+
+void AsyncFileSink::writer()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        queued.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty())
+            break;
+        int index = queue.front();
+        queue.pop_front();
+
+        lock.unlock();
+        write_buffer(&buffers[index]);
+        lock.lock();
+        buffers[index].state = BUFFER_FREE;
+    }
+}
+
+#ifdef HAVE_LIBURING
+void AsyncFileSink::queue_uring_write(int index)
+{
+    Buffer *buffer = &buffers[index];
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+    /* The ring has room for twice the buffers, so this only happens if submission failed earlier */
+    if (!sqe) {
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+        if (!sqe) {
+            error = -EBUSY;
+            buffer->state = BUFFER_FREE;
+            return;
+        }
+    }
+    io_uring_prep_write_fixed(sqe, fd, buffer->data + buffer->done, buffer->length - buffer->done,
+                              buffer->offset + buffer->done, index);
+    io_uring_sqe_set_data(sqe, (void *) (intptr_t) index);
+    io_uring_submit(&ring);
+    in_flight++;
+}
+
+void AsyncFileSink::reap(bool wait)
+{
+    while (in_flight) {
+        struct io_uring_cqe *cqe;
+        int ret = wait ? io_uring_wait_cqe(&ring, &cqe) : io_uring_peek_cqe(&ring, &cqe);
+        if (ret == -EINTR)
+            continue;
+        if (ret < 0) {
+            if (wait && !error)
+                error = ret;
+            break;
+        }
+
+        int index = (int) (intptr_t) io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        in_flight--;
+
+        Buffer *buffer = &buffers[index];
+        if (res == -EINTR || res == -EAGAIN) {
+            queue_uring_write(index);
+            continue;
+        }
+        if (res <= 0) {
+            if (!error)
+                error = res < 0 ? res : -EIO;
+            buffer->state = BUFFER_FREE;
+            continue;
+        }
+        buffer->done += res;
+        written += res;
+        if (buffer->done < buffer->length)
+            queue_uring_write(index);       // short write, send the rest
+        else
+            buffer->state = BUFFER_FREE;
+    }
+}
+#endif
+
+int AsyncFileSink::close()
+{
+    if (fd >= 0) {
+        if (current >= 0 && buffers[current].length)
+            submit(current);
+        current = -1;
+
+#ifdef HAVE_LIBURING
+        if (use_uring) {
+            reap(true);
+            io_uring_unregister_buffers(&ring);
+            io_uring_queue_exit(&ring);
+            use_uring = false;
+        }
+#endif
+        if (thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            queued.notify_one();
+            thread.join();
+        }
+
+        /* Drop the O_DIRECT padding and any preallocation that was not used */
+        if ((direct || preallocated) && ftruncate(fd, logical_size) && !error)
+            error = -errno;
+        if (error)
+            fprintf(stderr, "Error writing to file: %s\n", strerror(-error));
+        if (dropped)
+            fprintf(stderr, "The disk fell behind, %llu bytes were dropped\n", (unsigned long long) dropped);
+
+        ::close(fd);
+        fd = -1;
+    }
+
+    for (Buffer &buffer: buffers)
+        free(buffer.data);
+    buffers.clear();
+    return error;
+}
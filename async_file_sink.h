@@ -0,0 +1,99 @@
+#ifndef ASYNC_FILE_SINK_H
+#define ASYNC_FILE_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define ASYNC_SINK_BUFFER_SIZE (256 * 1024)
+#define ASYNC_SINK_BUFFERS 3
+
+/*
+ * Appends to a file without ever blocking the caller on the disk, for the capture thread.
+ *
+ * write() copies into one of a few page-aligned buffers (three by default) and hands each
+ * full buffer to the kernel: through io_uring with the buffers registered, when built with
+ * HAVE_LIBURING and the kernel supports it, otherwise to a dedicated writer thread. When
+ * the disk falls so far behind that a write does not fit in the buffers left, the whole
+ * write is dropped and counted instead of stalling capture, so the file never holds part
+ * of a frame. Use more buffers for slow disks.
+ *
+ * With direct the file is opened O_DIRECT, bypassing the page cache; preallocate reserves
+ * that many bytes up front with fallocate() so long recordings do not fragment.
+ */
+class AsyncFileSink
+{
+    public:
+        AsyncFileSink();
+        ~AsyncFileSink();
+
+        /* Creates or truncates path; returns 0 or a negative errno */
+        int open(const char *path, bool direct = false, uint64_t preallocate = 0,
+                 size_t buffer_size = ASYNC_SINK_BUFFER_SIZE, int buffers = ASYNC_SINK_BUFFERS);
+
+        /* Never waits for the disk; returns 0, or a negative errno once a write has failed */
+        int write(const void *data, size_t size);
+
+        /* Writes what is buffered, waits for every write and closes the file; safe to call twice */
+        int close();
+
+        const char *backend() const { return use_uring ? "io_uring" : "writer thread"; }
+        uint64_t bytes_written() const { return written.load(); }
+        uint64_t bytes_dropped() const { return dropped; }
+
+    private:
+        enum BufferState { BUFFER_FREE, BUFFER_FILLING, BUFFER_WRITING };
+
+        struct Buffer
+        {
+            uint8_t *data;
+            size_t length;          // bytes to write, padded to a page with O_DIRECT
+            size_t done;
+            uint64_t offset;
+            BufferState state;
+        };
+
+        int take_buffer();
+        size_t free_space();
+        void submit(int index);
+        void write_buffer(Buffer *buffer);      // blocking, writer thread only
+        void writer();
+#ifdef HAVE_LIBURING
+        void queue_uring_write(int index);
+        void reap(bool wait);
+#endif
+
+        int fd;
+        bool direct;
+        uint64_t preallocated;
+        size_t buffer_size;
+        std::vector<Buffer> buffers;
+        int current;                // buffer being filled, or -1
+        uint64_t next_offset;       // file offset of the next buffer submitted
+        uint64_t logical_size;      // bytes accepted, without O_DIRECT padding
+        uint64_t dropped;
+        std::atomic<uint64_t> written;
+        std::atomic<int> error;
+
+        bool use_uring;
+#ifdef HAVE_LIBURING
+        struct io_uring ring;
+        int in_flight;
+#endif
+
+        std::thread thread;
+        std::mutex mutex;                       // buffer states and the queue, in writer thread mode
+        std::condition_variable queued;
+        std::deque<int> queue;
+        bool stopping;
+};
+
+#endif
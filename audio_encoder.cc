@@ -0,0 +1,275 @@
+#include "audio_encoder.h"
+#include <string.h>
+
+AudioEncoder::AudioEncoder()
+{
+    codec_context = NULL;
+    outctx = NULL;
+    audio_st = NULL;
+    frame = NULL;
+    next_pts = 0;
+    draining = false;
+    index_interval = 1.0;
+    fragmented = false;
+}
+
+AudioEncoder::~AudioEncoder()
+{
+    cleanup();
+}
+
+int AudioEncoder::init(const char *codec_name, int64_t bit_rate, int sample_rate,
+                       uint64_t channel_layout, const char *filename)
+{
+    int ret;
+    enum AVSampleFormat sample_fmt = AV_SAMPLE_FMT_FLTP;
+
+    AVCodec *aud_codec;
+    if (codec_name)
+        aud_codec = avcodec_find_encoder_by_name(codec_name);
+    else
+        aud_codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+
+    if (!aud_codec)
+        return COULD_NOT_FIND_AUD_CODEC;
+
+    /* Every stage before the encoder produces planar float */
+    bool planar_float = !aud_codec->sample_fmts;
+    for (const enum AVSampleFormat *fmt = aud_codec->sample_fmts; fmt && *fmt != AV_SAMPLE_FMT_NONE; fmt++)
+        planar_float |= *fmt == sample_fmt;
+    if (!planar_float) {
+        fprintf(stderr, "Encoder %s does not accept planar float samples\n", aud_codec->name);
+        return COULD_NOT_OPEN_AUD_CODEC;
+    }
+
+    codec_context = avcodec_alloc_context3(aud_codec);
+    if (!codec_context)
+        return CONTEXT_CREATION_ERROR;
+
+    codec_context->bit_rate = bit_rate;
+    codec_context->sample_rate = sample_rate;
+    codec_context->sample_fmt = sample_fmt;
+    codec_context->channel_layout = channel_layout;
+    codec_context->channels = av_get_channel_layout_nb_channels(channel_layout);
+    codec_context->time_base = (AVRational) { 1, sample_rate };
+
+    /* mp4 needs the codec configuration out of band, and a pre-warmed encoder is opened before its container is known */
+    codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    ret = avcodec_open2(codec_context, aud_codec, NULL);
+    if (ret < 0)
+        return COULD_NOT_OPEN_AUD_CODEC;
+
+    /* Codecs without a fixed frame size take whatever we give them */
+    if (!codec_context->frame_size)
+        codec_context->frame_size = 1024;
+
+    frame = av_frame_alloc();
+    if (!frame)
+        return COULD_NOT_ALLOCATE_FRAME;
+
+    frame->nb_samples = codec_context->frame_size;
+    frame->format = codec_context->sample_fmt;
+    frame->channel_layout = codec_context->channel_layout;
+
+    if (av_frame_get_buffer(frame, 0) < 0)
+        return COULD_NOT_ALLOCATE_FRAME;
+
+    next_pts = 0;
+    draining = false;
+
+    if (filename)
+        return open_output(filename);
+    return 0;
+}
+
+int AudioEncoder::open_output(const char *filename)
+{
+    int ret;
+
+    ret = avformat_alloc_output_context2(&outctx, NULL, NULL, filename);
+    if (ret < 0 || !outctx)
+        ret = avformat_alloc_output_context2(&outctx, NULL, "mp4", filename);
+    if (ret < 0 || !outctx)
+        return COULD_NOT_OPEN_FILE;
+
+    audio_st = avformat_new_stream(outctx, codec_context->codec);
+    if (!audio_st)
+        return COULD_NOT_OPEN_FILE;
+    avcodec_parameters_from_context(audio_st->codecpar, codec_context);
+    audio_st->time_base = codec_context->time_base;
+
+    av_dump_format(outctx, 0, filename, 1);
+
+    if (!(outctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&outctx->pb, filename, AVIO_FLAG_WRITE) < 0)
+            return COULD_NOT_OPEN_FILE;
+    }
+
+    /* Fragments are cut by index_packet(), so each index entry lands on a moof */
+    AVDictionary *options = NULL;
+    SeekIndexFormat index_format = SEEK_INDEX_ADTS;
+    fragmented = false;
+    if (!index_path.empty()) {
+        const char *format = outctx->oformat->name;
+        if (!strcmp(format, "mp4") || !strcmp(format, "mov") || !strcmp(format, "ipod")) {
+            av_dict_set(&options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+            index_format = SEEK_INDEX_FMP4;
+            fragmented = true;
+        } else if (strcmp(format, "adts")) {
+            fprintf(stderr, "No seek index for %s output, only for ADTS and MP4\n", format);
+            index_path.clear();
+        }
+    }
+
+    ret = avformat_write_header(outctx, &options);
+    av_dict_free(&options);
+    if (ret < 0)
+        return COULD_NOT_OPEN_FILE;
+
+    /* A recording whose index cannot be written still records */
+    if (!index_path.empty())
+        index.open(index_path.c_str(), index_format, codec_context->sample_rate, codec_context->channels, 0,
+                   index_interval);
+    return 0;
+}
+
+void AudioEncoder::set_index(const char *path, double interval)
+{
+    index_path = path ? path : "";
+    index_interval = interval;
+}
+
+void AudioEncoder::index_packet(const AVPacket *pkt)
+{
+    int64_t pts = av_rescale_q(pkt->pts, audio_st->time_base, codec_context->time_base);
+    if (!index.due(pts))
+        return;
+
+    /* Closes the fragment so far; this packet opens the next one */
+    if (fragmented && av_write_frame(outctx, NULL) < 0)
+        return;
+    if (index.add(pts, avio_tell(outctx->pb)))
+        index.close();
+}
+
+AVPacket* AudioEncoder::encode(uint8_t **aud_samples)
+{
+    int ret;
+
+    /* The encoder may still hold a reference to the previous frame's buffers */
+    if (av_frame_make_writable(frame) < 0)
+        return NULL;
+
+    for (int c = 0; c < codec_context->channels; c++)
+        memcpy(frame->data[c], aud_samples[c], codec_context->frame_size * sizeof(float));
+
+    frame->pts = next_pts;
+    next_pts += codec_context->frame_size;
+
+    ret = avcodec_send_frame(codec_context, frame);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR_ENCODING_SAMPLES_SEND: '%d'\n", ret);
+        return NULL;
+    }
+    return receive();
+}
+
+AVPacket *AudioEncoder::receive()
+{
+    AVPacket *pkt = av_packet_alloc();      // it calls av_init_packet(), and calling av_packet_unref is hadled by avcodec_receive_packet
+    if (!pkt)
+        return NULL;
+
+    int ret = avcodec_receive_packet(codec_context, pkt);
+    if (!ret) {
+        if (audio_st) {
+            av_packet_rescale_ts(pkt, codec_context->time_base, audio_st->time_base);
+            pkt->stream_index = audio_st->index;
+        }
+        return pkt;
+    }
+
+    av_packet_free(&pkt);
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+        fprintf(stderr, "error in receiving encoded packet: '%d'\n", ret);  //ERROR_ENCODING_SAMPLES_RECEIVE);
+    return NULL;
+}
+
+int AudioEncoder::write(AVPacket *pkt)
+{
+    if (!outctx)
+        return 0;
+
+    /* The muxer may adjust timestamps in place and the caller still delivers pkt, so give it its own reference */
+    AVPacket *ref = av_packet_clone(pkt);
+    if (!ref)
+        return ERROR_ENCODING_SAMPLES_RECEIVE;
+    if (index.is_open())
+        index_packet(ref);
+    int ret = av_write_frame(outctx, ref);
+    av_packet_free(&ref);
+    return ret < 0 ? ERROR_ENCODING_SAMPLES_RECEIVE : 0;
+}
+
+int AudioEncoder::finish()
+{
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    /* After drain() the encoder is already flushing and only the trailer is left */
+    int ret = draining ? 0 : avcodec_send_frame(codec_context, NULL);
+    if (ret < 0)
+        return ERROR_ENCODING_FRAME_SEND;
+
+    while (1) {
+        ret = avcodec_receive_packet(codec_context, &pkt);
+        if (!ret) {
+            if (audio_st) {
+                av_packet_rescale_ts(&pkt, codec_context->time_base, audio_st->time_base);
+                pkt.stream_index = audio_st->index;
+                av_write_frame(outctx, &pkt);
+            }
+            av_packet_unref(&pkt);
+        }
+        if (ret == AVERROR_EOF)
+            break;
+        else if (ret < 0)
+            return ERROR_ENCODING_FRAME_RECEIVE;
+    }
+
+    if (outctx)
+        av_write_trailer(outctx);
+    index.close();
+    return 0;
+}
+
+AVPacket *AudioEncoder::drain()
+{
+    if (!draining) {
+        if (avcodec_send_frame(codec_context, NULL) < 0)
+            return NULL;
+        draining = true;
+    }
+    return receive();
+}
+
+void AudioEncoder::cleanup()
+{
+    index.close();
+    if (frame)
+        av_frame_free(&frame);
+
+    if (outctx) {
+        if (!(outctx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&outctx->pb);
+        avformat_free_context(outctx);
+        outctx = NULL;
+        audio_st = NULL;
+    }
+
+    if (codec_context)
+        avcodec_free_context(&codec_context);
+}
@@ -0,0 +1,93 @@
+#ifndef AUDIO_ENCODER_H
+#define AUDIO_ENCODER_H
+
+extern "C"
+{
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include "capture_errors.h"
+#include "seek_index.h"
+
+/* Output format of the capture pipeline */
+#define DEFAULT_AUD_BIT_RATE 192000
+#define DEFAULT_AUD_SAMPLE_RATE 44100
+#define DEFAULT_AUD_CHANNELS 2
+
+/*
+ * Encodes planar float audio one codec frame at a time and, when given a file
+ * name, muxes the packets into a container guessed from it.
+ */
+class AudioEncoder
+{
+    public:
+        AudioEncoder();
+        ~AudioEncoder();
+
+        /* codec_name NULL selects the native AAC encoder; filename NULL skips the container */
+        int init(const char *codec_name, int64_t bit_rate, int sample_rate,
+                 uint64_t channel_layout, const char *filename);
+
+        /* Attaches a container to an encoder opened without one, e.g. a pre-warmed encoder */
+        int open_output(const char *filename);
+
+        /*
+         * Call before the container is opened: it gets a seek index at index_path with an entry
+         * every interval seconds. ADTS is indexed as it is; MP4 is written fragmented instead,
+         * one fragment per entry, so every entry is a point a player can start from.
+         */
+        void set_index(const char *index_path, double interval = 1.0);
+
+        /* The sample at pts was captured at wall_ns; times the seek index */
+        void set_clock(int64_t pts, int64_t wall_ns) { index.set_clock(pts, wall_ns); }
+
+        /*
+         * Encodes frame_size() samples per channel from aud_samples. Returns the first packet
+         * it produced (owned by the caller) or NULL while the encoder is still buffering;
+         * receive() returns the rest.
+         */
+        AVPacket* encode(uint8_t **aud_samples);
+
+        /* The next packet of the last encode() or drain(), or NULL; some codecs make several per frame */
+        AVPacket *receive();
+
+        /* Advances the timestamps by nb_samples without encoding anything, leaving a gap */
+        void skip(int nb_samples) { next_pts += nb_samples; }
+
+        /* Writes a packet returned by encode() to the container, if there is one */
+        int write(AVPacket *pkt);
+
+        /* Drains the encoder into the container, unless drain() already did, and writes its trailer */
+        int finish();
+
+        /* For callers that mux elsewhere: after the last encode(), returns the held back packets one at a time, then NULL */
+        AVPacket *drain();
+
+        void cleanup();
+
+        int frame_size() const { return codec_context ? codec_context->frame_size : 0; }
+        int channels() const { return codec_context ? codec_context->channels : 0; }
+        int sample_rate() const { return codec_context ? codec_context->sample_rate : 0; }
+
+        AVCodecContext *codec_context;
+        AVFormatContext *outctx;
+        AVStream *audio_st;
+
+    private:
+        void index_packet(const AVPacket *pkt);
+
+        AVFrame *frame;
+        int64_t next_pts;
+        bool draining;
+        std::string index_path;
+        double index_interval;
+        SeekIndexWriter index;
+        bool fragmented;
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include "audio_encoder.h"
+#include "capture_stats.h"
+#include "mapped_file.h"
+#include "sample_convert.h"
+#include "worker_pool.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Encodes PCM archives to one AAC file using every core. The inputs, WAV or raw S16_LE, are
+ * mapped and laid end to end on one timeline, which is cut into chunks of whole codec frames
+ * that are encoded independently and stitched back together in order.
+ *
+ * A chunk's encoder starts PREROLL frames early and runs on past the chunk's end, so its psy
+ * model and MDCT overlap are warm at the boundaries. Only the packets whose timestamps fall
+ * inside the chunk are kept: the same packets, by timestamp, a single encoder would have made.
+ * The first chunk keeps the priming packet and the last one drains the encoder, and its final
+ * packet is shortened to the real end so the container records the padding.
+ */
+
+/* Frames a chunk encoder runs before the chunk starts */
+#define PREROLL_FRAMES 4
+
+struct InputFile
+{
+    MappedFile file;
+    PcmLayout layout;
+    int64_t start;          // first frame on the batch timeline
+    int64_t frames;
+};
+
+struct Batch
+{
+    std::vector<InputFile *> inputs;
+    int64_t total;          // frames on the timeline
+    unsigned int rate;
+    unsigned int channels;
+    ConvertFunction convert;
+    const char *codec_name;
+    int64_t bit_rate;
+};
+
+/* Timeline frames [first, last), and the packets that belong to them once encoded */
+struct Chunk
+{
+    int64_t first;
+    int64_t last;
+    std::vector<AVPacket *> packets;
+    int error;
+};
+
+/* Converts count timeline frames from pos into planes, with silence past the end */
+static void read_frames(const Batch &batch, int64_t pos, int count, float **planes)
+{
+    std::vector<float *> out(batch.channels);
+    int done = 0;
+
+    for (InputFile *input: batch.inputs) {
+        if (done == count)
+            break;
+        int64_t at = pos + done;
+        if (at >= input->start + input->frames || at < input->start)
+            continue;
+        int64_t n = input->start + input->frames - at;
+        if (n > count - done)
+            n = count - done;
+        const uint8_t *samples = input->file.data() + input->layout.offset + (at - input->start) * 2 * batch.channels;
+        for (unsigned int c = 0; c < batch.channels; c++)
+            out[c] = planes[c] + done;
+        batch.convert(samples, out.data(), n, batch.channels);
+        done += n;
+    }
+    for (unsigned int c = 0; c < batch.channels; c++)
+        memset(planes[c] + done, 0, (count - done) * sizeof(float));
+}
+
+static void encode_chunk(const Batch &batch, Chunk *chunk)
+{
+    AudioEncoder encoder;
+    chunk->error = encoder.init(batch.codec_name, batch.bit_rate, batch.rate,
+                                av_get_default_channel_layout(batch.channels), NULL);
+    if (chunk->error)
+        return;
+
+    int frame_size = encoder.frame_size();
+    int64_t delay = encoder.codec_context->initial_padding;
+    int64_t lookahead = (delay + frame_size - 1) / frame_size + 1;
+
+    /* The packet with pts p carries samples [p, p + frame_size) */
+    int64_t keep_from = chunk->first - delay;
+    int64_t keep_to = chunk->last >= batch.total ? batch.total : chunk->last - delay;
+    int64_t begin = chunk->first - PREROLL_FRAMES * frame_size;
+    if (begin < 0)
+        begin = 0;
+    int64_t end = chunk->last + lookahead * frame_size;
+    bool at_end = end >= batch.total;
+
+    std::vector<float> buffer((size_t) frame_size * batch.channels);
+    std::vector<float *> planes(batch.channels);
+    for (unsigned int c = 0; c < batch.channels; c++)
+        planes[c] = &buffer[(size_t) c * frame_size];
+
+    auto keep = [&] (AVPacket *pkt) {
+        pkt->pts += begin;
+        pkt->dts = pkt->pts;
+        if (pkt->pts >= keep_from && pkt->pts < keep_to)
+            chunk->packets.push_back(pkt);
+        else
+            av_packet_free(&pkt);
+    };
+
+    for (int64_t pos = begin; pos < end && pos < batch.total; pos += frame_size) {
+        read_frames(batch, pos, frame_size, planes.data());
+        AVPacket *pkt = encoder.encode((uint8_t **) planes.data());
+        for (; pkt; pkt = encoder.receive())
+            keep(pkt);
+    }
+    if (at_end) {
+        AVPacket *pkt;
+        while ((pkt = encoder.drain()))
+            keep(pkt);
+    }
+}
+
+static int open_inputs(Batch *batch, std::vector<const char *> &paths, unsigned int raw_rate, unsigned int raw_channels)
+{
+    batch->total = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        InputFile *input = new InputFile();
+        batch->inputs.push_back(input);
+        int err = input->file.open(paths[i]);
+        if (err)
+            return err;
+
+        input->layout.rate = raw_rate;
+        input->layout.channels = raw_channels;
+        if (parse_pcm_layout(input->file.data(), input->file.size(), &input->layout)) {
+            fprintf(stderr, "%s: only 16 bit PCM WAV or raw S16_LE files are supported\n", paths[i]);
+            return -1;
+        }
+        if (i == 0) {
+            batch->rate = input->layout.rate;
+            batch->channels = input->layout.channels;
+        } else if (input->layout.rate != batch->rate || input->layout.channels != batch->channels) {
+            fprintf(stderr, "%s is %u Hz, %u channels; every input must match the first (%u Hz, %u channels)\n",
+                    paths[i], input->layout.rate, input->layout.channels, batch->rate, batch->channels);
+            return -1;
+        }
+        input->start = batch->total;
+        input->frames = input->layout.bytes / (2 * input->layout.channels);
+        batch->total += input->frames;
+        printf("%s: %s, %u Hz, %u channels, %.1f s\n", paths[i], input->layout.wav ? "wav" : "raw",
+               input->layout.rate, input->layout.channels, (double) input->frames / input->layout.rate);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    Batch batch;
+    std::vector<const char *> paths;
+    const char *output = NULL;
+    unsigned int raw_rate = 44100, raw_channels = 2;
+    int threads = std::thread::hardware_concurrency();
+    double chunk_seconds = 10;
+    bool usage = false;
+    int err;
+
+    batch.codec_name = NULL;
+    batch.bit_rate = DEFAULT_AUD_BIT_RATE;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else if (!strcmp(argv[i], "--codec") && i + 1 < argc)
+            batch.codec_name = argv[++i];
+        else if (!strcmp(argv[i], "--bitrate") && i + 1 < argc)
+            batch.bit_rate = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--chunk-seconds") && i + 1 < argc)
+            chunk_seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--rate") && i + 1 < argc)
+            raw_rate = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--channels") && i + 1 < argc)
+            raw_channels = atoi(argv[++i]);
+        else if (argv[i][0] == '-')
+            usage = true;
+        else
+            paths.push_back(argv[i]);
+    }
+    if (usage || !output || paths.empty() || raw_channels < 1 || raw_channels > 2 || chunk_seconds <= 0) {
+        fprintf(stderr, "Usage: %s -o output.mp4 [--codec name] [--bitrate 192000] [--threads N]\n"
+                "        [--chunk-seconds 10] [--rate 44100] [--channels 2] input.wav|input.raw ...\n"
+                "Encodes the inputs, one after the other, into a single file; --rate and --channels\n"
+                "describe raw inputs, WAV files carry their own\n", argv[0]);
+        return -1;
+    }
+    if (threads < 1)
+        threads = 1;
+
+    err = open_inputs(&batch, paths, raw_rate, raw_channels);
+    if (!err && batch.channels > 2) {
+        fprintf(stderr, "Only mono and stereo inputs can be encoded\n");
+        err = -1;
+    }
+    if (!err && !batch.total) {
+        fprintf(stderr, "The inputs hold no samples\n");
+        err = -1;
+    }
+
+    /* Owns the container; its encoder only provides the stream parameters the chunk encoders share */
+    AudioEncoder muxer;
+    if (!err)
+        err = muxer.init(batch.codec_name, batch.bit_rate, batch.rate, av_get_default_channel_layout(batch.channels), output);
+    if (err) {
+        for (InputFile *input: batch.inputs)
+            delete input;
+        return err;
+    }
+    batch.convert = find_converter(SAMPLE_S16, LAYOUT_PLANAR, batch.channels);
+
+    int frame_size = muxer.frame_size();
+    int64_t chunk_frames = (int64_t) (chunk_seconds * batch.rate) / frame_size * frame_size;
+    if (chunk_frames < frame_size)
+        chunk_frames = frame_size;
+
+    std::vector<Chunk> chunks;
+    for (int64_t first = 0; first < batch.total; first += chunk_frames)
+        chunks.push_back(Chunk { first, first + chunk_frames < batch.total ? first + chunk_frames : batch.total, {}, 0 });
+
+    /* The calling thread encodes too; a window of chunks in flight bounds the packets held in memory */
+    WorkerPool pool;
+    pool.start(threads - 1);
+    int64_t started_ns = monotonic_ns();
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    AVRational sample_time_base = { 1, (int) batch.rate };
+    AVPacket *last = NULL;
+
+    for (size_t window = 0; window < chunks.size() && !err; window += threads * 2) {
+        size_t window_end = window + threads * 2 < chunks.size() ? window + threads * 2 : chunks.size();
+        std::vector<std::function<void()> > tasks;
+        for (size_t i = window; i < window_end; i++) {
+            Chunk *chunk = &chunks[i];
+            tasks.push_back([&batch, chunk] { encode_chunk(batch, chunk); });
+        }
+        pool.run(tasks);
+
+        for (size_t i = window; i < window_end; i++) {
+            if (!err && chunks[i].error) {
+                fprintf(stderr, "Could not encode frames %lld to %lld: %d\n", (long long) chunks[i].first,
+                        (long long) chunks[i].last, chunks[i].error);
+                err = chunks[i].error;
+            }
+            for (AVPacket *pkt: chunks[i].packets) {
+                /* Held back one packet so the final one can be cut to the real end */
+                if (last && !err) {
+                    last->duration = frame_size;
+                    av_packet_rescale_ts(last, sample_time_base, muxer.audio_st->time_base);
+                    last->stream_index = muxer.audio_st->index;
+                    err = muxer.write(last);
+                }
+                av_packet_free(&last);
+                last = pkt;
+            }
+            chunks[i].packets.clear();
+        }
+    }
+    if (last && !err) {
+        last->duration = batch.total - last->pts;
+        av_packet_rescale_ts(last, sample_time_base, muxer.audio_st->time_base);
+        last->stream_index = muxer.audio_st->index;
+        err = muxer.write(last);
+    }
+    av_packet_free(&last);
+    pool.stop();
+
+    int finish_err = muxer.finish();
+    if (!err)
+        err = finish_err;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    double wall = (monotonic_ns() - started_ns) / 1e9;
+    double cpu = (cpu_end.tv_sec - cpu_start.tv_sec) + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+    double audio = (double) batch.total / batch.rate;
+    printf("Encoded %.1f s of audio in %.2f s on %d threads, %zu chunks: %.1fx real time, %.1f cores busy\n",
+           audio, wall, threads, chunks.size(), wall > 0 ? audio / wall : 0, wall > 0 ? cpu / wall : 0);
+
+    for (InputFile *input: batch.inputs)
+        delete input;
+    return err;
+}
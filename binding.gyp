@@ -1,7 +1,9 @@
 {
   "variables": {
     # x264_root as relative path to the module root
-    "x264_root%": "<(module_root_dir)/x264"
+    "x264_root%": "<(module_root_dir)/x264",
+    # 1 when liburing is installed; AsyncFileSink then submits through io_uring
+    "have_liburing%": "<!(pkg-config --exists liburing && echo 1 || echo 0)"
   },
   "targets": [
     { 
@@ -23,10 +25,108 @@
         ]
       },
       "target_name": "linux_sound_capture_utility",
-      "sources": [ "capture_and_encode.cc"],
+      "sources": [ "capture_and_encode.cc" ],
       # To avoid native node modules from throwing cpp exception and raise pending JS exception which can be handled in JS
-      'dependencies': [ "<!(node -p \"require('node-addon-api').gyp\")" ],
+      'dependencies': [ "capture_pipeline", "<!(node -p \"require('node-addon-api').gyp\")" ],
       "defines": [ 'NAPI_DISABLE_CPP_EXCEPTIONS' ]
+    },
+    {
+      # Headless benchmarks for the pipeline stages, built into build/Release/capture_benchmark
+      "target_name": "capture_benchmark",
+      "type": "executable",
+      "cflags!": [ "-fno-exceptions" ],
+      "cflags_cc!": [ "-fno-exceptions" ],
+      "include_dirs" : [
+        "-I/usr/include/ffmpeg"
+      ],
+      "dependencies": [ "capture_pipeline" ],
+      "sources": [ "capture-benchmark.cpp" ]
+    },
+    {
+      # Pipeline stages shared by the addon, the benchmark and the command line tools
+      "target_name": "capture_pipeline",
+      "type": "static_library",
+      "cflags": [ "-fPIC" ],
+      "cflags!": [ "-fno-exceptions" ],
+      "cflags_cc!": [ "-fno-exceptions" ],
+      "include_dirs" : [
+        "-I/usr/include/ffmpeg"
+      ],
+      # Passed on to every target that depends on the library
+      "direct_dependent_settings": {
+        "include_dirs" : [
+          "-I/usr/include/ffmpeg"
+        ]
+      },
+      "link_settings": {
+        "libraries": [
+          "-lasound",
+          "-lavformat",
+          "-lavcodec",
+          "-lavutil",
+          "-lswresample",
+          "-lpthread"
+        ]
+      },
+      "conditions": [
+        [ "have_liburing==1", {
+          "defines": [ "HAVE_LIBURING" ],
+          # async_file_sink.h lays out its members by the same macro
+          "direct_dependent_settings": {
+            "defines": [ "HAVE_LIBURING" ]
+          },
+          "link_settings": {
+            "libraries": [ "<!@(pkg-config --libs liburing)" ]
+          }
+        } ]
+      ],
+      "sources": [ "capture_source.cc", "capture_pipeline.cc", "audio_encoder.cc", "resampler.cc", "sample_convert.cc",
+                   "capture_mixer.cc", "capture_pool.cc", "channel_remix.cc", "worker_pool.cc", "level_meter.cc",
+                   "spectrum_analyzer.cc", "pcm_tap.cc", "stream_muxer.cc", "wav_sink.cc", "async_file_sink.cc",
+                   "tee_sink.cc", "stage_pipeline.cc",
+                   "shared_encoder_pool.cc", "mapped_file.cc", "seek_index.cc" ]
+    },
+    {
+      "target_name": "alsa-record",
+      "type": "executable",
+      "dependencies": [ "capture_pipeline" ],
+      "sources": [ "alsa-record.cpp" ]
+    },
+    {
+      "target_name": "alsa-record-wav",
+      "type": "executable",
+      "dependencies": [ "capture_pipeline" ],
+      "sources": [ "alsa-record-wav.cpp" ]
+    },
+    {
+      "target_name": "modularised_capture",
+      "type": "executable",
+      "dependencies": [ "capture_pipeline" ],
+      "sources": [ "modularised_capture.cpp" ]
+    },
+    {
+      "target_name": "capture-and-encode",
+      "type": "executable",
+      "dependencies": [ "capture_pipeline" ],
+      "sources": [ "capture-and-encode.cpp" ]
+    },
+    {
+      "target_name": "s16-to-fltp",
+      "type": "executable",
+      "dependencies": [ "capture_pipeline" ],
+      "sources": [ "ffmpeg-resampling-s16-to-fltp.cpp" ]
+    },
+    {
+      "target_name": "batch-transcode",
+      "type": "executable",
+      "dependencies": [ "capture_pipeline" ],
+      "sources": [ "batch-transcode.cpp" ]
+    },
+    {
+      "target_name": "seek-extract",
+      "type": "executable",
+      "dependencies": [ "capture_pipeline" ],
+      "sources": [ "seek-extract.cpp" ]
     }
   ]
 }
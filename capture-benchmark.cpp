@@ -0,0 +1,770 @@
+extern "C"
+{
+#include <libavutil/opt.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+#include "audio_encoder.h"
+#include "capture_pipeline.h"
+#include "capture_source.h"
+#include "level_meter.h"
+#include "mapped_file.h"
+#include "resampler.h"
+#include "sample_convert.h"
+
+#include <atomic>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+/*
+ * Benchmarks for the capture pipeline stages, run headless on a file or generated source.
+ *
+ *   capture_benchmark [--seconds 30] [--source noise,fast] [--filter name] [--json results.json] [--io-mb 256]
+ *   capture_benchmark --compare baseline.json candidate.json [--threshold 5]
+ *
+ * Every case reports samples/sec (per channel), ns per frame, heap allocations per frame and
+ * the share of one core a real-time stream would need.
+ */
+
+/* Allocation counting: every malloc family call in the process, including ffmpeg's, goes through here */
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t nmemb, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+
+static std::atomic<uint64_t> alloc_count(0);
+
+extern "C" void *malloc(size_t size)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    *memptr = __libc_memalign(alignment, size);
+    return *memptr ? 0 : ENOMEM;
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+struct BenchmarkResult
+{
+    std::string name;
+    uint64_t frames;            // sample frames processed (one sample per channel)
+    double seconds;
+    uint64_t allocations;
+    double audio_seconds;       // duration of the audio processed
+};
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Measures one run of body, which processes and returns a number of frames at the given rate */
+template <typename Body>
+static BenchmarkResult measure(const std::string &name, int rate, Body body)
+{
+    BenchmarkResult result;
+    result.name = name;
+
+    uint64_t allocations = alloc_count.load();
+    double start = now_seconds();
+    result.frames = body();
+    result.seconds = now_seconds() - start;
+    result.allocations = alloc_count.load() - allocations;
+    result.audio_seconds = (double) result.frames / rate;
+    return result;
+}
+
+static void print_result(const BenchmarkResult &r)
+{
+    printf("%-36s %12.0f samples/s %10.2f ns/frame %8.4f allocs/frame %9.1fx realtime %7.3f%% cpu/stream\n",
+           r.name.c_str(), r.frames / r.seconds, r.seconds * 1e9 / r.frames,
+           (double) r.allocations / r.frames, r.audio_seconds / r.seconds, r.seconds * 100 / r.audio_seconds);
+}
+
+static void write_json(FILE *out, const std::vector<BenchmarkResult> &results)
+{
+    /* One case per line so --compare can read it back without a JSON parser */
+    fprintf(out, "{\"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult &r = results[i];
+        fprintf(out, "{\"name\": \"%s\", \"frames\": %llu, \"seconds\": %.6f, \"samples_per_sec\": %.1f, "
+                     "\"ns_per_frame\": %.3f, \"allocations\": %llu, \"realtime\": %.2f, \"cpu_percent\": %.4f}%s\n",
+                r.name.c_str(), (unsigned long long) r.frames, r.seconds, r.frames / r.seconds,
+                r.seconds * 1e9 / r.frames, (unsigned long long) r.allocations, r.audio_seconds / r.seconds,
+                r.seconds * 100 / r.audio_seconds,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+static int read_json(const char *path, std::vector<std::pair<std::string, double> > *cases)
+{
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -1;
+    }
+
+    char line[1024], name[256];
+    double ns_per_frame;
+    while (fgets(line, sizeof(line), in)) {
+        const char *ns = strstr(line, "\"ns_per_frame\": ");
+        if (sscanf(line, "{\"name\": \"%255[^\"]\"", name) == 1 && ns &&
+            sscanf(ns, "\"ns_per_frame\": %lf", &ns_per_frame) == 1)
+            cases->push_back(std::make_pair(std::string(name), ns_per_frame));
+    }
+    fclose(in);
+    return 0;
+}
+
+/* Prints the per case change between two runs; returns 1 when any case regressed past the threshold */
+static int compare(const char *baseline_path, const char *candidate_path, double threshold)
+{
+    std::vector<std::pair<std::string, double> > baseline, candidate;
+    if (read_json(baseline_path, &baseline) || read_json(candidate_path, &candidate))
+        return -1;
+
+    int regressions = 0;
+    printf("%-36s %14s %14s %9s\n", "benchmark", "baseline ns", "candidate ns", "change");
+    for (size_t i = 0; i < candidate.size(); i++) {
+        for (size_t j = 0; j < baseline.size(); j++) {
+            if (baseline[j].first != candidate[i].first)
+                continue;
+            double change = (candidate[i].second - baseline[j].second) * 100.0 / baseline[j].second;
+            bool regressed = change > threshold;
+            regressions += regressed;
+            printf("%-36s %14.2f %14.2f %+8.1f%%%s\n", candidate[i].first.c_str(), baseline[j].second,
+                   candidate[i].second, change, regressed ? "  REGRESSION" : "");
+        }
+    }
+    return regressions ? 1 : 0;
+}
+
+/* Reads `seconds` of interleaved S16 from a source spec, used as input for the stage benchmarks */
+static int load_input(const char *spec, double seconds, std::vector<int16_t> *pcm, unsigned int *rate,
+                      unsigned int *channels)
+{
+    unsigned long frames = 1024;
+    CaptureSource *source = create_capture_source(spec);
+    if (!source || source->open(&frames)) {
+        delete source;
+        return -1;
+    }
+
+    *rate = source->sample_rate();
+    *channels = source->channels();
+    uint64_t wanted = (uint64_t) (seconds * *rate);
+    pcm->resize(wanted * *channels);
+
+    uint64_t filled = 0;
+    std::vector<char> period(frames * source->bytes_per_frame());
+    while (filled < wanted) {
+        long got = source->read(period.data(), frames);
+        if (got <= 0)
+            break;
+        uint64_t take = (uint64_t) got < wanted - filled ? got : wanted - filled;
+        memcpy(&(*pcm)[filled * *channels], period.data(), take * source->bytes_per_frame());
+        filled += take;
+    }
+    pcm->resize(filled * *channels);
+
+    source->close();
+    delete source;
+    return filled ? 0 : -1;
+}
+
+/* Converts (and resamples when the rates differ) the whole input in 1024 frame periods */
+static uint64_t run_resampler(const std::vector<int16_t> &pcm, int channels, int src_rate, int dst_rate,
+                              ResamplerQuality quality = RESAMPLER_DEFAULT)
+{
+    const int period = 1024;
+    struct SwrContext *swr_ctx = create_resampler(av_get_default_channel_layout(channels), src_rate,
+                                                 av_get_default_channel_layout(channels), dst_rate, quality);
+    if (!swr_ctx)
+        return 0;
+
+    uint8_t **dst_data = NULL;
+    int dst_linesize;
+    int dst_nb_samples = av_rescale_rnd(period, dst_rate, src_rate, AV_ROUND_UP) + 16;
+    av_samples_alloc_array_and_samples(&dst_data, &dst_linesize, channels, dst_nb_samples, AV_SAMPLE_FMT_FLTP, 0);
+
+    uint64_t total = pcm.size() / channels, frames = 0;
+    for (uint64_t offset = 0; offset + period <= total; offset += period) {
+        const uint8_t *src = (const uint8_t *) &pcm[offset * channels];
+        if (swr_convert(swr_ctx, dst_data, dst_nb_samples, &src, period) < 0)
+            break;
+        frames += period;
+    }
+
+    av_freep(&dst_data[0]);
+    av_freep(&dst_data);
+    swr_free(&swr_ctx);
+    return frames;
+}
+
+/* Converts the whole input with the fused converter and level measurement the addon uses when no resampling is needed */
+static uint64_t run_fused_convert(const std::vector<int16_t> &pcm, int channels)
+{
+    const int period = 1024;
+    std::vector<std::vector<float> > planes(channels, std::vector<float>(period));
+    std::vector<float *> out(channels);
+    for (int c = 0; c < channels; c++)
+        out[c] = planes[c].data();
+
+    SignalLevel level;
+    uint64_t total = pcm.size() / channels, frames = 0;
+    for (uint64_t offset = 0; offset + period <= total; offset += period) {
+        convert_s16_to_fltp(&pcm[offset * channels], out.data(), period, channels, &level);
+        frames += period;
+    }
+    return frames;
+}
+
+/* Re-encodes the S16 input as `format` with `channels` channels, repeating input channels as needed */
+static std::vector<uint8_t> to_format(const std::vector<int16_t> &pcm, int src_channels, int channels, SampleFormat format)
+{
+    size_t frames = pcm.size() / src_channels;
+    int size = sample_format_size(format);
+    std::vector<uint8_t> out(frames * channels * size);
+    uint8_t *p = out.data();
+
+    for (size_t i = 0; i < frames; i++) {
+        for (int c = 0; c < channels; c++, p += size) {
+            int16_t s = pcm[i * src_channels + c % src_channels];
+            int32_t s32 = (int32_t) s << 16;
+            float f = s / 32768.0f;
+            switch (format) {
+            case SAMPLE_U8:  p[0] = (s >> 8) + 128; break;
+            case SAMPLE_S16: memcpy(p, &s, 2); break;
+            case SAMPLE_S24: p[0] = 0; p[1] = s & 0xff; p[2] = (s >> 8) & 0xff; break;
+            case SAMPLE_S32: memcpy(p, &s32, 4); break;
+            default:         memcpy(p, &f, 4); break;
+            }
+        }
+    }
+    return out;
+}
+
+/* Converts the input in 1024 frame periods with the specialized converter for the combination */
+static uint64_t run_converter(const std::vector<uint8_t> &in, SampleFormat format, SampleLayout layout, int channels)
+{
+    const int period = 1024;
+    ConvertFunction convert = find_converter(format, layout, channels);
+    std::vector<float> samples(period * channels);
+    std::vector<float *> out(channels);
+    for (int c = 0; c < channels; c++)
+        out[c] = layout == LAYOUT_PLANAR ? &samples[c * period] : samples.data();
+
+    size_t bytes_per_frame = channels * sample_format_size(format);
+    uint64_t total = in.size() / bytes_per_frame, frames = 0;
+    for (uint64_t offset = 0; offset + period <= total; offset += period) {
+        convert(&in[offset * bytes_per_frame], out.data(), period, channels);
+        frames += period;
+    }
+    return frames;
+}
+
+/* Writes the input over and over into a raw file of at least mb megabytes; returns its frames, 0 on failure */
+static uint64_t write_io_input(const char *path, const std::vector<int16_t> &pcm, int channels, int mb)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return 0;
+    uint64_t bytes = 0, target = (uint64_t) mb << 20;
+    while (bytes < target && !pcm.empty()) {
+        if (fwrite(pcm.data(), sizeof(int16_t), pcm.size(), file) != pcm.size())
+            break;
+        bytes += pcm.size() * sizeof(int16_t);
+    }
+    if (fclose(file) || bytes < target)
+        return 0;
+    return bytes / (sizeof(int16_t) * channels);
+}
+
+/* File to file S16 to FLTP in 4096 frame chunks through fread() and one fwrite() per plane */
+static uint64_t run_stdio_io(const char *in_path, const char *out_path, int channels)
+{
+    const int chunk = 4096;
+    ConvertFunction convert = find_converter(SAMPLE_S16, LAYOUT_PLANAR, channels);
+    std::vector<int16_t> in(chunk * channels);
+    std::vector<float> samples(chunk * channels);
+    std::vector<float *> out(channels);
+    for (int c = 0; c < channels; c++)
+        out[c] = &samples[c * chunk];
+
+    FILE *input = fopen(in_path, "rb");
+    std::vector<FILE *> outputs(channels);
+    for (int c = 0; c < channels; c++)
+        outputs[c] = fopen((std::string(out_path) + "." + std::to_string(c)).c_str(), "wb");
+
+    uint64_t frames = 0;
+    bool failed = !input;
+    size_t n;
+    while (!failed && (n = fread(in.data(), sizeof(int16_t) * channels, chunk, input)) > 0) {
+        convert((const uint8_t *) in.data(), out.data(), n, channels);
+        for (int c = 0; c < channels && !failed; c++)
+            failed = !outputs[c] || fwrite(out[c], sizeof(float), n, outputs[c]) != n;
+        frames += n;
+    }
+    if (input)
+        fclose(input);
+    for (FILE *output: outputs) {
+        if (!output || fclose(output))
+            failed = true;
+    }
+    return failed ? 0 : frames;
+}
+
+/* The same, with the converter reading the mapped input and writing the mapped, preallocated outputs */
+static uint64_t run_mmap_io(const char *in_path, const char *out_path, int channels)
+{
+    const int chunk = 4096;
+    ConvertFunction convert = find_converter(SAMPLE_S16, LAYOUT_PLANAR, channels);
+    MappedFile input;
+    if (input.open(in_path, true))
+        return 0;
+
+    uint64_t total = input.size() / (sizeof(int16_t) * channels);
+    std::vector<MappedOutput> outputs(channels);
+    for (int c = 0; c < channels; c++) {
+        if (outputs[c].open((std::string(out_path) + "." + std::to_string(c)).c_str(), total * sizeof(float)))
+            return 0;
+    }
+
+    std::vector<float *> out(channels);
+    for (uint64_t pos = 0; pos < total; pos += chunk) {
+        int n = total - pos < (uint64_t) chunk ? total - pos : chunk;
+        for (int c = 0; c < channels; c++)
+            out[c] = (float *) outputs[c].data() + pos;
+        convert(input.data() + pos * sizeof(int16_t) * channels, out.data(), n, channels);
+    }
+
+    for (MappedOutput &output: outputs) {
+        if (output.close(total * sizeof(float)))
+            return 0;
+    }
+    return total;
+}
+
+static const enum AVSampleFormat swr_formats[SAMPLE_FORMAT_COUNT] = {
+    AV_SAMPLE_FMT_U8, AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_NONE, AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_FLT
+};
+
+/*
+ * Converts the first periods of the input with the specialized converter and with swresample and
+ * returns the largest difference between the two, or -1 when swresample could not be set up.
+ * swresample has no packed 24 bit format, so S24 is checked against S32 with a zero low byte.
+ */
+static double check_converter(const std::vector<uint8_t> &in, SampleFormat format, SampleLayout layout,
+                              int channels, int rate)
+{
+    size_t bytes_per_frame = channels * sample_format_size(format);
+    int frames = in.size() / bytes_per_frame < 16 * 1024 ? in.size() / bytes_per_frame : 16 * 1024;
+    if (!frames)
+        return -1;
+
+    const uint8_t *src = in.data();
+    enum AVSampleFormat src_fmt = swr_formats[format];
+    std::vector<int32_t> widened;
+    if (format == SAMPLE_S24) {
+        widened.resize((size_t) frames * channels);
+        for (size_t i = 0; i < widened.size(); i++) {
+            const uint8_t *p = &in[i * 3];
+            widened[i] = (int32_t) ((uint32_t) p[0] << 8 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 24);
+        }
+        src = (const uint8_t *) widened.data();
+        src_fmt = AV_SAMPLE_FMT_S32;
+    }
+
+    std::vector<float> samples((size_t) frames * channels);
+    std::vector<float *> out(channels);
+    for (int c = 0; c < channels; c++)
+        out[c] = layout == LAYOUT_PLANAR ? &samples[(size_t) c * frames] : samples.data();
+    find_converter(format, layout, channels)(in.data(), out.data(), frames, channels);
+
+    enum AVSampleFormat dst_fmt = layout == LAYOUT_PLANAR ? AV_SAMPLE_FMT_FLTP : AV_SAMPLE_FMT_FLT;
+    int64_t ch_layout = av_get_default_channel_layout(channels);
+    struct SwrContext *swr_ctx = create_format_resampler(ch_layout, src_fmt, rate, ch_layout, dst_fmt, rate);
+    uint8_t **dst_data = NULL;
+    if (!swr_ctx || av_samples_alloc_array_and_samples(&dst_data, NULL, channels, frames, dst_fmt, 0) < 0) {
+        swr_free(&swr_ctx);
+        return -1;
+    }
+
+    double worst = -1;
+    if (swr_convert(swr_ctx, dst_data, frames, &src, frames) == frames) {
+        worst = 0;
+        for (int c = 0; c < (layout == LAYOUT_PLANAR ? channels : 1); c++) {
+            const float *expected = (const float *) dst_data[c];
+            int count = layout == LAYOUT_PLANAR ? frames : frames * channels;
+            for (int i = 0; i < count; i++) {
+                double diff = fabs((double) out[c][i] - expected[i]);
+                if (diff > worst)
+                    worst = diff;
+            }
+        }
+    }
+
+    av_freep(&dst_data[0]);
+    av_freep(&dst_data);
+    swr_free(&swr_ctx);
+    return worst;
+}
+
+/* The same conversion through swresample, for comparison; 0 when swr has no matching format */
+static uint64_t run_swr_converter(const std::vector<uint8_t> &in, SampleFormat format, SampleLayout layout,
+                                  int channels, int rate)
+{
+    if (swr_formats[format] == AV_SAMPLE_FMT_NONE)
+        return 0;
+
+    const int period = 1024;
+    enum AVSampleFormat dst_fmt = layout == LAYOUT_PLANAR ? AV_SAMPLE_FMT_FLTP : AV_SAMPLE_FMT_FLT;
+    int64_t ch_layout = av_get_default_channel_layout(channels);
+    struct SwrContext *swr_ctx = create_format_resampler(ch_layout, swr_formats[format], rate, ch_layout, dst_fmt, rate);
+    if (!swr_ctx)
+        return 0;
+
+    uint8_t **dst_data = NULL;
+    int dst_linesize;
+    av_samples_alloc_array_and_samples(&dst_data, &dst_linesize, channels, period, dst_fmt, 0);
+
+    size_t bytes_per_frame = channels * sample_format_size(format);
+    uint64_t total = in.size() / bytes_per_frame, frames = 0;
+    for (uint64_t offset = 0; offset + period <= total; offset += period) {
+        const uint8_t *src = &in[offset * bytes_per_frame];
+        if (swr_convert(swr_ctx, dst_data, period, &src, period) < 0)
+            break;
+        frames += period;
+    }
+
+    av_freep(&dst_data[0]);
+    av_freep(&dst_data);
+    swr_free(&swr_ctx);
+    return frames;
+}
+
+/* Deinterleaves the input to planar float once, so the encoder cases time only the encoder */
+static std::vector<std::vector<float> > to_planar(const std::vector<int16_t> &pcm, int channels)
+{
+    std::vector<std::vector<float> > planes(channels, std::vector<float>(pcm.size() / channels));
+    for (size_t i = 0; i < pcm.size(); i++)
+        planes[i % channels][i / channels] = pcm[i] / 32768.0f;
+    return planes;
+}
+
+/* Meters the planar input in 1024 frame periods, as the addon does with { levels: true } */
+static uint64_t run_meter(std::vector<std::vector<float> > &planes, int rate)
+{
+    const int period = 1024;
+    int channels = planes.size();
+    LevelMeter meter;
+    meter.init(rate, channels);
+
+    std::vector<const float *> in(channels);
+    uint64_t total = planes[0].size(), frames = 0;
+    for (uint64_t offset = 0; offset + period <= total; offset += period) {
+        for (int c = 0; c < channels; c++)
+            in[c] = &planes[c][offset];
+        meter.process(in.data(), period);
+        frames += period;
+    }
+    return frames;
+}
+
+static uint64_t run_encoder(const char *codec, int64_t bit_rate, int rate, int channels,
+                            std::vector<std::vector<float> > &planes)
+{
+    AudioEncoder encoder;
+    if (encoder.init(codec, bit_rate, rate, av_get_default_channel_layout(channels), NULL))
+        return 0;
+
+    int frame_size = encoder.frame_size();
+    uint64_t total = planes[0].size(), frames = 0;
+    std::vector<uint8_t *> samples(channels);
+    for (uint64_t offset = 0; offset + frame_size <= total; offset += frame_size) {
+        for (int c = 0; c < channels; c++)
+            samples[c] = (uint8_t *) &planes[c][offset];
+        AVPacket *pkt = encoder.encode(samples.data());
+        for (; pkt; pkt = encoder.receive())
+            av_packet_free(&pkt);
+        frames += frame_size;
+    }
+    encoder.finish();
+    return frames;
+}
+
+/* Source -> S16 to FLTP conversion -> AAC, as fast as the source delivers, through the stages the tools share */
+static uint64_t run_pipeline(const char *spec, double seconds, int *rate)
+{
+    CaptureInput input;
+    input.reset(create_capture_source(spec));
+    if (input.open(1024))
+        return 0;
+    *rate = input.source()->sample_rate();
+
+    int channels = input.source()->channels();
+    SampleConverter converter;
+    FrameAssembler assembler;
+    AudioEncoder encoder;
+    if (converter.init(channels, input.source()->sample_rate(), channels, 44100) || converter.reserve(input.frames()) ||
+        encoder.init(NULL, 192000, 44100, av_get_default_channel_layout(channels), NULL) ||
+        assembler.init(channels, encoder.frame_size()))
+        return 0;
+
+    uint64_t wanted = (uint64_t) (seconds * input.source()->sample_rate()), frames = 0;
+    while (frames < wanted) {
+        long got = input.read();
+        if (got <= 0)
+            break;
+        int converted = converter.convert(input.buffer(), got);
+        if (converted < 0 || assembler.write(converter.planes(), converted))
+            break;
+        frames += got;
+
+        while (assembler.next()) {
+            AVPacket *pkt = encoder.encode((uint8_t **) assembler.frame());
+            for (; pkt; pkt = encoder.receive())
+                av_packet_free(&pkt);
+        }
+    }
+    encoder.finish();
+    return frames;
+}
+
+static bool selected(const char *filter, const std::string &name)
+{
+    return !filter || name.find(filter) != std::string::npos;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = 30;
+    const char *source_spec = "noise,fast";
+    const char *filter = NULL;
+    const char *json_path = NULL;
+    double threshold = 5;
+    int io_mb = 256;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--seconds") && i + 1 < argc)
+            seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--source") && i + 1 < argc)
+            source_spec = argv[++i];
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+            filter = argv[++i];
+        else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+            json_path = argv[++i];
+        else if (!strcmp(argv[i], "--threshold") && i + 1 < argc)
+            threshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--io-mb") && i + 1 < argc)
+            io_mb = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--compare") && i + 2 < argc) {
+            const char *baseline = argv[++i];
+            const char *candidate = argv[++i];
+            for (int j = i + 1; j + 1 < argc; j++)
+                if (!strcmp(argv[j], "--threshold"))
+                    threshold = atof(argv[j + 1]);
+            return compare(baseline, candidate, threshold);
+        } else {
+            fprintf(stderr, "Usage: %s [--seconds N] [--source spec] [--filter name] [--json file] [--io-mb 256]\n"
+                            "       %s --compare baseline.json candidate.json [--threshold percent]\n",
+                    argv[0], argv[0]);
+            return -1;
+        }
+    }
+
+    av_log_set_level(AV_LOG_ERROR);
+
+    std::vector<int16_t> input_44100, input_48000;
+    unsigned int rate, channels, rate_48000, channels_48000;
+    std::string spec_48000 = std::string(source_spec) + ",rate=48000";
+    if (load_input(source_spec, seconds, &input_44100, &rate, &channels)) {
+        fprintf(stderr, "Could not read input from %s\n", source_spec);
+        return -1;
+    }
+    /* Generated sources honour the rate option too; file sources fall back to their own rate */
+    if (load_input(spec_48000.c_str(), seconds, &input_48000, &rate_48000, &channels_48000) ||
+        channels_48000 != channels)
+        input_48000.clear();
+
+    std::vector<BenchmarkResult> results;
+    char name[128];
+
+    snprintf(name, sizeof(name), "convert_s16_fltp_%uch_%u", channels, rate);
+    if (selected(filter, name))
+        results.push_back(measure(name, rate, [&] { return run_resampler(input_44100, channels, rate, rate); }));
+
+    snprintf(name, sizeof(name), "convert_s16_fltp_fused_%uch", channels);
+    if (selected(filter, name))
+        results.push_back(measure(name, rate, [&] { return run_fused_convert(input_44100, channels); }));
+
+    /* Every specialized converter against swresample doing the same format conversion, checked to match it first */
+    static const char *format_names[SAMPLE_FORMAT_COUNT] = { "u8", "s16", "s24", "s32", "f32" };
+    static const char *layout_names[LAYOUT_COUNT] = { "planar", "interleaved" };
+    int mismatches = 0;
+    for (int f = 0; f < SAMPLE_FORMAT_COUNT; f++) {
+        for (int ch = 1; ch <= 2; ch++) {
+            std::vector<uint8_t> in;
+            for (int l = 0; l < LAYOUT_COUNT; l++) {
+                snprintf(name, sizeof(name), "convert_%s_%s_%dch", format_names[f], layout_names[l], ch);
+                if (selected(filter, name)) {
+                    if (in.empty())
+                        in = to_format(input_44100, channels, ch, (SampleFormat) f);
+                    /* Both scale by a power of two, so only float rounding may differ */
+                    double worst = check_converter(in, (SampleFormat) f, (SampleLayout) l, ch, rate);
+                    if (worst < 0 || worst > 1e-6) {
+                        printf("%-36s differs from swresample (%g)\n", name, worst);
+                        mismatches++;
+                    }
+                }
+                for (int swr = 0; swr <= 1; swr++) {
+                    snprintf(name, sizeof(name), "convert_%s_%s_%dch_%s", format_names[f], layout_names[l], ch,
+                             swr ? "swr" : "template");
+                    if (!selected(filter, name))
+                        continue;
+                    if (in.empty())
+                        in = to_format(input_44100, channels, ch, (SampleFormat) f);
+                    BenchmarkResult r = measure(name, rate, [&] {
+                        return swr ? run_swr_converter(in, (SampleFormat) f, (SampleLayout) l, ch, rate)
+                                   : run_converter(in, (SampleFormat) f, (SampleLayout) l, ch);
+                    });
+                    if (r.frames)
+                        results.push_back(r);
+                    else
+                        printf("%-36s skipped (no matching swresample format)\n", name);
+                }
+            }
+        }
+    }
+
+    /*
+     * File to file conversion of an archive of io_mb megabytes, through stdio and through mappings.
+     * The files are in TMPDIR and the page cache is warm for both, so this is the cost of the copies.
+     */
+    const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    std::string io_in = std::string(tmpdir) + "/capture_benchmark_io.raw";
+    std::string io_out = std::string(tmpdir) + "/capture_benchmark_io.fltp";
+    bool io_stdio = selected(filter, "io_s16_fltp_stdio"), io_mmap = selected(filter, "io_s16_fltp_mmap");
+    if ((io_stdio || io_mmap) && io_mb > 0) {
+        if (!write_io_input(io_in.c_str(), input_44100, channels, io_mb)) {
+            fprintf(stderr, "Could not write %s, skipping the io cases\n", io_in.c_str());
+        } else {
+            if (io_stdio)
+                results.push_back(measure("io_s16_fltp_stdio", rate, [&] {
+                    return run_stdio_io(io_in.c_str(), io_out.c_str(), channels);
+                }));
+            if (io_mmap)
+                results.push_back(measure("io_s16_fltp_mmap", rate, [&] {
+                    return run_mmap_io(io_in.c_str(), io_out.c_str(), channels);
+                }));
+        }
+        remove(io_in.c_str());
+        for (unsigned int c = 0; c < channels; c++)
+            remove((io_out + "." + std::to_string(c)).c_str());
+    }
+
+    /* Every resampler quality tier; the default tier keeps the unsuffixed names of earlier runs */
+    int other_rate = rate == 44100 ? 48000 : 44100;
+    for (int q = 0; q < RESAMPLER_QUALITY_COUNT; q++) {
+        ResamplerQuality quality = (ResamplerQuality) q;
+        std::string suffix = quality == RESAMPLER_DEFAULT ? "" : std::string("_") + resampler_quality_name(quality);
+
+        snprintf(name, sizeof(name), "resample_%u_%u%s", rate, other_rate, suffix.c_str());
+        if (selected(filter, name))
+            results.push_back(measure(name, rate, [&] {
+                return run_resampler(input_44100, channels, rate, other_rate, quality);
+            }));
+
+        if (!input_48000.empty() && rate_48000 == 48000) {
+            snprintf(name, sizeof(name), "resample_48000_44100%s", suffix.c_str());
+            if (selected(filter, name))
+                results.push_back(measure(name, 48000, [&] {
+                    return run_resampler(input_48000, channels, 48000, 44100, quality);
+                }));
+        }
+    }
+
+    static const char *codecs[] = { "aac", "libfdk_aac", "libmp3lame", "ac3", "eac3", "libvorbis", "libopus" };
+    static const int64_t bit_rates[] = { 64000, 128000, 192000, 256000 };
+    std::vector<std::vector<float> > planes = to_planar(input_44100, channels);
+    snprintf(name, sizeof(name), "meter_levels_%uch", channels);
+    if (selected(filter, name))
+        results.push_back(measure(name, rate, [&] { return run_meter(planes, rate); }));
+
+    for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++) {
+        for (size_t b = 0; b < sizeof(bit_rates) / sizeof(bit_rates[0]); b++) {
+            snprintf(name, sizeof(name), "encode_%s_%lldk", codecs[c], (long long) bit_rates[b] / 1000);
+            if (!selected(filter, name))
+                continue;
+            BenchmarkResult r = measure(name, rate, [&] {
+                return run_encoder(codecs[c], bit_rates[b], rate, channels, planes);
+            });
+            if (r.frames)
+                results.push_back(r);
+            else
+                printf("%-36s skipped (encoder unavailable or unsupported configuration)\n", name);
+        }
+    }
+
+    snprintf(name, sizeof(name), "pipeline_aac_192k");
+    if (selected(filter, name)) {
+        int pipeline_rate = 44100;
+        BenchmarkResult r = measure(name, 44100, [&] { return run_pipeline(source_spec, seconds, &pipeline_rate); });
+        r.audio_seconds = (double) r.frames / pipeline_rate;
+        if (r.frames)
+            results.push_back(r);
+    }
+
+    /* A failed case has no frames to divide by; it is reported here and left out of the JSON */
+    std::vector<BenchmarkResult> completed;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].frames) {
+            print_result(results[i]);
+            completed.push_back(results[i]);
+        } else
+            printf("%-36s failed\n", results[i].name.c_str());
+    }
+
+    if (json_path) {
+        FILE *out = fopen(json_path, "w");
+        if (!out) {
+            fprintf(stderr, "Could not open %s\n", json_path);
+            return -1;
+        }
+        write_json(out, completed);
+        fclose(out);
+    }
+    return mismatches ? 1 : 0;
+}
@@ -1,9 +1,13 @@
 #include "capture_and_encode.h"
 #include <chrono>
+#include <cmath>
 #include <memory>
 
 using namespace Napi;
 
+/* Packets of a live source that may wait for credits; past this they are dropped and counted */
+#define HELD_PACKETS 64
+
 Napi::FunctionReference LinuxSoundCapturer::constructor;
 
 Napi::Object InitAll(Napi::Env env, Napi::Object exports)
@@ -16,7 +20,17 @@ Napi::Object LinuxSoundCapturer::Init(Napi::Env env, Napi::Object exports)
     Napi::HandleScope scope(env);
     Napi::Function func = DefineClass(env, "LinuxSoundCapturer", {
         InstanceMethod("startListener", &LinuxSoundCapturer::StartListener),
-        InstanceMethod("stopListener",  &LinuxSoundCapturer::StopListener)
+        InstanceMethod("stopListener",  &LinuxSoundCapturer::StopListener),
+        InstanceMethod("getStats",      &LinuxSoundCapturer::GetStats),
+        InstanceMethod("subscribe",     &LinuxSoundCapturer::Subscribe),
+        InstanceMethod("unsubscribe",   &LinuxSoundCapturer::Unsubscribe),
+        InstanceMethod("requestPackets", &LinuxSoundCapturer::RequestPackets),
+        InstanceMethod("getLevels",     &LinuxSoundCapturer::GetLevels),
+        InstanceMethod("getSpectrum",   &LinuxSoundCapturer::GetSpectrum),
+        InstanceMethod("attachTap",     &LinuxSoundCapturer::AttachTap),
+        InstanceMethod("detachTap",     &LinuxSoundCapturer::DetachTap),
+        StaticMethod("prewarm",         &LinuxSoundCapturer::Prewarm),
+        StaticMethod("encoderPool",     &LinuxSoundCapturer::EncoderPool)
     }); 
     LinuxSoundCapturer::constructor = Napi::Persistent(func);
     LinuxSoundCapturer::constructor.SuppressDestruct();
@@ -27,477 +41,1905 @@ Napi::Object LinuxSoundCapturer::Init(Napi::Env env, Napi::Object exports)
 LinuxSoundCapturer::LinuxSoundCapturer(const Napi::CallbackInfo& info): ObjectWrap<LinuxSoundCapturer>(info)
 {
     isClosing = false;
+    state = IDLE;
+
+    // Capturing related: { source: "alsa:default" | "file:path" | "tone:440" | "noise", ... }
+    source_spec = "alsa";
+    period_seconds = 0;
+
+    // Encoding related: { output: "result.mp4" }, an empty string disables the file
+    output_file = "result.mp4";
+    encoder = NULL;
+
+    // Extra listeners, see subscribe()
+    has_listener = false;
+    next_subscriber_id = 1;
+
+    // Pull based delivery, see startListener()
+    flow_control = false;
+    credits = 0;
+    stream_format = "packets";
+    muxer = NULL;
+
+    // Silence gate, off unless the silence option is given
+    silence_mode = SILENCE_OFF;
+    silence_threshold_db = -60;
+    silence_hangover_ms = 300;
+    fused_conversion = false;
+
+    // Resampler quality: { resampler: "fast" | "default" | "high" | "auto" }
+    resampler_quality = RESAMPLER_DEFAULT;
+    resampler_auto = false;
+    resampler_tier = RESAMPLER_DEFAULT;
+    budget_periods = 0;
+    budget_overruns = 0;
+
+    // Level metering, see getLevels()
+    metering = false;
+
+    // Spectrum analysis, see getSpectrum()
+    analyzing = false;
+    spectrum_bands = 32;
+    spectrum_fft_size = 2048;
+    spectrum_rate = 30;
+
+    // Raw PCM tap, see attachTap()
+    tap_enabled = false;
+
+    // Pre-warmed pipelines: { warm: true } takes them from, and returns them to, the CapturePool
+    use_pool = false;
+    warm_start = false;
+    start_requested_ns = 0;
+
+    // Multichannel split, see parse_streams(); -1 encoder threads picks one per stream
+    encoder_threads = -1;
+    convert_input = NULL;
+
+    // Stage pipeline, off unless the pipeline option is given; -1 leaves a stage unpinned
+    pipelined = false;
+    pipeline_depth = 8;
+    for (int i = 0; i < STAGE_COUNT; i++)
+        pipeline_cpus[i] = -1;
+    pending_skip = 0;
+    frame_channels = 0;
+
+    // Shared encoder pool, see encoderPool()
+    shared_encoder = false;
+
+    if (info.Length() > 0 && info[0].IsObject()) {
+        Napi::Object options = info[0].As<Napi::Object>();
+        if (options.Has("source") && options.Get("source").IsString())
+            source_spec = options.Get("source").As<Napi::String>().Utf8Value();
+        if (options.Has("output") && options.Get("output").IsString())
+            output_file = options.Get("output").As<Napi::String>().Utf8Value();
+        if (options.Has("warm"))
+            use_pool = options.Get("warm").ToBoolean().Value();
+        if (options.Has("levels"))
+            metering = options.Get("levels").ToBoolean().Value();
+        if (options.Has("spectrum") && options.Get("spectrum").IsObject()) {
+            Napi::Object analysis = options.Get("spectrum").As<Napi::Object>();
+            analyzing = true;
+            if (analysis.Has("bands") && analysis.Get("bands").IsNumber())
+                spectrum_bands = analysis.Get("bands").As<Napi::Number>().Int32Value();
+            if (analysis.Has("fftSize") && analysis.Get("fftSize").IsNumber())
+                spectrum_fft_size = analysis.Get("fftSize").As<Napi::Number>().Int32Value();
+            if (analysis.Has("rate") && analysis.Get("rate").IsNumber())
+                spectrum_rate = analysis.Get("rate").As<Napi::Number>().DoubleValue();
+        }
+        if (options.Has("silence") && options.Get("silence").IsObject()) {
+            Napi::Object gate = options.Get("silence").As<Napi::Object>();
+            silence_mode = SILENCE_SKIP;
+            if (gate.Has("mode") && gate.Get("mode").IsString() &&
+                gate.Get("mode").As<Napi::String>().Utf8Value() == "zero")
+                silence_mode = SILENCE_ZERO;
+            if (gate.Has("thresholdDb") && gate.Get("thresholdDb").IsNumber())
+                silence_threshold_db = gate.Get("thresholdDb").As<Napi::Number>().DoubleValue();
+            if (gate.Has("hangoverMs") && gate.Get("hangoverMs").IsNumber())
+                silence_hangover_ms = gate.Get("hangoverMs").As<Napi::Number>().DoubleValue();
+        }
+        if (options.Has("resampler") && options.Get("resampler").IsString()) {
+            std::string tier = options.Get("resampler").As<Napi::String>().Utf8Value();
+            int quality = tier == "auto" ? RESAMPLER_HIGH : parse_resampler_quality(tier.c_str());
+            if (quality < 0) {
+                TypeError::New(info.Env(), "Unknown resampler quality: " + tier).ThrowAsJavaScriptException();
+                return;
+            }
+            resampler_quality = (ResamplerQuality) quality;
+            resampler_auto = tier == "auto";
+        }
+        if (options.Has("encoderThreads") && options.Get("encoderThreads").IsNumber())
+            encoder_threads = options.Get("encoderThreads").As<Napi::Number>().Int32Value();
+        if (options.Has("sharedEncoder"))
+            shared_encoder = options.Get("sharedEncoder").ToBoolean().Value();
+        if (options.Has("pipeline") && options.Get("pipeline").IsObject()) {
+            Napi::Object pipeline = options.Get("pipeline").As<Napi::Object>();
+            pipelined = true;
+            if (pipeline.Has("depth") && pipeline.Get("depth").IsNumber())
+                pipeline_depth = pipeline.Get("depth").As<Napi::Number>().Int32Value();
+            if (pipeline.Has("cpus") && pipeline.Get("cpus").IsArray()) {
+                Napi::Array cpus = pipeline.Get("cpus").As<Napi::Array>();
+                for (uint32_t i = 0; i < cpus.Length() && i < STAGE_COUNT; i++) {
+                    if (cpus.Get(i).IsNumber())
+                        pipeline_cpus[i] = cpus.Get(i).As<Napi::Number>().Int32Value();
+                }
+            }
+            if (pipeline_depth < 2)
+                pipeline_depth = 2;
+        } else if (options.Has("pipeline")) {
+            pipelined = options.Get("pipeline").ToBoolean().Value();
+        }
+        if (options.Has("streams") && options.Get("streams").IsArray() &&
+            !parse_streams(info.Env(), options.Get("streams").As<Napi::Array>()))
+            return;
+    }
 
-    // Encoding related
-    vid_codec_context = NULL;
-    aud_codec_context = NULL;
+    /* Metering, analysis, the silence gate and warm pipelines work on the single stereo mix only */
+    if (!stream_configs.empty()) {
+        metering = false;
+        analyzing = false;
+        silence_mode = SILENCE_OFF;
+        use_pool = false;
+    }
+}
 
-    // Resampling related
-    swr_ctx = NULL;
-    src_data = NULL;
-    dst_data = NULL;
+/*
+ * A capturer collected, or torn down with its environment, while it still captures stops first,
+ * since its threads use it. Subscriptions outlive sessions, so their tsfns are released only here.
+ */
+LinuxSoundCapturer::~LinuxSoundCapturer()
+{
+    if (state == RUNNING) {
+        close_pipeline();
+        state = IDLE;
+    }
+    release_subscribers();
 }
 
-int LinuxSoundCapturer::init_capturer(snd_pcm_t **handle, snd_pcm_uframes_t frames, char **buffer, int *size)
+/*
+ * streams: [{ channels: [2, 3], output }, { matrix: [[0.5, 0.5, 0, 0]], output }, ...] splits
+ * the capture into mono or stereo streams, each encoded on its own. channels picks inputs by
+ * index; matrix gives one row of input gains per output channel.
+ */
+bool LinuxSoundCapturer::parse_streams(Napi::Env env, Napi::Array options)
 {
-    int err, dir;
-    snd_pcm_hw_params_t *params;
-    char *device = (char*) "default";
+    for (uint32_t i = 0; i < options.Length(); i++) {
+        if (!options.Get(i).IsObject()) {
+            TypeError::New(env, "Each stream must be an object").ThrowAsJavaScriptException();
+            return false;
+        }
+        Napi::Object stream = options.Get(i).As<Napi::Object>();
+        StreamConfig config;
+
+        if (stream.Has("channels") && stream.Get("channels").IsArray()) {
+            Napi::Array channels = stream.Get("channels").As<Napi::Array>();
+            for (uint32_t c = 0; c < channels.Length(); c++) {
+                if (!channels.Get(c).IsNumber() || channels.Get(c).As<Napi::Number>().Int32Value() < 0) {
+                    TypeError::New(env, "Stream channels must be input channel numbers").ThrowAsJavaScriptException();
+                    return false;
+                }
+                config.channels.push_back(channels.Get(c).As<Napi::Number>().Int32Value());
+            }
+        } else if (stream.Has("matrix") && stream.Get("matrix").IsArray()) {
+            Napi::Array rows = stream.Get("matrix").As<Napi::Array>();
+            for (uint32_t r = 0; r < rows.Length(); r++) {
+                if (!rows.Get(r).IsArray()) {
+                    TypeError::New(env, "Stream matrix rows must be arrays of gains").ThrowAsJavaScriptException();
+                    return false;
+                }
+                Napi::Array gains = rows.Get(r).As<Napi::Array>();
+                std::vector<float> row;
+                for (uint32_t g = 0; g < gains.Length(); g++) {
+                    double gain = gains.Get(g).ToNumber().DoubleValue();
+                    if (!std::isfinite(gain)) {
+                        TypeError::New(env, "Stream matrix gains must be finite numbers").ThrowAsJavaScriptException();
+                        return false;
+                    }
+                    row.push_back(gain);
+                }
+                config.matrix.push_back(row);
+            }
+        }
 
-    // Settings
-    unsigned int sample_rate = 44100; // CD Quality
-    unsigned int bits_per_sample = 16; // As we are using S16_LE forma
-    unsigned int number_of_channels = 2; // stereo
-    uint32_t duration = 5000; // duration to record in milliseconds
+        size_t outputs = config.channels.size() + config.matrix.size();
+        if (outputs < 1 || outputs > 2) {
+            TypeError::New(env, "A stream has one or two channels").ThrowAsJavaScriptException();
+            return false;
+        }
+        if (stream.Has("output") && stream.Get("output").IsString())
+            config.output = stream.Get("output").As<Napi::String>().Utf8Value();
+        stream_configs.push_back(config);
+    }
+    return true;
+}
 
-    printf("Capture device is %s\n", device);
+int LinuxSoundCapturer::initialize_encoding_audio(const char *filename)
+{
+    int ret;
 
-    /* Open PCM device for recording (capture). */
-    err = snd_pcm_open(handle, device, SND_PCM_STREAM_CAPTURE, 0);
-    if (err) {
-        fprintf(stderr, "Unable to open PCM device: %s\n", snd_strerror(err));
-        return err;
+    /* A pre-warmed encoder is already open and only needs its container */
+    if (encoder)
+        ret = filename ? encoder->open_output(filename) : 0;
+    else {
+        encoder = new AudioEncoder();
+        ret = encoder->init(NULL, DEFAULT_AUD_BIT_RATE, DEFAULT_AUD_SAMPLE_RATE, AV_CH_LAYOUT_STEREO, filename);
     }
+    if (ret)
+        fprintf(stderr, "Could not initialize audio encoding: '%d'\n", ret);
+    return ret;
+}
 
-    /* Allocate a hardware parameters object. */
-    snd_pcm_hw_params_alloca(&params);
+/* Encodes a frame and writes its first packet to the file; next_audio_packet() writes and returns the rest */
+AVPacket* LinuxSoundCapturer::encode_audio_samples(uint8_t **aud_samples)
+{
+    AVPacket *pkt = encoder->encode(aud_samples);
+    if (pkt)
+        encoder->write(pkt);
+    return pkt;
+}
 
-    /* Fill it in with default values. */
-    snd_pcm_hw_params_any(*handle, params);
+AVPacket* LinuxSoundCapturer::next_audio_packet()
+{
+    AVPacket *pkt = encoder->receive();
+    if (pkt)
+        encoder->write(pkt);
+    return pkt;
+}
 
-    /* ### Set the desired hardware parameters. ### */
+int LinuxSoundCapturer::finish_audio_encoding()
+{
+    return encoder->finish();
+}
 
-    /* Interleaved mode */
-    err = snd_pcm_hw_params_set_access(*handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
-    if (err) {
-        fprintf(stderr, "Error setting interleaved mode: %s\n", snd_strerror(err));
-        snd_pcm_close(*handle);
-        return err;
+void LinuxSoundCapturer::cleanup()
+{
+    delete encoder;
+    encoder = NULL;
+}
+
+/*
+ * Opens the source and builds the resampler and encoder on a libuv worker thread,
+ * then starts the native processing thread back on the JS thread.
+ */
+class StartListenerWorker: public Napi::AsyncWorker
+{
+    public:
+        StartListenerWorker(Napi::Env env, LinuxSoundCapturer *capturer):
+            AsyncWorker(env, "LinuxSoundCapturerStart"), capturer(capturer), deferred(Promise::Deferred::New(env))
+        {
+            capturer->Ref();
+        }
+        ~StartListenerWorker() { capturer->Unref(); }
+
+        Napi::Promise GetPromise() { return deferred.Promise(); }
+
+    protected:
+        void Execute()
+        {
+            std::string error;
+            if (capturer->open_pipeline(&error))
+                SetError(error);
+        }
+
+        void OnOK()
+        {
+            capturer->start_processing();
+            deferred.Resolve(Env().Undefined());
+        }
+
+        void OnError(const Napi::Error& e)
+        {
+            capturer->abort_start();
+            deferred.Reject(e.Value());
+        }
+
+    private:
+        LinuxSoundCapturer *capturer;
+        Promise::Deferred deferred;
+};
+
+/*
+ * Stops the native thread and drains the encoder and container on a libuv worker thread.
+ */
+class StopListenerWorker: public Napi::AsyncWorker
+{
+    public:
+        StopListenerWorker(Napi::Env env, LinuxSoundCapturer *capturer):
+            AsyncWorker(env, "LinuxSoundCapturerStop"), capturer(capturer), deferred(Promise::Deferred::New(env))
+        {
+            capturer->Ref();
+        }
+        ~StopListenerWorker() { capturer->Unref(); }
+
+        Napi::Promise GetPromise() { return deferred.Promise(); }
+
+    protected:
+        void Execute() { capturer->close_pipeline(); }
+
+        void OnOK()
+        {
+            capturer->finish_stop();
+            deferred.Resolve(Env().Undefined());
+        }
+
+    private:
+        LinuxSoundCapturer *capturer;
+        Promise::Deferred deferred;
+};
+
+Napi::Value LinuxSoundCapturer::StartListener(const Napi::CallbackInfo& info)
+{
+    // Tsfn related
+    Napi::Env env = info.Env();
+    // The callback may be null when only subscribers receive the audio
+    if (info.Length() < 1 || !(info[0].IsFunction() || info[0].IsNull() || info[0].IsUndefined())) {
+        TypeError::New(env, "Expects a function type argument").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    if (state != IDLE) {
+        Error::New(env, "Listener is already started").ThrowAsJavaScriptException();
+        return env.Undefined();
     }
 
-    /* Signed capture format (16-bit little-endian format) */
-    if (bits_per_sample == 16) err = snd_pcm_hw_params_set_format(*handle, params, SND_PCM_FORMAT_S16_LE);
-    else err = snd_pcm_hw_params_set_format(*handle, params, SND_PCM_FORMAT_U8);
-    if (err) {
-        fprintf(stderr, "Error setting format: %s\n", snd_strerror(err));
-        snd_pcm_close(*handle);
-        return err;
+    /*
+     * startListener(callback[, { format, flowControl }]): format "adts" or "mp4" (fragmented)
+     * delivers muxed bytes instead of raw packets. With flowControl the native thread only
+     * hands over as many packets as requestPackets() granted and waits for more otherwise.
+     */
+    flow_control = false;
+    stream_format = "packets";
+    if (info.Length() > 1 && info[1].IsObject()) {
+        Napi::Object options = info[1].As<Napi::Object>();
+        if (options.Has("flowControl"))
+            flow_control = options.Get("flowControl").ToBoolean().Value();
+        if (options.Has("format") && options.Get("format").IsString())
+            stream_format = options.Get("format").As<Napi::String>().Utf8Value();
+        if (stream_format != "packets" && stream_format != "adts" && stream_format != "mp4") {
+            TypeError::New(env, "Unknown stream format: " + stream_format).ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        /* A pool worker cannot sit waiting for credits while other capturers' frames queue behind it */
+        if (flow_control && shared_encoder) {
+            TypeError::New(env, "flowControl cannot be combined with sharedEncoder").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        if (stream_format != "packets" && !stream_configs.empty()) {
+            TypeError::New(env, "Split streams are delivered as packets only").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
     }
+    credits = 0;
 
-    /* Setting number of channels */
-    err = snd_pcm_hw_params_set_channels(*handle, params, number_of_channels);
-    if (err) {
-        fprintf(stderr, "Error setting channels: %s\n", snd_strerror(err));
-        snd_pcm_close(*handle);
-        return err;
+    CaptureSource *source = create_mixing_capture_source(source_spec.c_str());
+    if (!source) {
+        Error::New(env, "Invalid capture source: " + source_spec).ThrowAsJavaScriptException();
+        return env.Undefined();
     }
+    input.reset(source);
+
+    has_listener = info[0].IsFunction();
+    if (has_listener)
+        tsfn = ThreadSafeFunction::New(env, info[0].As<Function>(), "LinuxSoundCapturerTsfn", 0, 1);
+
+    state = STARTING;
+    start_requested_ns = monotonic_ns();
+    StartListenerWorker *worker = new StartListenerWorker(env, this);
+    Napi::Promise promise = worker->GetPromise();
+    worker->Queue();
+    return promise;
+}
 
-    /* Setting sampling rate */
-    err = snd_pcm_hw_params_set_rate_near(*handle, params, &sample_rate, &dir);
-    if (err) {
-        fprintf(stderr, "Error setting sampling rate (%d): %s\n", sample_rate, snd_strerror(err));
-        snd_pcm_close(*handle);
-        return err;
+int LinuxSoundCapturer::open_pipeline(std::string *error)
+{
+    int err;
+
+    WarmPipeline *warm = use_pool ? CapturePool::instance().acquire(source_spec) : NULL;
+    warm_start = warm != NULL;
+    if (warm) {
+        err = input.adopt(warm->source, warm->frames);
+        encoder = warm->encoder;
+        /* The pool keeps default quality resamplers */
+        if (!err && resampler_quality == RESAMPLER_DEFAULT)
+            err = converter.adopt(warm->swr_ctx, input.source()->channels(), input.source()->sample_rate(),
+                                  DEFAULT_AUD_CHANNELS, DEFAULT_AUD_SAMPLE_RATE);
+        else
+            swr_free(&warm->swr_ctx);
+        delete warm;
+        if (err) {
+            *error = "Could not allocate capture buffer";
+            return err;
+        }
+    } else {
+        // Capturing related
+        err = input.open(1024);
+        if (err) {
+            *error = "Could not open capture source: " + source_spec;
+            return err;
+        }
     }
 
-    /* Set period size*/
-    err = snd_pcm_hw_params_set_period_size_near(*handle, params, &frames, &dir);
-    if (err) {
-        fprintf(stderr, "Error setting period size: %s\n", snd_strerror(err));
-        snd_pcm_close(*handle);
-        return err;
+    if (!stream_configs.empty()) {
+        period_seconds = (double) input.frames() / input.source()->sample_rate();
+        err = open_streams(error);
+        return err ? err : open_stages(error);
     }
 
-    /* Write the parameters to the driver */
-    err = snd_pcm_hw_params(*handle, params);
-    if (err < 0) {
-        fprintf(stderr, "Unable to set HW parameters: %s\n", snd_strerror(err));
-        snd_pcm_close(*handle);
+    // Resampling related
+    resampler_tier = resampler_quality;
+    budget_periods = 0;
+    budget_overruns = 0;
+    if (!warm_start || resampler_quality != RESAMPLER_DEFAULT)
+        err = converter.init(input.source()->channels(), input.source()->sample_rate(), DEFAULT_AUD_CHANNELS,
+                             DEFAULT_AUD_SAMPLE_RATE, resampler_quality);
+    if (!err)
+        err = converter.reserve(input.frames());
+    if (err) {
+        *error = "Could not initialize the resampler";
         return err;
     }
 
-    /* Use a buffer large enough to hold one period (Find number of frames in one period) */
-    err = snd_pcm_hw_params_get_period_size(params, &frames, &dir);
+    err = initialize_encoding_audio(output_file.empty() ? NULL : output_file.c_str());
     if (err) {
-        fprintf(stderr, "Error retrieving period size: %s\n", snd_strerror(err));
-        snd_pcm_close(*handle);
+        *error = "Could not initialize audio encoding";
         return err;
     }
-
-    /* Allocating buffer in number of bytes per period (2 bytes/sample, 2 channels) */
-    *size = frames * bits_per_sample / 8 * number_of_channels; 
-    *buffer = (char *) malloc(*size);
-    if (!buffer) {
-        fprintf(stdout, "Buffer error.\n");
-        snd_pcm_close(*handle);
+    if (assembler.init(DEFAULT_AUD_CHANNELS, encoder->frame_size())) {
+        *error = "Could not allocate the encoder frame";
         return -1;
     }
 
-    unsigned int period_time;
-    err = snd_pcm_hw_params_get_period_time(params, &period_time, &dir);
-    if (err) {
-        fprintf(stderr, "Error retrieving period time: %s\n", snd_strerror(err));
-        snd_pcm_close(*handle);
-        free(buffer);
-        return err;
+    if (stream_format != "packets") {
+        muxer = new StreamMuxer();
+        err = muxer->init(stream_format.c_str(), encoder->codec_context);
+        if (err) {
+            *error = "Could not initialize the " + stream_format + " muxer";
+            return err;
+        }
     }
 
-    //unsigned int bytes_per_frame = bits_per_sample / 8 * number_of_channels;
-    //uint32_t pcm_data_size = period_time * bytes_per_frame * duration / 1000;
+    if (metering)
+        meter.init(DEFAULT_AUD_SAMPLE_RATE, DEFAULT_AUD_CHANNELS);
+    if (analyzing) {
+        int err = spectrum.init(DEFAULT_AUD_SAMPLE_RATE, spectrum_fft_size, spectrum_bands, spectrum_rate);
+        if (err == -EINVAL) {
+            *error = "Invalid spectrum options, fftSize must be a power of two";
+            return -1;
+        } else if (err) {
+            *error = "Could not set up the spectrum FFT";
+            return -1;
+        }
+    }
+    fused_conversion = !converter.resampling();
+    silence.configure(silence_mode, silence_threshold_db, silence_hangover_ms * input.source()->sample_rate() / 1000);
 
-    printf("Sample rate: %d Hz\n", sample_rate);
-    printf("Channels: %d\n", number_of_channels);
-    printf("Duration: %d millisecs\n", duration);
-    printf("Number of frames: %lu", frames);
-    return 0;
+    period_seconds = (double) input.frames() / input.source()->sample_rate();
+    return open_stages(error);
 }
 
-void LinuxSoundCapturer::close_capturer(snd_pcm_t **handle, char** buffer)
+/*
+ * Converts the period in data, meters it and runs the silence gate over it. The gate takes its
+ * level from the conversion pass when no resampling is needed, and from the meter when there
+ * is one. Only when nothing else wants the converted samples, in skip mode without metering,
+ * does it read the S16 input first and let silent periods bypass the resampler. In zero mode
+ * a closed gate does the same and hands out zeroed planes. Returns the number of converted
+ * frames, in *planes, or a negative error.
+ */
+int LinuxSoundCapturer::convert_period(const char *data, long nb_frames, bool *silent, float ***planes)
 {
-    //snd_pcm_drain(*handle);
-    snd_pcm_drop(*handle);
-    snd_pcm_close(*handle);
-    free(*buffer);
+    SignalLevel level;
+    SignalLevel *measure = silence.enabled() && (fused_conversion || !metering) ? &level : NULL;
+    bool gated = !silence.enabled();
+
+    *silent = false;
+    *planes = converter.planes();
+    if ((!fused_conversion && silence.gate_mode() == SILENCE_SKIP && !metering) ||
+        (silence.gate_mode() == SILENCE_ZERO && silence.closed())) {
+        measure_s16((const int16_t *) data, nb_frames * input.source()->channels(), &level);
+        *silent = silence.update(level, nb_frames);
+        if (*silent && silence.gate_mode() == SILENCE_SKIP)
+            return bypass_resampler(nb_frames);
+        if (*silent) {
+            /* The resampler only holds the quiet samples that closed the gate; they become zeros too */
+            int frames = bypass_resampler(nb_frames);
+            if (zero_samples.size() < (size_t) frames)
+                zero_samples.assign(frames, 0.0f);
+            for (int c = 0; c < DEFAULT_AUD_CHANNELS; c++)
+                zero_planes[c] = zero_samples.data();
+            *planes = zero_planes;
+            if (metering)
+                meter.process((const float * const *) zero_planes, frames);
+            return frames;
+        }
+        gated = true;
+        measure = NULL;
+    }
+    int converted = converter.convert(data, nb_frames, measure);
+    if (converted < 0)
+        return converted;
+
+    if (metering) {
+        meter.process((const float * const *) converter.planes(), converted);
+        if (!fused_conversion)
+            level.peak = meter.period_peak();
+    }
+    if (!gated)
+        *silent = silence.update(level, nb_frames);
+
+    /* The period that closes the gate; the ones after it skip the conversion above */
+    if (*silent && silence.gate_mode() == SILENCE_ZERO) {
+        for (int c = 0; c < DEFAULT_AUD_CHANNELS; c++)
+            memset(converter.planes()[c], 0, converted * sizeof(float));
+    }
+    return converted;
 }
 
-int LinuxSoundCapturer::init_resampler(struct SwrContext **swr_ctx, 
-                    int *src_nb_samples, uint8_t ***src_data,
-                    int *dst_nb_samples, uint8_t ***dst_data)
+/*
+ * A silent period that does not go through the resampler. What the resampler still holds came
+ * before the silence and would otherwise be mixed into the first period after it, so it is
+ * dropped, and skipped along with the period to keep the timestamps exact.
+ */
+int LinuxSoundCapturer::bypass_resampler(long nb_frames)
 {
-    int64_t src_ch_layout = AV_CH_LAYOUT_STEREO;
-    int src_rate = 44100;
-    enum AVSampleFormat src_sample_fmt = AV_SAMPLE_FMT_S16;
-    
-    int64_t dst_ch_layout = AV_CH_LAYOUT_STEREO;
-    int dst_rate = 44100;
-    enum AVSampleFormat dst_sample_fmt = AV_SAMPLE_FMT_FLTP;
+    int64_t held = converter.reset();
+    return av_rescale(nb_frames, DEFAULT_AUD_SAMPLE_RATE, input.source()->sample_rate()) + held;
+}
 
-    int ret;
+/*
+ * Builds one remix row per output channel of every stream and an encoder per stream at the
+ * capture rate. Encoders run on encoder_pool; the processing thread takes one of them itself.
+ * The streams share a codec, so their frame assemblers fill in step.
+ */
+int LinuxSoundCapturer::open_streams(std::string *error)
+{
+    int inputs = input.source()->channels();
+    std::vector<std::vector<float> > matrix;
+
+    for (size_t s = 0; s < stream_configs.size(); s++) {
+        const StreamConfig &config = stream_configs[s];
+        for (size_t c = 0; c < config.channels.size(); c++) {
+            if (config.channels[c] >= inputs) {
+                *error = "Stream channel " + std::to_string(config.channels[c]) + " is not captured, the source has " +
+                    std::to_string(inputs) + " channels";
+                return -1;
+            }
+            std::vector<float> row(inputs, 0.0f);
+            row[config.channels[c]] = 1.0f;
+            matrix.push_back(row);
+        }
+        for (size_t r = 0; r < config.matrix.size(); r++)
+            matrix.push_back(config.matrix[r]);
+    }
+    if (remix.init(inputs, matrix)) {
+        *error = "Stream matrix rows need one gain per input channel (" + std::to_string(inputs) + ")";
+        return -1;
+    }
 
-    int src_nb_channels = 0;
-    int src_linesize;
+    convert_input = find_converter(SAMPLE_S16, LAYOUT_PLANAR, inputs);
+    for (int c = 0; c < inputs; c++)
+        input_planes.push_back((float *) av_malloc(input.frames() * sizeof(float)));
+
+    for (size_t s = 0; s < stream_configs.size(); s++) {
+        LogicalStream *stream = new LogicalStream();
+        stream->channels = stream_configs[s].channels.size() + stream_configs[s].matrix.size();
+        stream->encoder = new AudioEncoder();
+
+        const char *filename = stream_configs[s].output.empty() ? NULL : stream_configs[s].output.c_str();
+        int err = stream->encoder->init(NULL, DEFAULT_AUD_BIT_RATE / DEFAULT_AUD_CHANNELS * stream->channels,
+                                        input.source()->sample_rate(), stream->channels == 1 ? AV_CH_LAYOUT_MONO : AV_CH_LAYOUT_STEREO,
+                                        filename);
+        if (err) {
+            delete stream->encoder;
+            delete stream;
+            *error = "Could not initialize audio encoding for stream " + std::to_string(s);
+            return err;
+        }
+        streams.push_back(stream);
+        for (int c = 0; c < stream->channels; c++)
+            stream->planes[c] = (float *) av_mallocz(input.frames() * sizeof(float));
+        if (stream->assembler.init(stream->channels, stream->encoder->frame_size())) {
+            *error = "Could not allocate the frames of stream " + std::to_string(s);
+            return -1;
+        }
+        if (stream->encoder->frame_size() != streams[0]->encoder->frame_size()) {
+            *error = "Every stream must encode the same frame size";
+            return -1;
+        }
+    }
 
-    //int max_dst_nb_samples;
-    int dst_nb_channels = 0;
-    int dst_linesize;
+    int threads = encoder_threads;
+    if (threads < 0) {
+        int cores = std::thread::hardware_concurrency();
+        threads = (int) streams.size() < cores ? streams.size() : cores;
+        threads--;
+    }
+    encoder_pool.start(threads > 0 && !shared_encoder ? threads : 0);
+    return 0;
+}
 
-    /* create resampler context */
-    *swr_ctx = swr_alloc();
-    if (!*swr_ctx) {
-        fprintf(stderr, "Could not allocate resampler context\n");
-        return -1;
+/* Split streams: emits the whole frames the assemblers hold, one frame of every stream at a time */
+void LinuxSoundCapturer::emit_stream_frames(int64_t captured_ns)
+{
+    std::vector<float *> planes;
+    int frame_size = streams[0]->assembler.frame_size();
+
+    while (streams[0]->assembler.pending() >= frame_size) {
+        planes.clear();
+        for (LogicalStream *stream: streams) {
+            stream->assembler.next();
+            planes.insert(planes.end(), stream->assembler.frame(), stream->assembler.frame() + stream->channels);
+        }
+        emit_frame(planes.data(), frame_size, captured_ns);
     }
+}
 
-    /* set options */
-    av_opt_set_int(*swr_ctx, "in_channel_layout",    src_ch_layout, 0);
-    av_opt_set_int(*swr_ctx, "in_sample_rate",       src_rate, 0);
-    av_opt_set_sample_fmt(*swr_ctx, "in_sample_fmt", src_sample_fmt, 0);
+/*
+ * frames of encoder input are lost or gated away after what the assemblers hold. The partial
+ * frames queued are completed with silence standing in for the start of the gap, so they are
+ * still encoded, and the encoders skip the rest; the timestamps stay exact.
+ */
+void LinuxSoundCapturer::bridge_gap(int64_t frames, int64_t captured_ns)
+{
+    const FrameAssembler &first = streams.empty() ? assembler : streams[0]->assembler;
+    int64_t fill = first.pending() ? first.frame_size() - first.pending() : 0;
+    if (fill > frames)
+        fill = frames;
+
+    if (streams.empty()) {
+        assembler.write_silence(fill);
+        while (assembler.next())
+            emit_frame(assembler.frame(), assembler.frame_size(), captured_ns);
+    } else {
+        for (LogicalStream *stream: streams)
+            stream->assembler.write_silence(fill);
+        emit_stream_frames(captured_ns);
+    }
+    if (frames > fill)
+        emit_skip(frames - fill);
+}
 
-    av_opt_set_int(*swr_ctx, "out_channel_layout",    dst_ch_layout, 0);
-    av_opt_set_int(*swr_ctx, "out_sample_rate",       dst_rate, 0);
-    av_opt_set_sample_fmt(*swr_ctx, "out_sample_fmt", dst_sample_fmt, 0);
+/*
+ * Encodes one frame of every logical stream in parallel and dispatches the packets in stream
+ * order. planes holds the stream channels one after the other, as remix wrote them.
+ */
+void LinuxSoundCapturer::encode_streams(float **planes, int64_t captured_ns)
+{
+    encode_tasks.clear();
+    for (size_t s = 0; s < streams.size(); s++) {
+        LogicalStream *stream = streams[s];
+        encode_tasks.push_back([stream, planes] {
+            AVPacket *pkt = stream->encoder->encode((uint8_t **) planes);
+            for (; pkt; pkt = stream->encoder->receive()) {
+                stream->encoder->write(pkt);
+                stream->pkts.push_back(pkt);
+            }
+        });
+        planes += stream->channels;
+    }
+    encoder_pool.run(encode_tasks);
 
-    /* initialize the resampling context */
-    if ((ret = swr_init(*swr_ctx)) < 0) {
-        fprintf(stderr, "Failed to initialize the resampling context\n");
-        return -1;
+    for (size_t s = 0; s < streams.size(); s++) {
+        for (AVPacket *pkt: streams[s]->pkts) {
+            publish(pkt, s);
+            dispatch(pkt, captured_ns, s);
+        }
+        streams[s]->pkts.clear();
     }
+}
 
-    /* allocate source and destination samples buffers 
-        - For S16, 2 channels 16 bits per sample. So, each sample takes 4 bytes.
-        - Linesize is the total bytes allocated in multiples of 128. 
-        - Based on src_nb_samples, src_linesize is decided and space allocated in src_data
-    */
+void LinuxSoundCapturer::close_streams()
+{
+    encoder_pool.stop();
+    for (size_t s = 0; s < streams.size(); s++) {
+        LogicalStream *stream = streams[s];
+        delete stream->encoder;
+        for (int c = 0; c < stream->channels; c++)
+            av_free(stream->planes[c]);
+        delete stream;
+    }
+    streams.clear();
+    for (size_t c = 0; c < input_planes.size(); c++)
+        av_free(input_planes[c]);
+    input_planes.clear();
+}
 
-    src_nb_channels = av_get_channel_layout_nb_channels(src_ch_layout);
-    ret = av_samples_alloc_array_and_samples(src_data, &src_linesize, src_nb_channels,
-                                             *src_nb_samples, src_sample_fmt, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate source samples\n");
-        return -1;
+/*
+ * Native thread, { resampler: "auto" }: steps down one quality tier when 4 of the last 16
+ * periods spent more than 3/4 of their duration converting and encoding. What the old resampler
+ * still held is drained and assembled ahead of the next period, so the switch neither clicks
+ * nor moves the timestamps.
+ */
+void LinuxSoundCapturer::adapt_resampler(int64_t stage_ns, int64_t period_ns, int64_t captured_ns)
+{
+    int tier = resampler_tier.load(std::memory_order_relaxed);
+    if (tier == RESAMPLER_FAST)
+        return;
+
+    budget_periods++;
+    if (stage_ns * 4 > period_ns * 3)
+        budget_overruns++;
+    if (budget_periods < 16)
+        return;
+    bool behind = budget_overruns >= 4;
+    budget_periods = 0;
+    budget_overruns = 0;
+    if (!behind)
+        return;
+
+    ResamplerQuality cheaper = (ResamplerQuality) (tier - 1);
+    int drained = converter.set_quality(cheaper);
+    if (drained < 0)
+        return;
+    assemble(converter.planes(), drained, captured_ns);
+    resampler_tier.store(cheaper, std::memory_order_relaxed);
+    stats.resampler_downgrades.fetch_add(1, std::memory_order_relaxed);
+    fprintf(stderr, "Encoding is falling behind, resampling with the %s tier\n", resampler_quality_name(cheaper));
+}
+
+void LinuxSoundCapturer::start_processing()
+{
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        for (auto &subscriber : subscribers)
+            subscriber->tsfn.Ref(Env());
     }
 
-    printf("Line size : %d\n", src_linesize);
+    stats.reset();
+    if (pipelined) {
+        stage_metrics[STAGE_CAPTURE].reset("capture", pipeline_cpus[STAGE_CAPTURE], 0);
+        stage_metrics[STAGE_CONVERT].reset("convert", pipeline_cpus[STAGE_CONVERT], captured_periods->capacity());
+        stage_metrics[STAGE_ENCODE].reset("encode", pipeline_cpus[STAGE_ENCODE], converted_frames->capacity());
+    }
+    if (analyzing)
+        spectrum.start();
+    if (tap.attached() && tap.format() == PCM_TAP_FLTP && !streams.empty()) {
+        fprintf(stderr, "Split streams only feed an s16 PCM tap, not writing to it\n");
+        tap_enabled = false;
+    } else if (tap.attached()) {
+        int err = tap.format() == PCM_TAP_FLTP ?
+            tap.start(DEFAULT_AUD_CHANNELS, DEFAULT_AUD_SAMPLE_RATE, converter.max_output(input.frames())) :
+            tap.start(input.source()->channels(), input.source()->sample_rate(), input.frames());
+        if (err)
+            fprintf(stderr, "PCM tap is too small for a period, not writing to it\n");
+        tap_enabled = !err;
+    }
+    isClosing = false;
+    state = RUNNING;
+
+    /*
+     * Under flow control a live source cannot wait for credits without overrunning, so when the
+     * capture thread would deliver, the packets wait on a thread of their own. The pipeline's
+     * encode stage can wait itself; file and generator sources simply pause.
+     */
+    if (flow_control && has_listener && !pipelined && input.source()->live()) {
+        held_packets.reset(new SpscQueue<EncodedPacket *>(HELD_PACKETS));
+        delivery_thread = std::thread(&LinuxSoundCapturer::deliver_held, this);
+    }
 
-    /* compute the number of converted samples: buffering is avoided
-     * ensuring that the output buffer will contain at least all the
-     * converted input samples */
-    //max_dst_nb_samples = *dst_nb_samples =
-    *dst_nb_samples = av_rescale_rnd(*src_nb_samples, dst_rate, src_rate, AV_ROUND_UP);
+    // Thread for doing continuous processing
+    nativeThread = std::thread(&LinuxSoundCapturer::process, this);
+}
 
-    printf("Number of samples in dest: %d\n", *dst_nb_samples);
+void LinuxSoundCapturer::abort_start()
+{
+    if (has_listener)
+        tsfn.Release();
+    release_pipeline();
+    state = IDLE;
+}
 
-    /* buffer is going to be directly written to a rawaudio file, no alignment */
-    dst_nb_channels = av_get_channel_layout_nb_channels(dst_ch_layout);
-    ret = av_samples_alloc_array_and_samples(dst_data, &dst_linesize, dst_nb_channels,
-                                             *dst_nb_samples, dst_sample_fmt, 0);
-    return 0;
+void LinuxSoundCapturer::process()
+{
+    if (pipelined)
+        capture_stage();
+    else
+        run_serial();
+    for (PooledEncoder *lane: lanes)
+        SharedEncoderPool::instance().wait(lane->stream);
+    flush_encoders();
+
+    if (!isClosing)
+        publish(NULL, -1);
+    if (delivery_thread.joinable()) {
+        /* It delivers what is held as credits allow, then the end of input event */
+        held_packets->close();
+        delivery_thread.join();
+    } else if (!isClosing) {
+        dispatch(NULL, monotonic_ns(), -1);
+    }
+    if (has_listener && napi_ok != tsfn.Release())
+        fprintf(stderr, "error releasing tsfn for linux audio capturer");
 }
 
-int LinuxSoundCapturer::initialize_encoding_audio(const char *filename)
+/* Native thread: reads, converts, encodes and delivers every period in turn */
+void LinuxSoundCapturer::run_serial()
 {
-    int ret;
-    enum AVCodecID aud_codec_id = AV_CODEC_ID_AAC;
-    enum AVSampleFormat sample_fmt = AV_SAMPLE_FMT_FLTP;
+    int err;
 
-    //avcodec_register_all();
-    //av_register_all();
+    int64_t thread_cpu_start = thread_cpu_ns();
+    int64_t period_ns = period_seconds * 1e9;
 
-    AVCodec *aud_codec;
-    aud_codec = avcodec_find_encoder(aud_codec_id);
-    //avcodec_register(aud_codec);
+    while(!isClosing) {
+        err = input.read();
+        int64_t captured_ns = monotonic_ns();
+        if (err == 0 && input.source()->at_end())
+            break;
+        if (err <= 0) {
+            fprintf(stderr, "Error occured while recording: '%s'\n", strerror(-err));
+            stats.overruns.fetch_add(1, std::memory_order_relaxed);
+            stats.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+            input.source()->recover(err);
+        } else {
+            stats.periods.fetch_add(1, std::memory_order_relaxed);
+            if (tap_enabled && tap.format() == PCM_TAP_S16)
+                tap.write_s16((const int16_t *) input.buffer(), err);
+            handle_period(input.buffer(), err, captured_ns, captured_ns);
+
+            /* With the shared encoder the pool jobs record processing, from capture to encoded */
+            int64_t processing_ns = monotonic_ns() - captured_ns;
+            if (!shared_encoder)
+                stats.processing.record(processing_ns / 1000);
+            if (processing_ns > period_ns)
+                stats.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+        }
+        stats.cpu_ns.store(thread_cpu_ns() - thread_cpu_start, std::memory_order_relaxed);
+    }
+}
 
-    if (!aud_codec)
-        return COULD_NOT_FIND_AUD_CODEC;
+/*
+ * Converts one captured period and assembles codec frames from it, which emit_frame() encodes
+ * right away or queues for the encode stage. started_ns is when work on the period began, the
+ * start of the resampler's time budget.
+ */
+void LinuxSoundCapturer::handle_period(const char *data, long nb_frames, int64_t captured_ns, int64_t started_ns)
+{
+    if (!streams.empty()) {
+        /* Split streams encode at the capture rate; a period is rarely one codec frame either */
+        std::vector<float *> outputs;
+        for (size_t s = 0; s < streams.size(); s++) {
+            for (int c = 0; c < streams[s]->channels; c++)
+                outputs.push_back(streams[s]->planes[c]);
+        }
+        convert_input((const uint8_t *) data, input_planes.data(), nb_frames, input.source()->channels());
+        remix.process(input_planes.data(), outputs.data(), nb_frames);
+        for (LogicalStream *stream: streams)
+            stream->assembler.write(stream->planes, nb_frames);
+        emit_stream_frames(captured_ns);
+        return;
+    }
 
-    aud_codec_context = avcodec_alloc_context3(aud_codec);
-    if (!aud_codec_context)
-        return CONTEXT_CREATION_ERROR;
+    bool silent = false;
+    float **planes;
+    int ret = convert_period(data, nb_frames, &silent, &planes);
+    if (silent) {
+        stats.silent_periods.fetch_add(1, std::memory_order_relaxed);
+        if (ret > 0)
+            stats.silent_frames.fetch_add(ret, std::memory_order_relaxed);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Error while converting: '%d'\n", ret);
+    } else if (silent && silence.gate_mode() == SILENCE_SKIP) {
+        /* Samples still queued are the gate's hangover tail; they are encoded before the skip */
+        bridge_gap(ret, captured_ns);
+    } else {
+        assemble(planes, ret, captured_ns);
+        if (resampler_auto && !fused_conversion)
+            adapt_resampler(monotonic_ns() - started_ns, period_seconds * 1e9, captured_ns);
+    }
+}
 
-    aud_codec_context->bit_rate = 192000;
-    aud_codec_context->sample_rate = 44100;
-    printf("Sample rate selected : %d\n", aud_codec_context->sample_rate);
-    aud_codec_context->sample_fmt = sample_fmt;
-    aud_codec_context->channel_layout = AV_CH_LAYOUT_STEREO;
-    aud_codec_context->channels = av_get_channel_layout_nb_channels(aud_codec_context->channel_layout);
+/* Hands converted stereo to the analyzer and the tap and emits the codec frames it completes */
+void LinuxSoundCapturer::assemble(float **planes, int frames, int64_t captured_ns)
+{
+    if (frames <= 0)
+        return;
+    if (analyzing)
+        spectrum.push((const float * const *) planes, DEFAULT_AUD_CHANNELS, frames);
+    if (tap_enabled && tap.format() == PCM_TAP_FLTP)
+        tap.write_fltp((const float * const *) planes, frames);
+    /* A resampled period is rarely one codec frame, so it can make zero or two of them */
+    assembler.write(planes, frames);
+    while (assembler.next())
+        emit_frame(assembler.frame(), assembler.frame_size(), captured_ns);
+}
 
-    aud_codec_context->codec = aud_codec;
-    aud_codec_context->codec_id = aud_codec_id;
+/*
+ * A codec frame is ready: encode it now, queue a copy for the encode stage when pipelined, or
+ * submit a copy per encoder to the shared encoder pool.
+ */
+void LinuxSoundCapturer::emit_frame(float **planes, int frames, int64_t captured_ns)
+{
+    if (shared_encoder) {
+        for (size_t i = 0; i < lanes.size(); i++) {
+            submit_frame(i, planes, frames, captured_ns);
+            planes += lanes[i]->channels;
+        }
+        return;
+    }
+    if (!pipelined) {
+        encode_frame(planes, captured_ns);
+        return;
+    }
 
-    ret = avcodec_open2(aud_codec_context, aud_codec, NULL);
+    /* Every queued frame comes out of free_frames, so finding it empty means the queue is full */
+    PipelineFrame *frame;
+    if (!free_frames->pop(&frame)) {
+        pending_skip += frames;
+        stage_metrics[STAGE_CONVERT].dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    for (int c = 0; c < frame_channels; c++)
+        memcpy(frame->planes[c], planes[c], frames * sizeof(float));
+    frame->captured_ns = captured_ns;
+    frame->skip = pending_skip;
+    pending_skip = 0;
+    converted_frames->push(frame);
+}
 
-    if (ret < 0)
-        return COULD_NOT_OPEN_AUD_CODEC;
+/* frames are not going to be encoded; the encoder moves its timestamps past them */
+void LinuxSoundCapturer::emit_skip(int64_t frames)
+{
+    if (shared_encoder) {
+        for (PooledEncoder *lane: lanes)
+            lane->pending_skip += frames;
+    } else if (pipelined)
+        pending_skip += frames;
+    else
+        encoder->skip(frames);
+}
 
-    outctx = avformat_alloc_context();
-    ret = avformat_alloc_output_context2(&outctx, NULL, "mp4", filename);
+/* Encodes one frame, of the stereo mix or of every split stream, and delivers the packets */
+void LinuxSoundCapturer::encode_frame(float **planes, int64_t captured_ns)
+{
+    if (!streams.empty()) {
+        encode_streams(planes, captured_ns);
+        return;
+    }
 
-    outctx->audio_codec = aud_codec;
-    outctx->audio_codec_id = aud_codec_id;
+    /* Some codecs make several packets of one frame */
+    AVPacket* pkt = encode_audio_samples((uint8_t **) planes);
+    for (; pkt; pkt = next_audio_packet())
+        deliver(pkt, captured_ns);
+}
 
-    audio_st = avformat_new_stream(outctx, aud_codec);
+/* Hands a packet of the stereo mix, muxed when a stream format was asked for, to subscribers and the listener */
+void LinuxSoundCapturer::deliver(AVPacket *pkt, int64_t captured_ns)
+{
+    AVPacket *out = pkt;
+    if (muxer) {
+        AVRational time_base = encoder->audio_st ? encoder->audio_st->time_base : encoder->codec_context->time_base;
+        out = muxer->mux(pkt, time_base);
+        av_packet_free(&pkt);
+    }
+    if (out) {
+        publish(out, -1);
+        dispatch(out, captured_ns, -1);
+    }
+}
 
-    audio_st->codecpar->bit_rate = aud_codec_context->bit_rate;
-    audio_st->codecpar->sample_rate = aud_codec_context->sample_rate;
-    audio_st->codecpar->channels = aud_codec_context->channels;
-    audio_st->codecpar->channel_layout = aud_codec_context->channel_layout;
-    audio_st->codecpar->codec_id = aud_codec_id;
-    audio_st->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
-    audio_st->codecpar->format = sample_fmt;
-    audio_st->codecpar->frame_size = aud_codec_context->frame_size;
-    audio_st->codecpar->block_align = aud_codec_context->block_align;
-    audio_st->codecpar->initial_padding = aud_codec_context->initial_padding;
+/*
+ * Native thread, once the input is done and every stage has returned: encodes the last partial
+ * frame, padded with silence, drains the encoders and delivers all of it, with the muxer's
+ * trailer, ahead of the end event. close_pipeline() then only writes the files' trailers.
+ */
+void LinuxSoundCapturer::flush_encoders()
+{
+    int64_t now = monotonic_ns();
 
-    // outctx->streams = new AVStream*[1];
-    // outctx->streams[0] = audio_st;
+    /* Frames dropped at the very end still move the timestamps */
+    for (size_t i = 0; i < lanes.size(); i++) {
+        if (lanes[i]->pending_skip)
+            (streams.empty() ? encoder : streams[i]->encoder)->skip(lanes[i]->pending_skip);
+        lanes[i]->pending_skip = 0;
+    }
+    if (pipelined && pending_skip && !shared_encoder) {
+        if (streams.empty())
+            encoder->skip(pending_skip);
+        for (LogicalStream *stream: streams)
+            stream->encoder->skip(pending_skip);
+    }
+    pending_skip = 0;
+
+    if (streams.empty()) {
+        if (assembler.flush())
+            encode_frame(assembler.frame(), now);
+        AVPacket *pkt;
+        while ((pkt = encoder->drain())) {
+            encoder->write(pkt);
+            deliver(pkt, now);
+        }
+        AVPacket *tail = muxer ? muxer->finish() : NULL;
+        if (tail) {
+            publish(tail, -1);
+            dispatch(tail, now, -1);
+        }
+        return;
+    }
 
-    av_dump_format(outctx, 0, filename, 1);
+    for (size_t s = 0; s < streams.size(); s++) {
+        LogicalStream *stream = streams[s];
+        AVPacket *pkt = stream->assembler.flush() ? stream->encoder->encode((uint8_t **) stream->assembler.frame()) : NULL;
+        for (; pkt; pkt = stream->encoder->receive()) {
+            stream->encoder->write(pkt);
+            publish(pkt, s);
+            dispatch(pkt, now, s);
+        }
+        while ((pkt = stream->encoder->drain())) {
+            stream->encoder->write(pkt);
+            publish(pkt, s);
+            dispatch(pkt, now, s);
+        }
+    }
+}
 
-    if (!(outctx->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&outctx->pb, filename, AVIO_FLAG_WRITE) < 0)
-            return COULD_NOT_OPEN_FILE;
+/* Shared encoder: copies one encoder's channels into a free frame of its lane and queues a job for it */
+void LinuxSoundCapturer::submit_frame(int index, float **planes, int frames, int64_t captured_ns)
+{
+    PooledEncoder *lane = lanes[index];
+    PipelineFrame *frame;
+    if (!lane->free_frames->pop(&frame)) {
+        lane->pending_skip += frames;
+        lane->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
     }
+    for (int c = 0; c < lane->channels; c++)
+        memcpy(frame->planes[c], planes[c], frames * sizeof(float));
+    frame->captured_ns = captured_ns;
+    frame->skip = lane->pending_skip;
+    lane->pending_skip = 0;
+
+    /* Missing the deadline means the pool cannot keep up with this capture in real time */
+    SharedEncoderPool::instance().submit(lane->stream, [this, index, frame] { encode_pooled(index, frame); },
+                                         captured_ns + (int64_t) (period_seconds * 1e9));
+}
+
+/* Pool worker: encodes and delivers one frame of a lane; the pool never runs two of a lane at once */
+void LinuxSoundCapturer::encode_pooled(int index, PipelineFrame *frame)
+{
+    if (streams.empty()) {
+        if (frame->skip)
+            encoder->skip(frame->skip);
+        encode_frame(frame->planes.data(), frame->captured_ns);
+    } else {
+        LogicalStream *stream = streams[index];
+        if (frame->skip)
+            stream->encoder->skip(frame->skip);
+        AVPacket *pkt = stream->encoder->encode((uint8_t **) frame->planes.data());
+        for (; pkt; pkt = stream->encoder->receive()) {
+            stream->encoder->write(pkt);
+            publish(pkt, index);
+            dispatch(pkt, frame->captured_ns, index);
+        }
+    }
+    stats.processing.record((monotonic_ns() - frame->captured_ns) / 1000);
+    lanes[index]->free_frames->push(frame);
+}
 
-    ret = avformat_write_header(outctx, NULL);
+/* Fills pool with as many frames of planar float as free holds and queues them all on it */
+static int allocate_frames(std::vector<PipelineFrame> &pool, SpscQueue<PipelineFrame *> *free_queue,
+                           int channels, int plane_size)
+{
+    pool.assign(free_queue->capacity(), PipelineFrame());
+    for (PipelineFrame &frame: pool) {
+        for (int c = 0; c < channels; c++) {
+            float *plane = (float *) av_mallocz(plane_size * sizeof(float));
+            if (!plane)
+                return -1;
+            frame.planes.push_back(plane);
+        }
+        free_queue->push(&frame);
+    }
+    return 0;
+}
 
-    aud_frame = av_frame_alloc();
-    aud_frame->nb_samples = aud_codec_context->frame_size;
-    aud_frame->format = aud_codec_context->sample_fmt;
-    aud_frame->channel_layout = aud_codec_context->channel_layout;
+static void free_frames_of(std::vector<PipelineFrame> &pool)
+{
+    for (PipelineFrame &frame: pool) {
+        for (float *plane: frame.planes)
+            av_free(plane);
+    }
+    pool.clear();
+}
 
-    int buffer_size = av_samples_get_buffer_size(NULL, aud_codec_context->channels, aud_codec_context->frame_size,
-        aud_codec_context->sample_fmt, 0);
+/*
+ * { pipeline } runs the session on three threads joined by bounded queues:
+ *
+ *   capture (read, s16 tap) -> convert (resample, gate, meters, frame assembly) -> encode (encode, mux, deliver)
+ *
+ * { sharedEncoder } hands every encoder's frames to the process-wide pool instead of encoding
+ * them on a thread of this capturer, replacing the encode stage when both are given.
+ *
+ * Periods and frames come from fixed pools and travel back on a free queue, so nothing is
+ * allocated while running. A stage that finds no free buffer drops the item and counts it
+ * rather than stall the stage before it; the encoder skips the gap so timestamps stay exact.
+ */
+int LinuxSoundCapturer::open_stages(std::string *error)
+{
+    int plane_size;
+    if (streams.empty()) {
+        frame_channels = DEFAULT_AUD_CHANNELS;
+        plane_size = encoder->frame_size();
+    } else {
+        frame_channels = 0;
+        plane_size = streams[0]->encoder->frame_size();
+        for (size_t s = 0; s < streams.size(); s++)
+            frame_channels += streams[s]->channels;
+    }
 
-    av_frame_get_buffer(aud_frame, buffer_size / aud_codec_context->channels);
+    int lane_count = !shared_encoder ? 0 : streams.empty() ? 1 : streams.size();
+    for (int i = 0; i < lane_count; i++) {
+        PooledEncoder *lane = new PooledEncoder();
+        lane->channels = streams.empty() ? DEFAULT_AUD_CHANNELS : streams[i]->channels;
+        lane->pending_skip = 0;
+        lane->dropped = 0;
+        lane->free_frames.reset(new SpscQueue<PipelineFrame *>(pipeline_depth));
+        std::string name = streams.empty() ? (output_file.empty() ? source_spec : output_file) :
+            !stream_configs[i].output.empty() ? stream_configs[i].output : source_spec + "#" + std::to_string(i);
+        lane->stream = SharedEncoderPool::instance().add(name);
+        lanes.push_back(lane);
+        if (allocate_frames(lane->frames, lane->free_frames.get(), lane->channels, plane_size)) {
+            *error = "Could not allocate the encoder frames";
+            return -1;
+        }
+    }
 
-    if (!aud_frame)
-        return COULD_NOT_ALLOCATE_FRAME;
+    if (!pipelined)
+        return 0;
 
-    aud_frame_counter = 0;
+    captured_periods.reset(new SpscQueue<PipelinePeriod *>(pipeline_depth));
+    free_periods.reset(new SpscQueue<PipelinePeriod *>(pipeline_depth));
+    converted_frames.reset(new SpscQueue<PipelineFrame *>(pipeline_depth));
+    free_frames.reset(new SpscQueue<PipelineFrame *>(pipeline_depth));
 
+    period_pool.assign(captured_periods->capacity(), PipelinePeriod());
+    for (PipelinePeriod &period: period_pool) {
+        period.data = (char *) malloc(input.size());
+        if (!period.data) {
+            *error = "Could not allocate the pipeline buffers";
+            return -1;
+        }
+        free_periods->push(&period);
+    }
+    if (!shared_encoder && allocate_frames(frame_pool, free_frames.get(), frame_channels, plane_size)) {
+        *error = "Could not allocate the pipeline buffers";
+        return -1;
+    }
+    pending_skip = 0;
     return 0;
 }
 
-AVPacket* LinuxSoundCapturer::encode_audio_samples(uint8_t **aud_samples)
+void LinuxSoundCapturer::close_stages()
 {
-    int ret;
+    for (PooledEncoder *lane: lanes) {
+        SharedEncoderPool::instance().remove(lane->stream);
+        free_frames_of(lane->frames);
+        delete lane;
+    }
+    lanes.clear();
+
+    for (PipelinePeriod &period: period_pool)
+        free(period.data);
+    period_pool.clear();
+    free_frames_of(frame_pool);
+    captured_periods.reset();
+    free_periods.reset();
+    converted_frames.reset();
+    free_frames.reset();
+}
 
-    int buffer_size = av_samples_get_buffer_size(NULL, aud_codec_context->channels, aud_codec_context->frame_size,
-        aud_codec_context->sample_fmt, 0);
+/*
+ * Native thread when pipelined: starts the convert and encode stages, then reads periods into
+ * free pool buffers and queues them until the input ends or the capture stops. Without a free
+ * buffer a period is still read, so the device does not overrun, and then dropped.
+ */
+void LinuxSoundCapturer::capture_stage()
+{
+    StageMetrics &metrics = stage_metrics[STAGE_CAPTURE];
+    std::thread convert_thread(&LinuxSoundCapturer::convert_stage, this);
+    std::thread encode_thread;
+    if (!shared_encoder)
+        encode_thread = std::thread(&LinuxSoundCapturer::encode_stage, this);
+    enter_stage(metrics.name, metrics.cpu);
+
+    int64_t thread_cpu_start = thread_cpu_ns();
+    PipelinePeriod *period = NULL;
+    long lost = 0;
+
+    while (!isClosing) {
+        if (!period)
+            free_periods->pop(&period);
+        int err = input.source()->read(period ? period->data : input.buffer(), input.frames());
+        int64_t captured_ns = monotonic_ns();
+        if (err == 0 && input.source()->at_end())
+            break;
+        if (err <= 0) {
+            fprintf(stderr, "Error occured while recording: '%s'\n", strerror(-err));
+            stats.overruns.fetch_add(1, std::memory_order_relaxed);
+            stats.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+            input.source()->recover(err);
+            continue;
+        }
 
-    //for (size_t i = 0; i < buffer_size / aud_codec_context->channels; i++) {
-    for (int i = 0; i < buffer_size / aud_codec_context->channels; i++) {
-        aud_frame->data[0][i] = aud_samples[0][i];
-        aud_frame->data[1][i] = aud_samples[1][i];
+        stats.periods.fetch_add(1, std::memory_order_relaxed);
+        if (tap_enabled && tap.format() == PCM_TAP_S16)
+            tap.write_s16((const int16_t *) (period ? period->data : input.buffer()), err);
+        if (!period) {
+            lost += err;
+            metrics.dropped.fetch_add(1, std::memory_order_relaxed);
+            stats.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        period->frames = err;
+        period->captured_ns = captured_ns;
+        period->lost = lost;
+        lost = 0;
+        captured_periods->push(period);
+        period = NULL;
+
+        metrics.record(monotonic_ns() - captured_ns, 0);
+        int64_t cpu_ns = thread_cpu_ns() - thread_cpu_start;
+        metrics.cpu_ns.store(cpu_ns, std::memory_order_relaxed);
+        stats.cpu_ns.store(cpu_ns, std::memory_order_relaxed);
     }
 
-    aud_frame->pts = aud_frame_counter++;
+    /* The later stages drain what is queued before they return */
+    captured_periods->close();
+    convert_thread.join();
+    if (encode_thread.joinable())
+        encode_thread.join();
+}
 
-    ret = avcodec_send_frame(aud_codec_context, aud_frame);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR_ENCODING_SAMPLES_SEND: '%d'\n", ret);
-        return NULL;
+/* Convert stage thread: turns queued periods into codec frames for the encode stage */
+void LinuxSoundCapturer::convert_stage()
+{
+    StageMetrics &metrics = stage_metrics[STAGE_CONVERT];
+    enter_stage(metrics.name, metrics.cpu);
+
+    int64_t thread_cpu_start = thread_cpu_ns();
+    int64_t period_ns = period_seconds * 1e9;
+    PipelinePeriod *period;
+
+    while (captured_periods->pop_wait(&period)) {
+        size_t queued = captured_periods->size() + 1;
+        int64_t started_ns = monotonic_ns();
+
+        /* Split streams encode at the capture rate, the stereo mix at the encoder's */
+        if (period->lost)
+            bridge_gap(streams.empty() ? av_rescale(period->lost, DEFAULT_AUD_SAMPLE_RATE, input.source()->sample_rate()) :
+                       period->lost, period->captured_ns);
+        handle_period(period->data, period->frames, period->captured_ns, started_ns);
+        free_periods->push(period);
+
+        int64_t busy_ns = monotonic_ns() - started_ns;
+        metrics.record(busy_ns, queued);
+        if (busy_ns > period_ns)
+            stats.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+        metrics.cpu_ns.store(thread_cpu_ns() - thread_cpu_start, std::memory_order_relaxed);
     }
+    converted_frames->close();
+}
 
-    AVPacket *pkt = av_packet_alloc();      // it calls av_init_packet(), and calling av_packet_unref is hadled by avcodec_receive_packet
-    fflush(stdout);
+/* Encode stage thread: encodes, muxes and delivers the frames the convert stage queued */
+void LinuxSoundCapturer::encode_stage()
+{
+    StageMetrics &metrics = stage_metrics[STAGE_ENCODE];
+    enter_stage(metrics.name, metrics.cpu);
+
+    int64_t thread_cpu_start = thread_cpu_ns();
+    int64_t period_ns = period_seconds * 1e9;
+    PipelineFrame *frame;
+
+    while (converted_frames->pop_wait(&frame)) {
+        size_t queued = converted_frames->size() + 1;
+        int64_t started_ns = monotonic_ns();
+        int64_t captured_ns = frame->captured_ns;
+
+        if (frame->skip && streams.empty())
+            encoder->skip(frame->skip);
+        for (size_t s = 0; frame->skip && s < streams.size(); s++)
+            streams[s]->encoder->skip(frame->skip);
+        encode_frame(frame->planes.data(), captured_ns);
+        free_frames->push(frame);
+
+        /* processingMs runs from capture to encoded, time spent queued included */
+        int64_t done_ns = monotonic_ns();
+        metrics.record(done_ns - started_ns, queued);
+        stats.processing.record((done_ns - captured_ns) / 1000);
+        if (done_ns - started_ns > period_ns)
+            stats.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+        metrics.cpu_ns.store(thread_cpu_ns() - thread_cpu_start, std::memory_order_relaxed);
+    }
+}
 
-    ret = avcodec_receive_packet(aud_codec_context, pkt);
-    if (!ret) {
-        av_packet_rescale_ts(pkt, aud_codec_context->time_base, audio_st->time_base);
-        pkt->stream_index = audio_st->index;
-        return pkt;
+/*
+ * Native thread: hands pkt to the startListener() callback and takes ownership of it. Under flow
+ * control it takes a credit first, or queues pkt for the delivery thread when the source is live.
+ * pkt NULL sends the end of input event.
+ */
+void LinuxSoundCapturer::dispatch(AVPacket *pkt, int64_t captured_ns, int stream)
+{
+    if (!has_listener) {
+        av_packet_free(&pkt);
+        return;
     }
 
-    fprintf(stderr, "error in receiving encoded packet: '%d'\n", ret);  //ERROR_ENCODING_SAMPLES_RECEIVE);
-    return NULL;
+    EncodedPacket *encoded = new EncodedPacket { pkt, captured_ns, stream };
+    if (pkt && held_packets) {
+        if (!held_packets->push(encoded)) {
+            stats.credit_dropped.fetch_add(1, std::memory_order_relaxed);
+            av_packet_free(&encoded->pkt);
+            delete encoded;
+        }
+        return;
+    }
+    if (pkt && flow_control && !wait_for_credit()) {
+        av_packet_free(&encoded->pkt);
+        delete encoded;
+        return;
+    }
+    post(encoded);
 }
 
-int LinuxSoundCapturer::finish_audio_encoding()
+/* Delivery thread: hands held packets over one credit at a time until the capture ends */
+void LinuxSoundCapturer::deliver_held()
+{
+    EncodedPacket *encoded;
+    while (held_packets->pop_wait(&encoded)) {
+        /* Once stopping, what is still held goes nowhere */
+        if (!wait_for_credit()) {
+            av_packet_free(&encoded->pkt);
+            delete encoded;
+            continue;
+        }
+        post(encoded);
+    }
+    if (!isClosing)
+        post(new EncodedPacket { NULL, monotonic_ns(), -1 });
+}
+
+/* Queues encoded to the startListener() callback and takes ownership of it */
+void LinuxSoundCapturer::post(EncodedPacket *encoded)
 {
-    AVPacket pkt;
-    av_init_packet(&pkt);
-    pkt.data = NULL;
-    pkt.size = 0;
+    auto callback = [this] (Napi::Env env, Function jsCallback, EncodedPacket* encoded) {
+        AVPacket *packet = encoded->pkt;
+        if (!packet) {
+            // The source ran out of input
+            jsCallback.Call({String::New(env, "end")});
+            delete encoded;
+            return;
+        }
+        stats.delivered.fetch_add(1, std::memory_order_relaxed);
+        stats.latency.record((monotonic_ns() - encoded->captured_ns) / 1000);
+
+        // The Buffer points into the packet, which is freed when the Buffer is collected
+        Buffer<uint8_t> encoded_audio = Buffer<uint8_t>::New(env, packet->data, packet->size,
+            [] (Napi::Env, uint8_t *, AVPacket *packet) { av_packet_free(&packet); }, packet);
+        Number pts = Number::New(env, packet->pts);
+        if (encoded->stream < 0)
+            jsCallback.Call({String::New(env, "data"), encoded_audio, pts});
+        else
+            jsCallback.Call({String::New(env, "data"), encoded_audio, pts, Number::New(env, encoded->stream)});
+        delete encoded;
+    };
+
+    AVPacket *pkt = encoded->pkt;
+    napi_status status = this->tsfn.NonBlockingCall(encoded, callback);
+    if (napi_ok != status) {
+        if (pkt)
+            fprintf(stderr, "Error after calling tsfn at C++: '%d'",status);
+        av_packet_free(&pkt);
+        delete encoded;
+    } else if (pkt) {
+        if (!stats.dispatched.load(std::memory_order_relaxed))
+            stats.first_packet_ns.store(monotonic_ns() - start_requested_ns);
+        stats.packet_dispatched();
+    }
+}
 
-    fflush(stdout);
+Napi::Value LinuxSoundCapturer::StopListener(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
 
-    int ret = avcodec_send_frame(aud_codec_context, NULL);
-    if (ret < 0)
-        return ERROR_ENCODING_FRAME_SEND;
+    /* Stopping an idle capturer is not an error; stopping one that is already stopping waits for that stop */
+    if (state != RUNNING) {
+        Promise::Deferred deferred = Promise::Deferred::New(env);
+        if (state == STARTING)
+            deferred.Reject(Error::New(env, "Listener is still starting").Value());
+        else if (state == STOPPING)
+            stop_waiters.push_back(deferred);
+        else
+            deferred.Resolve(env.Undefined());
+        return deferred.Promise();
+    }
 
-    while (1) {
-        ret = avcodec_receive_packet(aud_codec_context, &pkt);
-        if (!ret) {
-            if (pkt.pts != AV_NOPTS_VALUE)
-                pkt.pts = av_rescale_q(pkt.pts, aud_codec_context->time_base, audio_st->time_base);
-            if (pkt.dts != AV_NOPTS_VALUE)
-                pkt.dts = av_rescale_q(pkt.dts, aud_codec_context->time_base, audio_st->time_base);
+    state = STOPPING;
+    StopListenerWorker *worker = new StopListenerWorker(env, this);
+    Napi::Promise promise = worker->GetPromise();
+    worker->Queue();
+    return promise;
+}
 
-            av_write_frame(outctx, &pkt);
-            av_packet_unref(&pkt);
+void LinuxSoundCapturer::close_pipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(credit_mutex);
+        isClosing = true;
+    }
+    credit_available.notify_one();
+    nativeThread.join();
+    spectrum.stop();
+    if (tap_enabled)
+        tap.stop();
+    tap_enabled = false;
+    /* flush_encoders() delivered the tail on the native thread; what is left is the files' trailers */
+    if (encoder)
+        finish_audio_encoding();
+    for (size_t s = 0; s < streams.size(); s++)
+        streams[s]->encoder->finish();
+
+    /* Keep the device and resampler open for the next session; the drained encoder cannot be reused */
+    if (use_pool) {
+        cleanup();
+        if (resampler_tier == RESAMPLER_DEFAULT || converter.set_quality(RESAMPLER_DEFAULT) >= 0) {
+            unsigned long frames = input.frames();
+            CapturePool::instance().release(source_spec, new WarmPipeline { input.detach(), frames, converter.detach(), NULL });
         }
-        if (ret == -AVERROR(AVERROR_EOF))
-            break;
-        else if (ret < 0)
-            return ERROR_ENCODING_FRAME_RECEIVE;
     }
+    release_pipeline();
+}
 
-    av_write_trailer(outctx);
-    return 0;
+void LinuxSoundCapturer::release_pipeline()
+{
+    input.close();
+    converter.close();
+
+    delete muxer;
+    muxer = NULL;
+    held_packets.reset();
+
+    close_stages();
+    close_streams();
+    cleanup();
 }
 
-void LinuxSoundCapturer::cleanup()
+/* Native thread: takes one credit, waiting for requestPackets() if there is none. False when closing. */
+bool LinuxSoundCapturer::wait_for_credit()
 {
-    if (vid_frame)
-        av_frame_free(&vid_frame);
+    std::unique_lock<std::mutex> lock(credit_mutex);
+    credit_available.wait(lock, [this] { return credits > 0 || isClosing; });
+    if (isClosing)
+        return false;
+    credits--;
+    return true;
+}
 
-    if (aud_frame)
-        av_frame_free(&aud_frame);
+Napi::Value LinuxSoundCapturer::RequestPackets(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsNumber()) {
+        TypeError::New(env, "Expects the number of packets").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    int64_t count = info[0].As<Napi::Number>().Int64Value();
+    if (count > 0) {
+        {
+            std::lock_guard<std::mutex> lock(credit_mutex);
+            credits += count;
+        }
+        credit_available.notify_one();
+    }
+    return env.Undefined();
+}
 
-    if (outctx) {
-        for (unsigned int i = 0; i < outctx->nb_streams; i++)
-            av_freep(&outctx->streams[i]);
+void LinuxSoundCapturer::finish_stop()
+{
+    // Idle subscribers must not keep the process alive
+    std::lock_guard<std::mutex> lock(subscribers_mutex);
+    for (auto &subscriber : subscribers)
+        subscriber->tsfn.Unref(Env());
+    state = IDLE;
+
+    for (Promise::Deferred &waiter : stop_waiters)
+        waiter.Resolve(Env().Undefined());
+    stop_waiters.clear();
+}
 
-        avio_close(outctx->pb);
-        av_free(outctx);
+/*
+ * Hands pkt to every subscriber with room in its queue. Each one gets its own reference to
+ * the same packet buffer, so nothing is copied, and a full queue only drops for that subscriber.
+ */
+void LinuxSoundCapturer::publish(AVPacket *pkt, int stream)
+{
+    auto deliver = [] (Napi::Env env, Function jsCallback, SubscriberPacket *item) {
+        Subscriber *subscriber = item->subscriber.get();
+        subscriber->queued.fetch_sub(1, std::memory_order_relaxed);
+        if (!item->pkt) {
+            jsCallback.Call({String::New(env, "end")});
+        } else {
+            subscriber->delivered.fetch_add(1, std::memory_order_relaxed);
+            AVPacket *packet = item->pkt;
+            Buffer<uint8_t> data = Buffer<uint8_t>::New(env, packet->data, packet->size,
+                [] (Napi::Env, uint8_t *, AVPacket *packet) { av_packet_free(&packet); }, packet);
+            if (item->stream < 0)
+                jsCallback.Call({String::New(env, "data"), data, Number::New(env, packet->pts)});
+            else
+                jsCallback.Call({String::New(env, "data"), data, Number::New(env, packet->pts), Number::New(env, item->stream)});
+        }
+        delete item;
+    };
+
+    std::lock_guard<std::mutex> lock(subscribers_mutex);
+    for (auto &subscriber : subscribers) {
+        if (pkt && subscriber->queued.load(std::memory_order_relaxed) >= subscriber->max_queued) {
+            subscriber->dropped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        AVPacket *ref = NULL;
+        if (pkt && !(ref = av_packet_clone(pkt)))
+            continue;
+        SubscriberPacket *item = new SubscriberPacket { subscriber, ref, stream };
+        subscriber->queued.fetch_add(1, std::memory_order_relaxed);
+        if (napi_ok != subscriber->tsfn.NonBlockingCall(item, deliver)) {
+            subscriber->queued.fetch_sub(1, std::memory_order_relaxed);
+            av_packet_free(&ref);
+            delete item;
+        }
     }
+}
 
-    if (aud_codec_context) {
-        avcodec_close(aud_codec_context);
-        av_free(aud_codec_context);
+/*
+ * subscribe(callback[, { maxQueued: 64 }]) adds a listener that receives the same packets as the
+ * startListener() callback, with the same (event, data, pts) arguments. Returns an id for unsubscribe().
+ */
+Napi::Value LinuxSoundCapturer::Subscribe(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsFunction()) {
+        TypeError::New(env, "Expects a function type argument").ThrowAsJavaScriptException();
+        return env.Undefined();
     }
 
-    if (vid_codec_context) {
-        avcodec_close(vid_codec_context);
-        av_free(vid_codec_context);
+    std::shared_ptr<Subscriber> subscriber = std::make_shared<Subscriber>();
+    subscriber->id = next_subscriber_id++;
+    subscriber->max_queued = 64;
+    subscriber->queued = 0;
+    subscriber->delivered = 0;
+    subscriber->dropped = 0;
+    if (info.Length() > 1 && info[1].IsObject()) {
+        Napi::Object options = info[1].As<Napi::Object>();
+        if (options.Has("maxQueued") && options.Get("maxQueued").IsNumber())
+            subscriber->max_queued = options.Get("maxQueued").As<Napi::Number>().Int64Value();
     }
+    subscriber->tsfn = ThreadSafeFunction::New(env, info[0].As<Function>(), "LinuxSoundCapturerSubscriber", 0, 1);
+    if (state == IDLE)
+        subscriber->tsfn.Unref(env);
+
+    std::lock_guard<std::mutex> lock(subscribers_mutex);
+    subscribers.push_back(subscriber);
+    return Number::New(env, subscriber->id);
 }
 
-void LinuxSoundCapturer::StartListener(const Napi::CallbackInfo& info)
+/* Packets already queued are still delivered; each one holds its subscriber until then */
+void LinuxSoundCapturer::release_subscribers()
 {
-    int err, ret;
+    std::lock_guard<std::mutex> lock(subscribers_mutex);
+    for (auto &subscriber : subscribers)
+        subscriber->tsfn.Release();
+    subscribers.clear();
+}
 
-    // Capturing related
-    snd_pcm_uframes_t frames = 1024;
-    int size;
+Napi::Value LinuxSoundCapturer::Unsubscribe(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsNumber()) {
+        TypeError::New(env, "Expects a subscription id").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    int id = info[0].As<Napi::Number>().Int32Value();
+
+    std::lock_guard<std::mutex> lock(subscribers_mutex);
+    for (auto it = subscribers.begin(); it != subscribers.end(); ++it) {
+        if ((*it)->id == id) {
+            // Packets already queued are still delivered, then the tsfn goes away
+            (*it)->tsfn.Release();
+            subscribers.erase(it);
+            return Boolean::New(env, true);
+        }
+    }
+    return Boolean::New(env, false);
+}
 
-    // Resampling related
-    int src_nb_samples = frames;
-    int dst_nb_samples;
+static Napi::Object encoder_pool_entry(Napi::Env env, const EncoderPoolStreamStats &stats)
+{
+    Napi::Object entry = Napi::Object::New(env);
+    entry.Set("name", String::New(env, stats.name));
+    entry.Set("jobs", Number::New(env, stats.jobs));
+    entry.Set("deadlineMisses", Number::New(env, stats.deadline_misses));
+    entry.Set("maxLateMs", Number::New(env, stats.max_late_ns / 1e6));
+    entry.Set("busyMs", Number::New(env, stats.busy_ns / 1e6));
+    entry.Set("queued", Number::New(env, stats.queued));
+    entry.Set("turnaroundP99Ms", Number::New(env, stats.turnaround_p99_us / 1000.0));
+    return entry;
+}
 
-    // Encoding related
-    float_t** aud_samples;
-    int src_samples_linesize;
-    int src_channels = 2;
+Napi::Value LinuxSoundCapturer::GetStats(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    Napi::Object result = Napi::Object::New(env);
+    uint64_t dispatched = stats.dispatched.load(), delivered = stats.delivered.load();
+
+    result.Set("periods", Number::New(env, stats.periods.load()));
+    result.Set("periodMs", Number::New(env, period_seconds * 1000));
+    result.Set("deadlineMisses", Number::New(env, stats.deadline_misses.load()));
+    result.Set("overruns", Number::New(env, stats.overruns.load()));
+    result.Set("packets", Number::New(env, delivered));
+    result.Set("queued", Number::New(env, dispatched - delivered));
+    result.Set("maxQueued", Number::New(env, stats.max_pending.load()));
+    result.Set("creditDropped", Number::New(env, stats.credit_dropped.load()));
+    int64_t cpu_ns = stats.cpu_ns.load();
+    if (pipelined)
+        cpu_ns += stage_metrics[STAGE_CONVERT].cpu_ns.load() + stage_metrics[STAGE_ENCODE].cpu_ns.load();
+    result.Set("cpuTimeMs", Number::New(env, cpu_ns / 1e6));
+    result.Set("wallTimeMs", Number::New(env, (monotonic_ns() - stats.started_ns.load()) / 1e6));
+    result.Set("silentPeriods", Number::New(env, stats.silent_periods.load()));
+    result.Set("silenceMs", Number::New(env, stats.silent_frames.load() * 1000.0 / DEFAULT_AUD_SAMPLE_RATE));
+    result.Set("warmStart", Boolean::New(env, warm_start));
+    result.Set("resampler", String::New(env, fused_conversion ? "none" :
+                                        resampler_quality_name((ResamplerQuality) resampler_tier.load())));
+    result.Set("resamplerDowngrades", Number::New(env, stats.resampler_downgrades.load()));
+    if (stats.first_packet_ns.load() >= 0)
+        result.Set("timeToFirstPacketMs", Number::New(env, stats.first_packet_ns.load() / 1e6));
+    else
+        result.Set("timeToFirstPacketMs", env.Null());
+
+    Napi::Object latency = Napi::Object::New(env);
+    latency.Set("p50", Number::New(env, stats.latency.percentile(50) / 1000.0));
+    latency.Set("p90", Number::New(env, stats.latency.percentile(90) / 1000.0));
+    latency.Set("p99", Number::New(env, stats.latency.percentile(99) / 1000.0));
+    latency.Set("max", Number::New(env, stats.latency.max() / 1000.0));
+    result.Set("latencyMs", latency);
+
+    Napi::Object processing = Napi::Object::New(env);
+    processing.Set("p50", Number::New(env, stats.processing.percentile(50) / 1000.0));
+    processing.Set("p99", Number::New(env, stats.processing.percentile(99) / 1000.0));
+    processing.Set("max", Number::New(env, stats.processing.max() / 1000.0));
+    result.Set("processingMs", processing);
+
+    Napi::Array subscriber_stats = Napi::Array::New(env);
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        for (size_t i = 0; i < subscribers.size(); i++) {
+            Napi::Object entry = Napi::Object::New(env);
+            entry.Set("id", Number::New(env, subscribers[i]->id));
+            entry.Set("queued", Number::New(env, subscribers[i]->queued.load()));
+            entry.Set("delivered", Number::New(env, subscribers[i]->delivered.load()));
+            entry.Set("dropped", Number::New(env, subscribers[i]->dropped.load()));
+            subscriber_stats.Set(i, entry);
+        }
+    }
+    result.Set("subscribers", subscriber_stats);
+
+    /* One entry per encoder lane with the shared encoder, in stream order */
+    if (shared_encoder) {
+        Napi::Array lane_stats = Napi::Array::New(env);
+        for (size_t i = 0; i < lanes.size(); i++) {
+            EncoderPoolStreamStats pooled;
+            SharedEncoderPool::instance().stats(lanes[i]->stream, &pooled);
+            Napi::Object entry = encoder_pool_entry(env, pooled);
+            entry.Set("dropped", Number::New(env, lanes[i]->dropped.load()));
+            lane_stats.Set(i, entry);
+        }
+        result.Set("encoderPool", lane_stats);
+    } else {
+        result.Set("encoderPool", env.Null());
+    }
 
-    // Tsfn related
+    /* One entry per stage when pipelined; queue figures are for the queue feeding the stage */
+    if (pipelined && stage_metrics[STAGE_CAPTURE].name) {
+        Napi::Array stages = Napi::Array::New(env);
+        double wall_ns = monotonic_ns() - stats.started_ns.load();
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            StageMetrics &metrics = stage_metrics[i];
+            uint64_t items = metrics.items.load();
+            Napi::Object entry = Napi::Object::New(env);
+            entry.Set("stage", String::New(env, metrics.name));
+            entry.Set("cpu", metrics.cpu < 0 ? env.Null() : Number::New(env, metrics.cpu));
+            entry.Set("items", Number::New(env, items));
+            entry.Set("dropped", Number::New(env, metrics.dropped.load()));
+            entry.Set("busyPercent", Number::New(env, wall_ns > 0 ? metrics.busy_ns.load() * 100.0 / wall_ns : 0));
+            entry.Set("cpuTimeMs", Number::New(env, metrics.cpu_ns.load() / 1e6));
+            if (metrics.queue_capacity) {
+                entry.Set("queueAverage", Number::New(env, items ? (double) metrics.queue_sum.load() / items : 0));
+                entry.Set("queueMax", Number::New(env, metrics.queue_max.load()));
+                entry.Set("queueCapacity", Number::New(env, metrics.queue_capacity));
+            }
+            stages.Set(i, entry);
+        }
+        result.Set("pipeline", stages);
+    } else {
+        result.Set("pipeline", env.Null());
+    }
+    return result;
+}
+
+/*
+ * getLevels() returns the meter readings of the latest period, { peakDb: [], rmsDb: [], momentaryLufs,
+ * shortTermLufs }, or null unless the capturer was created with { levels: true }. Reading them only
+ * loads atomics, so it is cheap enough to poll from a UI timer.
+ */
+Napi::Value LinuxSoundCapturer::GetLevels(const Napi::CallbackInfo& info)
+{
     Napi::Env env = info.Env();
-    if (info.Length() < 1 || !info[0].IsFunction())
-        throw TypeError::New( env, "Expects a single function type argument" );
+    if (!metering)
+        return env.Null();
+
+    Levels levels;
+    meter.read(&levels);
+
+    Napi::Object result = Napi::Object::New(env);
+    Napi::Array peak = Napi::Array::New(env, levels.channels);
+    Napi::Array rms = Napi::Array::New(env, levels.channels);
+    for (int c = 0; c < levels.channels; c++) {
+        peak.Set(c, Number::New(env, levels.peak_db[c]));
+        rms.Set(c, Number::New(env, levels.rms_db[c]));
+    }
+    result.Set("peakDb", peak);
+    result.Set("rmsDb", rms);
+    result.Set("momentaryLufs", Number::New(env, levels.momentary_lufs));
+    result.Set("shortTermLufs", Number::New(env, levels.short_term_lufs));
+    return result;
+}
 
-    tsfn = ThreadSafeFunction::New(env, info[0].As<Function>(), "LinuxSoundCapturerTsfn", 0, 1);
+/*
+ * getSpectrum() returns the latest band levels in dB as a Float32Array, lowest band first, or null
+ * unless the capturer was created with { spectrum } and has analyzed its first window.
+ */
+Napi::Value LinuxSoundCapturer::GetSpectrum(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    std::vector<float> bands;
+    if (!analyzing || !spectrum.read(&bands))
+        return env.Null();
 
-    // Initialization
-    err = init_capturer(&handle, frames, &buffer, &size);
-    init_resampler(&swr_ctx, &src_nb_samples, &src_data, &dst_nb_samples, &dst_data);
-    initialize_encoding_audio("result.mp4");
-    ret = av_samples_alloc_array_and_samples((uint8_t***)&aud_samples, &src_samples_linesize, src_channels,
-                                             src_nb_samples,           AV_SAMPLE_FMT_FLTP,    0);
+    Napi::Float32Array result = Napi::Float32Array::New(env, bands.size());
+    memcpy(result.Data(), bands.data(), bands.size() * sizeof(float));
+    return result;
+}
 
-    // Thread for doing continuous processing
-    //nativeThread = std::thread( [this] {
-    nativeThread = std::thread( [&] {
-        auto callback = [] (Napi::Env env, Function jsCallback, AVPacket* packet) {
-            Buffer<uint8_t> encoded_audio = Buffer<uint8_t>::New(env, packet->data, packet->size);
-            Number pts = Number::New(env, packet->pts);
-            jsCallback.Call({String::New(env, "data"), encoded_audio, pts});
-            if (packet)
-                av_packet_free(&packet);        // it calls av_packet_unref(), deallocates memory abd sets packet pointer to null
-        };
-
-        while(!isClosing) {
-            err = snd_pcm_readi(handle, buffer, frames);
-            if (err <= 0) {
-                fprintf(stderr, "Error occured while recording: '%s'\n", snd_strerror(err));
-                snd_pcm_recover(handle, err, 0);
-            } else {
-                memcpy(src_data[0], buffer, size);
-                ret = swr_convert(swr_ctx, dst_data, dst_nb_samples, (const uint8_t **)src_data, src_nb_samples);
-                if (ret < 0) {
-                    fprintf(stderr, "Error while converting: '%d'\n", ret);
-                } else {
-                    AVPacket* pkt = encode_audio_samples((uint8_t **)dst_data);
-                    napi_status status = this->tsfn.NonBlockingCall(pkt, callback);
-                    if (napi_ok != status)
-                       fprintf(stderr, "Error after calling tsfn at C++: '%d'",status);
-                }
+/*
+ * attachTap(view[, { format: "s16" | "fltp" }]) makes the native thread copy every period into
+ * the ring described in pcm_tap.h. view is a TypedArray, normally over a SharedArrayBuffer, and
+ * is kept alive until detachTap(). The ring is laid out when the next session starts.
+ */
+Napi::Value LinuxSoundCapturer::AttachTap(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsTypedArray()) {
+        TypeError::New(env, "Expects a TypedArray over the tap memory").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    if (state != IDLE) {
+        Error::New(env, "The tap can only be changed while the listener is stopped").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    int format = PCM_TAP_S16;
+    if (info.Length() > 1 && info[1].IsObject()) {
+        Napi::Object options = info[1].As<Napi::Object>();
+        if (options.Has("format") && options.Get("format").IsString()) {
+            std::string name = options.Get("format").As<Napi::String>().Utf8Value();
+            if (name == "fltp")
+                format = PCM_TAP_FLTP;
+            else if (name != "s16") {
+                TypeError::New(env, "Unknown tap format: " + name).ThrowAsJavaScriptException();
+                return env.Undefined();
             }
-            std::this_thread::sleep_for(std::chrono::seconds(1));
         }
-        if (napi_ok != tsfn.Release())
-            fprintf(stderr, "error releasing tsfn for linux audio capturer");
-    });
+    }
+
+    /* Works for SharedArrayBuffer backed views, which napi_get_arraybuffer_info rejects */
+    Napi::TypedArray view = info[0].As<Napi::TypedArray>();
+    void *data;
+    if (napi_get_typedarray_info(env, view, NULL, NULL, &data, NULL, NULL) != napi_ok || !data) {
+        Error::New(env, "Could not get the tap memory").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    if (((uintptr_t) data & 7) || view.ByteLength() <= PCM_TAP_HEADER_BYTES) {
+        RangeError::New(env, "Tap memory must be 8 byte aligned and larger than its header").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    tap_memory = Napi::Persistent(view.As<Napi::Object>());
+    tap.attach((uint8_t *) data, view.ByteLength(), format);
+    return env.Undefined();
 }
 
-void LinuxSoundCapturer::StopListener(const Napi::CallbackInfo& info)
+Napi::Value LinuxSoundCapturer::DetachTap(const Napi::CallbackInfo& info)
 {
-    isClosing = true;
-    nativeThread.join();
-    close_capturer(&handle, &buffer);
+    Napi::Env env = info.Env();
+    if (state != IDLE) {
+        Error::New(env, "The tap can only be changed while the listener is stopped").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    tap.detach();
+    tap_memory.Reset();
+    return env.Undefined();
+}
 
-    if (src_data)
-        av_freep(&src_data[0]);
-    av_freep(&src_data);
+/*
+ * Opens pipelines for a source spec in the background so later warm sessions skip device
+ * and codec setup: SoundCaptureUtility.prewarm({ source, count }). A count of 0 closes them.
+ */
+class PrewarmWorker: public Napi::AsyncWorker
+{
+    public:
+        PrewarmWorker(Napi::Env env, const std::string &spec, int count):
+            AsyncWorker(env, "LinuxSoundCapturerPrewarm"), spec(spec), count(count),
+            deferred(Promise::Deferred::New(env)) {}
+
+        Napi::Promise GetPromise() { return deferred.Promise(); }
+
+    protected:
+        void Execute()
+        {
+            if (CapturePool::instance().prewarm(spec, count))
+                SetError("Could not pre-warm capture source: " + spec);
+            ready = CapturePool::instance().idle_count(spec);
+        }
 
-    if (dst_data)
-        av_freep(&dst_data[0]);
-    av_freep(&dst_data);
+        void OnOK() { deferred.Resolve(Number::New(Env(), ready)); }
+        void OnError(const Napi::Error& e) { deferred.Reject(e.Value()); }
 
-    swr_free(&swr_ctx);
+    private:
+        std::string spec;
+        int count;
+        int ready;
+        Promise::Deferred deferred;
+};
 
-    finish_audio_encoding();
-    cleanup();
+Napi::Value LinuxSoundCapturer::Prewarm(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    std::string spec = "alsa";
+    int count = 1;
+
+    if (info.Length() > 0 && info[0].IsObject()) {
+        Napi::Object options = info[0].As<Napi::Object>();
+        if (options.Has("source") && options.Get("source").IsString())
+            spec = options.Get("source").As<Napi::String>().Utf8Value();
+        if (options.Has("count") && options.Get("count").IsNumber())
+            count = options.Get("count").As<Napi::Number>().Int32Value();
+    }
+
+    PrewarmWorker *worker = new PrewarmWorker(env, spec, count);
+    Napi::Promise promise = worker->GetPromise();
+    worker->Queue();
+    return promise;
+}
+
+/*
+ * SoundCaptureUtility.encoderPool([{ threads }]) returns { threads, steals, streams } for the
+ * encoder pool shared by { sharedEncoder: true } capturers, with one entry per encoder in use.
+ * threads (0 for one per core, the default) only applies before the first of them starts.
+ */
+Napi::Value LinuxSoundCapturer::EncoderPool(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    SharedEncoderPool &pool = SharedEncoderPool::instance();
+
+    if (info.Length() > 0 && info[0].IsObject()) {
+        Napi::Object options = info[0].As<Napi::Object>();
+        if (options.Has("threads") && options.Get("threads").IsNumber())
+            pool.configure(options.Get("threads").As<Napi::Number>().Int32Value());
+    }
+
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("threads", Number::New(env, pool.threads()));
+    result.Set("steals", Number::New(env, pool.steals()));
+    std::vector<EncoderPoolStreamStats> all = pool.stats();
+    Napi::Array streams = Napi::Array::New(env);
+    for (size_t i = 0; i < all.size(); i++)
+        streams.Set(i, encoder_pool_entry(env, all[i]));
+    result.Set("streams", streams);
+    return result;
 }
 
 NODE_API_MODULE(linux_sound_capture_utility, InitAll);
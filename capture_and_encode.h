@@ -17,71 +17,270 @@ extern "C"
 #include <stdio.h>
 #include <stdint.h>
 #include <napi.h>
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
+#include "audio_encoder.h"
+#include "capture_mixer.h"
+#include "capture_pipeline.h"
+#include "capture_pool.h"
+#include "capture_source.h"
+#include "capture_stats.h"
+#include "channel_remix.h"
+#include "level_meter.h"
+#include "pcm_tap.h"
+#include "shared_encoder_pool.h"
+#include "sample_convert.h"
+#include "silence_gate.h"
+#include "spectrum_analyzer.h"
+#include "stage_pipeline.h"
+#include "stream_muxer.h"
+#include "worker_pool.h"
 
-#define RES_NOT_MUL_OF_TWO 1
-#define COULD_NOT_FIND_VID_CODEC 2
-#define CONTEXT_CREATION_ERROR 3
-#define COULD_NOT_OPEN_VID_CODEC 4
-#define COULD_NOT_OPEN_FILE 5
-#define COULD_NOT_ALLOCATE_FRAME 6
-#define COULD_NOT_ALLOCATE_PIC_BUF 7
-#define ERROR_ENCODING_FRAME_SEND 8
-#define ERROR_ENCODING_FRAME_RECEIVE 9
-#define COULD_NOT_FIND_AUD_CODEC 10
-#define COULD_NOT_OPEN_AUD_CODEC 11
-#define COULD_NOT_ALL_RESMPL_CONTEXT 12
-#define FAILED_TO_INIT_RESMPL_CONTEXT 13
-#define COULD_NOT_ALLOC_SAMPLES 14
-#define COULD_NOT_CONVERT_AUD 15
-#define ERROR_ENCODING_SAMPLES_SEND 16
-#define ERROR_ENCODING_SAMPLES_RECEIVE 17
+// An encoded packet on its way to JS, with the time its period was captured
+struct EncodedPacket
+{
+    AVPacket *pkt;
+    int64_t captured_ns;
+    int stream;             // logical stream index, -1 when the capture is not split
+};
+
+// One entry of the streams option: the input channels it takes, or a gain row per output channel
+struct StreamConfig
+{
+    std::vector<int> channels;
+    std::vector<std::vector<float> > matrix;
+    std::string output;
+};
+
+// A mono or stereo stream split off a multichannel capture, encoded on its own
+struct LogicalStream
+{
+    int channels;
+    float *planes[2];               // one period of the remix output
+    FrameAssembler assembler;       // periods to codec frames
+    AudioEncoder *encoder;
+    std::vector<AVPacket *> pkts;   // results of the latest encode, empty while the encoder buffers
+};
+
+// A captured period on its way from the capture stage to the convert stage
+struct PipelinePeriod
+{
+    char *data;
+    long frames;
+    int64_t captured_ns;
+    long lost;              // capture frames dropped just before this one, for lack of a free period
+};
+
+// One codec frame of planar float on its way from the convert stage to the encode stage
+struct PipelineFrame
+{
+    std::vector<float *> planes;
+    int64_t captured_ns;
+    int64_t skip;           // frames to skip before this one: gated silence or frames the pipeline dropped
+};
+
+// One encoder's lane on the shared encoder pool: its frames are copied out and encoded there as jobs
+struct PooledEncoder
+{
+    EncoderPoolStream *stream;
+    std::unique_ptr<SpscQueue<PipelineFrame *> > free_frames;   // refilled by the jobs
+    std::vector<PipelineFrame> frames;
+    int channels;
+    int64_t pending_skip;                   // frames to skip before the next job
+    std::atomic<uint64_t> dropped;          // frames lost because every buffer was queued
+};
+
+// A listener added with subscribe(), with its own queue limit
+struct Subscriber
+{
+    int id;
+    Napi::ThreadSafeFunction tsfn;
+    uint64_t max_queued;
+    std::atomic<uint64_t> queued;       // packets handed to the tsfn and not yet delivered
+    std::atomic<uint64_t> delivered;
+    std::atomic<uint64_t> dropped;      // packets skipped because the queue was full
+};
+
+// One subscriber's reference to a shared packet; pkt is NULL for the end of input event
+struct SubscriberPacket
+{
+    std::shared_ptr<Subscriber> subscriber;
+    AVPacket *pkt;
+    int stream;
+};
 
 class LinuxSoundCapturer: public Napi::ObjectWrap<LinuxSoundCapturer>
 {
     public:
         static Napi::Object Init(Napi::Env env, Napi::Object exports);
         LinuxSoundCapturer(const Napi::CallbackInfo& info);
-        void StartListener(const Napi::CallbackInfo& info);
-        void StopListener(const Napi::CallbackInfo& info);
-
-        int init_capturer(snd_pcm_t **handle,
-                          snd_pcm_uframes_t frames,
-                          char **buffer,
-                          int *size);
-        void close_capturer(snd_pcm_t **handle,
-                            char** buffer);
-        int init_resampler(struct SwrContext **swr_ctx,
-                           int *src_nb_samples, uint8_t ***src_data,
-                           int *dst_nb_samples, uint8_t ***dst_data);
+        ~LinuxSoundCapturer();
+        Napi::Value StartListener(const Napi::CallbackInfo& info);
+        Napi::Value StopListener(const Napi::CallbackInfo& info);
+        Napi::Value GetStats(const Napi::CallbackInfo& info);
+        Napi::Value Subscribe(const Napi::CallbackInfo& info);
+        Napi::Value Unsubscribe(const Napi::CallbackInfo& info);
+        Napi::Value RequestPackets(const Napi::CallbackInfo& info);
+        Napi::Value GetLevels(const Napi::CallbackInfo& info);
+        Napi::Value GetSpectrum(const Napi::CallbackInfo& info);
+        Napi::Value AttachTap(const Napi::CallbackInfo& info);
+        Napi::Value DetachTap(const Napi::CallbackInfo& info);
+        static Napi::Value Prewarm(const Napi::CallbackInfo& info);
+        static Napi::Value EncoderPool(const Napi::CallbackInfo& info);
+
         int initialize_encoding_audio(const char *filename);
         AVPacket* encode_audio_samples(uint8_t **aud_samples);
+        AVPacket* next_audio_packet();
         int finish_audio_encoding();
         void cleanup();
 
+        // Session lifecycle, split between the JS thread and the start/stop workers
+        int open_pipeline(std::string *error);     // worker thread
+        void start_processing();                    // JS thread, after open_pipeline succeeded
+        void abort_start();                         // JS thread, after open_pipeline failed
+        void process();                             // native thread
+        void close_pipeline();                      // worker thread
+        void release_pipeline();
+        bool wait_for_credit();                     // native thread or delivery thread
+        void deliver_held();                        // delivery thread
+        void post(EncodedPacket *encoded);          // native thread or delivery thread
+        int convert_period(const char *data, long nb_frames, bool *silent, float ***planes);  // native thread or convert stage
+        int bypass_resampler(long nb_frames);
+        void handle_period(const char *data, long nb_frames, int64_t captured_ns, int64_t started_ns);
+        void assemble(float **planes, int frames, int64_t captured_ns);         // convert side
+        void emit_frame(float **planes, int frames, int64_t captured_ns);      // convert side
+        void emit_skip(int64_t frames);                         // convert side
+        void encode_frame(float **planes, int64_t captured_ns); // native thread or encode stage
+        void deliver(AVPacket *pkt, int64_t captured_ns);       // native thread or encode stage
+        void flush_encoders();                                  // native thread, after the stages
+        void submit_frame(int lane, float **planes, int frames, int64_t captured_ns);   // convert side
+        void encode_pooled(int lane, PipelineFrame *frame);    // shared encoder pool
+        void adapt_resampler(int64_t stage_ns, int64_t period_ns, int64_t captured_ns);   // native thread
+        void publish(AVPacket *pkt, int stream);    // native thread, pkt NULL at end of input
+        void dispatch(AVPacket *pkt, int64_t captured_ns, int stream);     // native thread
+        int open_streams(std::string *error);       // worker thread
+        void emit_stream_frames(int64_t captured_ns);                   // convert side
+        void bridge_gap(int64_t frames, int64_t captured_ns);           // convert side
+        void encode_streams(float **planes, int64_t captured_ns);        // native thread or encode stage
+        void close_streams();
+        void finish_stop();                         // JS thread, after close_pipeline
+        void release_subscribers();                 // JS thread
+        void run_serial();                          // native thread
+        int open_stages(std::string *error);        // worker thread
+        void close_stages();
+        void capture_stage();                       // native thread
+        void convert_stage();
+        void encode_stage();
+
     private:
         static Napi::FunctionReference constructor;
+        bool parse_streams(Napi::Env env, Napi::Array options);
         std::thread nativeThread;
         Napi::ThreadSafeFunction tsfn;
+        bool has_listener;
+
+        // Subscribers share every packet by reference; the native thread never waits for them
+        std::vector<std::shared_ptr<Subscriber> > subscribers;
+        std::mutex subscribers_mutex;
+        int next_subscriber_id;
+
+        // Encoding related
+        AudioEncoder *encoder;
+        FrameAssembler assembler;   // periods to codec frames, they differ once resampled
+        std::string output_file;
 
-        int vid_frame_counter, aud_frame_counter;
-        AVCodecContext *vid_codec_context;
-        AVCodecContext *aud_codec_context;
-        AVFormatContext *outctx;
-        AVStream *video_st, *audio_st;
-        AVFrame *vid_frame, *aud_frame;
+        // Pull based delivery: packets are only dispatched against credits granted from JS
+        bool flow_control;
+        int64_t credits;
+        std::mutex credit_mutex;
+        std::condition_variable credit_available;
+        std::unique_ptr<SpscQueue<EncodedPacket *> > held_packets;     // a live source's packets waiting for credits
+        std::thread delivery_thread;                // waits for credits so a live capture never has to
+        std::string stream_format;
+        StreamMuxer *muxer;
+
+        // Multichannel split: { streams: [{ channels: [0, 1] }, { matrix: [[...]] }], encoderThreads }
+        std::vector<StreamConfig> stream_configs;
+        std::vector<LogicalStream *> streams;
+        ChannelRemix remix;
+        WorkerPool encoder_pool;
+        int encoder_threads;
+        ConvertFunction convert_input;      // interleaved S16 to one plane per input channel
+        std::vector<float *> input_planes;
+        std::vector<std::function<void()> > encode_tasks;
+
+        // Stage pipeline: { pipeline: true | { cpus: [0, 1, 2], depth: 8 } }
+        enum { STAGE_CAPTURE, STAGE_CONVERT, STAGE_ENCODE, STAGE_COUNT };
+        bool pipelined;
+        int pipeline_depth;
+        int pipeline_cpus[STAGE_COUNT];
+        StageMetrics stage_metrics[STAGE_COUNT];
+        std::unique_ptr<SpscQueue<PipelinePeriod *> > captured_periods;    // capture to convert
+        std::unique_ptr<SpscQueue<PipelinePeriod *> > free_periods;        // and back
+        std::unique_ptr<SpscQueue<PipelineFrame *> > converted_frames;     // convert to encode
+        std::unique_ptr<SpscQueue<PipelineFrame *> > free_frames;          // and back
+        std::vector<PipelinePeriod> period_pool;
+        std::vector<PipelineFrame> frame_pool;
+        int64_t pending_skip;       // convert stage: frames to skip before the next frame it queues
+        int frame_channels;
+
+        // Shared encoder: { sharedEncoder: true } encodes on the process-wide pool, one lane per encoder
+        bool shared_encoder;
+        std::vector<PooledEncoder *> lanes;
+
+        // Level metering: { levels: true }
+        bool metering;
+        LevelMeter meter;
+
+        // Spectrum analysis: { spectrum: { bands: 32, fftSize: 2048, rate: 30 } }
+        bool analyzing;
+        int spectrum_bands;
+        int spectrum_fft_size;
+        double spectrum_rate;
+        SpectrumAnalyzer spectrum;
+
+        // Raw PCM tap into JS owned memory
+        PcmTap tap;
+        Napi::ObjectReference tap_memory;
+        bool tap_enabled;
+
+        // Pre-warmed pipelines
+        bool use_pool;
+        bool warm_start;
+        int64_t start_requested_ns;
 
         // Capturing related
-        snd_pcm_t *handle;
-        char* buffer;
+        std::string source_spec;
+        CaptureInput input;
 
         // Resampling related
-        struct SwrContext *swr_ctx;
-        uint8_t **src_data;
-        uint8_t **dst_data;
+        SampleConverter converter;
+        bool fused_conversion;      // capture format matches the encoder, convert without swr
+        ResamplerQuality resampler_quality;     // tier a session starts with
+        bool resampler_auto;        // step down a tier when periods run close to their deadline
+        std::atomic<int> resampler_tier;        // tier in use
+        int budget_periods;
+        int budget_overruns;
+
+        // Silence gate: { silence: { mode: "skip" | "zero", thresholdDb, hangoverMs } }
+        SilenceGate silence;
+        int silence_mode;
+        double silence_threshold_db;
+        double silence_hangover_ms;
+        std::vector<float> zero_samples;    // what a closed gate in zero mode encodes
+        float *zero_planes[DEFAULT_AUD_CHANNELS];
 
-        bool isClosing;
+        enum { IDLE, STARTING, RUNNING, STOPPING } state;
+        std::vector<Napi::Promise::Deferred> stop_waiters;     // stopListener() calls made while STOPPING
+        std::atomic<bool> isClosing;
+        CaptureStats stats;
+        double period_seconds;
 };
 
 #endif
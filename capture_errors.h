@@ -0,0 +1,22 @@
+#ifndef CAPTURE_ERRORS_H
+#define CAPTURE_ERRORS_H
+
+#define RES_NOT_MUL_OF_TWO 1
+#define COULD_NOT_FIND_VID_CODEC 2
+#define CONTEXT_CREATION_ERROR 3
+#define COULD_NOT_OPEN_VID_CODEC 4
+#define COULD_NOT_OPEN_FILE 5
+#define COULD_NOT_ALLOCATE_FRAME 6
+#define COULD_NOT_ALLOCATE_PIC_BUF 7
+#define ERROR_ENCODING_FRAME_SEND 8
+#define ERROR_ENCODING_FRAME_RECEIVE 9
+#define COULD_NOT_FIND_AUD_CODEC 10
+#define COULD_NOT_OPEN_AUD_CODEC 11
+#define COULD_NOT_ALL_RESMPL_CONTEXT 12
+#define FAILED_TO_INIT_RESMPL_CONTEXT 13
+#define COULD_NOT_ALLOC_SAMPLES 14
+#define COULD_NOT_CONVERT_AUD 15
+#define ERROR_ENCODING_SAMPLES_SEND 16
+#define ERROR_ENCODING_SAMPLES_RECEIVE 17
+
+#endif
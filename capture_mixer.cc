@@ -0,0 +1,419 @@
+#include "capture_mixer.h"
+#include "capture_stats.h"
+#include "resampler.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+typedef float vec4 __attribute__((vector_size(16)));
+
+/* dst = gain * src, four samples per vector */
+static void mix_scale(float *dst, const float *src, float gain, int frames)
+{
+    vec4 g = { gain, gain, gain, gain };
+    int i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        vec4 s;
+        memcpy(&s, src + i, sizeof(s));
+        s *= g;
+        memcpy(dst + i, &s, sizeof(s));
+    }
+    for (; i < frames; i++)
+        dst[i] = gain * src[i];
+}
+
+/* dst += gain * src */
+static void mix_accumulate(float *dst, const float *src, float gain, int frames)
+{
+    vec4 g = { gain, gain, gain, gain };
+    int i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        vec4 d, s;
+        memcpy(&d, dst + i, sizeof(d));
+        memcpy(&s, src + i, sizeof(s));
+        d += g * s;
+        memcpy(dst + i, &d, sizeof(d));
+    }
+    for (; i < frames; i++)
+        dst[i] += gain * src[i];
+}
+
+/* Planar float to interleaved S16, clipping what the sum pushed past full scale */
+static void interleave_s16(float * const *planes, int16_t *out, int frames, int channels)
+{
+    for (int i = 0; i < frames; i++) {
+        for (int c = 0; c < channels; c++) {
+            float sample = planes[c][i] * 32768.0f;
+            sample = sample > 32767.0f ? 32767.0f : sample < -32768.0f ? -32768.0f : sample;
+            out[i * channels + c] = (int16_t) lrintf(sample);
+        }
+    }
+}
+
+MixCaptureSource::MixCaptureSource(unsigned int mix_rate, unsigned int mix_channels, double jitter_ms):
+    jitter_ms(jitter_ms), jitter_frames(0), max_queued_frames(0), running(false), period_frames(0)
+{
+    rate = mix_rate;
+    number_of_channels = mix_channels;
+    paced = false;  // the first input sets the pace
+}
+
+MixCaptureSource::~MixCaptureSource()
+{
+    close();
+    for (size_t i = 0; i < inputs.size(); i++) {
+        delete inputs[i]->source;
+        delete inputs[i];
+    }
+}
+
+void MixCaptureSource::add_input(CaptureSource *source, float gain)
+{
+    MixInput *input = new MixInput();
+    input->source = source;
+    input->gain = gain;
+    input->frames = 0;
+    input->buffer = NULL;
+    input->swr_ctx = NULL;
+    input->converted = NULL;
+    input->converted_capacity = 0;
+    input->fifo = NULL;
+    input->newest_ns = 0;
+    input->ended = false;
+    input->offset = 0;
+    input->compensation = 0;
+    input->applied_compensation = 0;
+    input->underruns = 0;
+    input->overflows = 0;
+    inputs.push_back(input);
+}
+
+int MixCaptureSource::open(unsigned long *frames)
+{
+    int ret;
+
+    if (inputs.empty())
+        return -EINVAL;
+
+    period_frames = *frames;
+    jitter_frames = jitter_ms * rate / 1000;
+    max_queued_frames = jitter_frames + 4 * *frames;
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        MixInput *input = inputs[i];
+        CaptureSource *source = input->source;
+
+        input->frames = *frames;
+        ret = source->open(&input->frames);
+        if (ret) {
+            close();
+            return ret;
+        }
+
+        input->buffer = (char *) malloc(input->frames * source->bytes_per_frame());
+        input->swr_ctx = create_format_resampler(av_get_default_channel_layout(source->channels()), AV_SAMPLE_FMT_S16,
+                                                 source->sample_rate(), av_get_default_channel_layout(number_of_channels),
+                                                 AV_SAMPLE_FMT_FLTP, rate);
+        /* Room for drift compensation stretching a period */
+        input->converted_capacity = av_rescale_rnd(input->frames, rate, source->sample_rate(), AV_ROUND_UP) + 256;
+        ret = av_samples_alloc_array_and_samples(&input->converted, NULL, number_of_channels,
+                                                 input->converted_capacity, AV_SAMPLE_FMT_FLTP, 0);
+        input->fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, number_of_channels,
+                                          max_queued_frames + input->converted_capacity);
+        if (!input->buffer || !input->swr_ctx || ret < 0 || !input->fifo) {
+            fprintf(stderr, "Could not set up mixer input %s\n", source->name());
+            close();
+            return -ENOMEM;
+        }
+    }
+
+    for (unsigned int c = 0; c < number_of_channels; c++) {
+        mix_planes.push_back((float *) av_malloc(*frames * sizeof(float)));
+        input_planes.push_back((float *) av_malloc(*frames * sizeof(float)));
+    }
+    read_pointers.resize(number_of_channels);
+
+    printf("Mixing %zu sources (%u Hz, %u channels, %.0f ms jitter buffer, %lu frames per period)\n",
+           inputs.size(), rate, number_of_channels, jitter_ms, *frames);
+    start_readers();
+    return 0;
+}
+
+void MixCaptureSource::start_readers()
+{
+    for (size_t i = 0; i < inputs.size(); i++) {
+        MixInput *input = inputs[i];
+        input->ended = false;
+        input->offset = 0;
+        input->compensation = 0;
+        input->applied_compensation = 0;
+        swr_set_compensation(input->swr_ctx, 0, rate);
+    }
+    running = true;
+    for (size_t i = 0; i < inputs.size(); i++)
+        inputs[i]->thread = std::thread(&MixCaptureSource::capture, this, inputs[i]);
+}
+
+void MixCaptureSource::stop_readers()
+{
+    running = false;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (inputs[i]->thread.joinable())
+            inputs[i]->thread.join();
+    }
+}
+
+/* Reader thread: captures and resamples one input into its FIFO */
+void MixCaptureSource::capture(MixInput *input)
+{
+    CaptureSource *source = input->source;
+
+    while (running) {
+        long got = source->read(input->buffer, input->frames);
+        int64_t captured_ns = monotonic_ns();
+        if (got == 0 && source->at_end())
+            break;
+        if (got <= 0) {
+            if (source->recover(got)) {
+                fprintf(stderr, "Mixer input %s failed: '%ld'\n", source->name(), got);
+                break;
+            }
+            continue;
+        }
+
+        int delta = input->compensation.load(std::memory_order_relaxed);
+        if (delta != input->applied_compensation) {
+            swr_set_compensation(input->swr_ctx, delta, rate);
+            input->applied_compensation = delta;
+        }
+        int converted = swr_convert(input->swr_ctx, input->converted, input->converted_capacity,
+                                    (const uint8_t **) &input->buffer, got);
+        if (converted <= 0)
+            continue;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            av_audio_fifo_write(input->fifo, (void **) input->converted, converted);
+            input->newest_ns = captured_ns;
+            /* Nobody is keeping up with this input; drop its oldest audio to bound the latency */
+            int excess = av_audio_fifo_size(input->fifo) - max_queued_frames;
+            if (excess > 0) {
+                av_audio_fifo_drain(input->fifo, excess);
+                input->overflows.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        data_available.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        input->ended = true;
+    }
+    data_available.notify_all();
+}
+
+/* Capture time of the oldest queued sample, with the mixer's mutex held */
+int64_t MixCaptureSource::oldest_ns(const MixInput *input) const
+{
+    return input->newest_ns - (int64_t) av_audio_fifo_size(input->fifo) * 1000000000LL / rate;
+}
+
+/*
+ * Fills planes with offset frames of silence followed by frames of queued audio, padding
+ * with silence when the input has less. Returns the number of queued frames used.
+ */
+int MixCaptureSource::take(MixInput *input, float **planes, int offset, int frames)
+{
+    for (unsigned int c = 0; c < number_of_channels; c++) {
+        memset(planes[c], 0, offset * sizeof(float));
+        read_pointers[c] = planes[c] + offset;
+    }
+    int got = av_audio_fifo_read(input->fifo, read_pointers.data(), frames);
+    if (got < 0)
+        got = 0;
+    if (got < frames) {
+        for (unsigned int c = 0; c < number_of_channels; c++)
+            memset(planes[c] + offset + got, 0, (frames - got) * sizeof(float));
+        if (!input->ended)
+            input->underruns.fetch_add(1, std::memory_order_relaxed);
+    }
+    return got;
+}
+
+long MixCaptureSource::read(char *buffer, unsigned long frames)
+{
+    MixInput *clock = inputs[0];
+    int needed;
+
+    if (frames > period_frames)
+        frames = period_frames;
+    needed = frames + jitter_frames;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!data_available.wait_for(lock, std::chrono::seconds(1), [clock, needed] {
+            return av_audio_fifo_size(clock->fifo) >= needed || clock->ended; })) {
+        fprintf(stderr, "Mixer input %s stopped delivering\n", clock->source->name());
+        return -EIO;
+    }
+    if (clock->ended && !av_audio_fifo_size(clock->fifo))
+        return 0;
+
+    int64_t clock_ns = oldest_ns(clock);
+    take(clock, input_planes.data(), 0, frames);
+    for (unsigned int c = 0; c < number_of_channels; c++)
+        mix_scale(mix_planes[c], input_planes[c], clock->gain, frames);
+
+    for (size_t i = 1; i < inputs.size(); i++) {
+        MixInput *input = inputs[i];
+        int lead = 0;
+
+        if (av_audio_fifo_size(input->fifo)) {
+            /* Positive when this input's queued audio starts later than the clock's */
+            double offset = (oldest_ns(input) - clock_ns) * 1e-9 * rate;
+            input->offset = input->offset * 0.9 + offset * 0.1;
+            if (fabs(offset) > frames / 2) {
+                /* Too far apart to steer, e.g. at start or after an overrun: jump */
+                if (offset < 0)
+                    av_audio_fifo_drain(input->fifo, std::min((int) -offset, av_audio_fifo_size(input->fifo)));
+                else
+                    lead = std::min((int) offset, (int) frames);
+                input->offset = 0;
+            }
+            /* Steer the resampler by the remaining offset, at most 0.5% */
+            int limit = rate / 200;
+            int delta = lrint(input->offset);
+            delta = delta > limit ? limit : delta < -limit ? -limit : delta;
+            input->compensation.store(delta, std::memory_order_relaxed);
+        }
+
+        take(input, input_planes.data(), lead, frames - lead);
+        for (unsigned int c = 0; c < number_of_channels; c++)
+            mix_accumulate(mix_planes[c], input_planes[c], input->gain, frames);
+    }
+    lock.unlock();
+
+    interleave_s16(mix_planes.data(), (int16_t *) buffer, frames, number_of_channels);
+    return frames;
+}
+
+bool MixCaptureSource::at_end() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return inputs[0]->ended && !av_audio_fifo_size(inputs[0]->fifo);
+}
+
+int MixCaptureSource::reset()
+{
+    int err = 0;
+
+    stop_readers();
+    CaptureSource::reset();
+    for (size_t i = 0; i < inputs.size(); i++) {
+        MixInput *input = inputs[i];
+        int ret = input->source->reset();
+        if (ret)
+            err = ret;
+        av_audio_fifo_reset(input->fifo);
+        swr_init(input->swr_ctx);
+        input->newest_ns = 0;
+    }
+    return err;
+}
+
+int MixCaptureSource::resume()
+{
+    if (running)
+        return 0;
+    /* What the inputs buffered while nobody read them is stale by now */
+    int err = reset();
+    start_readers();
+    return err;
+}
+
+void MixCaptureSource::close()
+{
+    stop_readers();
+    for (size_t i = 0; i < inputs.size(); i++) {
+        MixInput *input = inputs[i];
+        if (input->fifo)
+            printf("Mixer input %s: %llu underruns, %llu overflows\n", input->source->name(),
+                   (unsigned long long) input->underruns.load(), (unsigned long long) input->overflows.load());
+
+        input->source->close();
+        free(input->buffer);
+        input->buffer = NULL;
+        swr_free(&input->swr_ctx);
+        if (input->converted)
+            av_freep(&input->converted[0]);
+        av_freep(&input->converted);
+        if (input->fifo)
+            av_audio_fifo_free(input->fifo);
+        input->fifo = NULL;
+    }
+    for (size_t c = 0; c < mix_planes.size(); c++) {
+        av_free(mix_planes[c]);
+        av_free(input_planes[c]);
+    }
+    mix_planes.clear();
+    input_planes.clear();
+}
+
+static double mix_option(const std::string &options, const char *key, double fallback)
+{
+    size_t pos = options.find(std::string(",") + key + "=");
+    if (pos == std::string::npos)
+        return fallback;
+    return atof(options.c_str() + pos + strlen(key) + 2);
+}
+
+CaptureSource *create_mixing_capture_source(const char *spec)
+{
+    if (!spec || strncmp(spec, "mix", 3) || (spec[3] != ':' && spec[3] != ','))
+        return create_capture_source(spec);
+
+    std::string text = spec;
+    size_t colon = text.find(':');
+    if (colon == std::string::npos || colon + 1 == text.size()) {
+        fprintf(stderr, "Capture source '%s' has no inputs\n", spec);
+        return NULL;
+    }
+
+    std::string options = text.substr(3, colon - 3) + ",";
+    MixCaptureSource *mixer = new MixCaptureSource(mix_option(options, "rate", 44100), mix_option(options, "channels", 2),
+                                                   mix_option(options, "jitter", 20));
+
+    /* Inputs are separated by '|', which no device name or option uses; '@' gives a linear gain */
+    std::string inputs = text.substr(colon + 1);
+    size_t start = 0;
+    while (true) {
+        size_t bar = inputs.find('|', start);
+        std::string input = inputs.substr(start, bar == std::string::npos ? std::string::npos : bar - start);
+        float gain = 1.0f;
+        size_t at = input.rfind('@');
+        if (at != std::string::npos) {
+            /* Only a trailing number is a gain, so a path like file:/takes/take@2/mic.wav stays whole */
+            const char *number = input.c_str() + at + 1;
+            char *end;
+            double value = strtod(number, &end);
+            if (end != number && !*end && isfinite(value)) {
+                gain = value;
+                input.erase(at);
+            }
+        }
+
+        CaptureSource *source = create_capture_source(input.c_str());
+        if (!source) {
+            delete mixer;
+            return NULL;
+        }
+        mixer->add_input(source, gain);
+
+        if (bar == std::string::npos)
+            break;
+        start = bar + 1;
+    }
+    return mixer;
+}
@@ -0,0 +1,94 @@
+#ifndef CAPTURE_MIXER_H
+#define CAPTURE_MIXER_H
+
+extern "C"
+{
+#include <libavutil/audio_fifo.h>
+#include <libswresample/swresample.h>
+}
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "capture_source.h"
+
+/* One source feeding the mix, read on its own thread into a jitter buffer */
+struct MixInput
+{
+    CaptureSource *source;
+    float gain;
+    unsigned long frames;
+    char *buffer;
+    struct SwrContext *swr_ctx;         // to the mix rate and channels, planar float
+    uint8_t **converted;
+    int converted_capacity;
+    AVAudioFifo *fifo;                  // guarded by the mixer's mutex, like the fields below
+    int64_t newest_ns;                  // capture time of the newest sample in fifo
+    bool ended;
+    double offset;                      // smoothed alignment error against the first input, in frames
+    std::atomic<int> compensation;      // frames to add (or drop) per second of output
+    int applied_compensation;           // reader thread only
+    std::atomic<uint64_t> underruns;
+    std::atomic<uint64_t> overflows;
+    std::thread thread;
+};
+
+/*
+ * Mixes several capture sources into one interleaved S16 stream, so a microphone and a
+ * loopback device can be encoded together. The spec is
+ *
+ *   mix[,rate=44100][,channels=2][,jitter=20]:spec[@gain]|spec[@gain]|...
+ *
+ * Every input is read on its own thread and resampled into a FIFO. The first input is the
+ * clock: read() returns once it has a period plus the jitter buffer queued, which bounds the
+ * added latency to the jitter buffer. The other inputs are aligned to it by capture time;
+ * small offsets are corrected by swr_set_compensation() so drift between two devices' clocks
+ * is absorbed smoothly, large ones by dropping or padding samples. An input that has
+ * nothing to offer is mixed as silence instead of holding up the others.
+ */
+class MixCaptureSource: public CaptureSource
+{
+    public:
+        MixCaptureSource(unsigned int mix_rate, unsigned int mix_channels, double jitter_ms);
+        ~MixCaptureSource();
+
+        /* Takes ownership of source */
+        void add_input(CaptureSource *source, float gain);
+
+        int open(unsigned long *frames);
+        long read(char *buffer, unsigned long frames);
+        void close();
+        int reset();
+        void suspend() { stop_readers(); }
+        int resume();
+        bool at_end() const;
+        bool live() const { return true; }         // the input threads keep reading into their FIFOs
+        const char *name() const { return "mix"; }
+
+    private:
+        void start_readers();
+        void stop_readers();
+        void capture(MixInput *input);
+        int64_t oldest_ns(const MixInput *input) const;
+        int take(MixInput *input, float **planes, int offset, int frames);
+
+        std::vector<MixInput *> inputs;
+        double jitter_ms;
+        int jitter_frames;
+        int max_queued_frames;
+        std::atomic<bool> running;
+        mutable std::mutex mutex;
+        std::condition_variable data_available;
+
+        unsigned long period_frames;
+        std::vector<float *> mix_planes;
+        std::vector<float *> input_planes;
+        std::vector<void *> read_pointers;
+};
+
+/* Like create_capture_source(), and also accepts the mix: spec above */
+CaptureSource *create_mixing_capture_source(const char *spec);
+
+#endif
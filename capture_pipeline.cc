@@ -0,0 +1,347 @@
+#include "capture_pipeline.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture_errors.h"
+
+CaptureInput::CaptureInput()
+{
+    src = NULL;
+    buf = NULL;
+    period_frames = 0;
+    opened = false;
+}
+
+CaptureInput::~CaptureInput()
+{
+    close();
+}
+
+void CaptureInput::reset(CaptureSource *source)
+{
+    close();
+    src = source;
+}
+
+int CaptureInput::allocate()
+{
+    /* One period in bytes, e.g. 2 bytes/sample and 2 channels for S16 stereo */
+    buf = (char *) malloc(size());
+    if (!buf) {
+        fprintf(stderr, "Could not allocate the capture buffer\n");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+int CaptureInput::open(unsigned long frames)
+{
+    if (!src)
+        return -EINVAL;
+
+    period_frames = frames;
+    int err = src->open(&period_frames);
+    if (err)
+        return err;
+    opened = true;
+
+    err = allocate();
+    if (err) {
+        close();
+        return err;
+    }
+
+    printf("Sample rate: %d Hz\n", src->sample_rate());
+    printf("Channels: %d\n", src->channels());
+    printf("Number of frames: %lu\n", period_frames);
+    return 0;
+}
+
+int CaptureInput::adopt(CaptureSource *source, unsigned long frames)
+{
+    close();
+    src = source;
+    period_frames = frames;
+    opened = true;
+    int err = allocate();
+    if (err)
+        close();
+    return err;
+}
+
+CaptureSource *CaptureInput::detach()
+{
+    CaptureSource *source = src;
+    free(buf);
+    buf = NULL;
+    src = NULL;
+    opened = false;
+    return source;
+}
+
+void CaptureInput::close()
+{
+    if (src && opened)
+        src->close();
+    delete src;
+    src = NULL;
+    free(buf);
+    buf = NULL;
+    opened = false;
+}
+
+SampleConverter::SampleConverter()
+{
+    swr_ctx = NULL;
+    kernel = NULL;
+    format = SAMPLE_S16;
+    out = NULL;
+    capacity = 0;
+    src_channels = 0;
+    src_rate = 0;
+    dst_channels = 0;
+    dst_rate = 0;
+}
+
+SampleConverter::~SampleConverter()
+{
+    close();
+}
+
+void SampleConverter::close()
+{
+    swr_free(&swr_ctx);
+    if (out)
+        av_freep(&out[0]);
+    av_freep(&out);
+    capacity = 0;
+}
+
+struct SwrContext *SampleConverter::create(ResamplerQuality quality) const
+{
+    int64_t src_layout = av_get_default_channel_layout(src_channels);
+    int64_t dst_layout = av_get_default_channel_layout(dst_channels);
+
+    if (format == SAMPLE_S16)
+        return create_resampler(src_layout, src_rate, dst_layout, dst_rate, quality);
+    return create_format_resampler(src_layout, AV_SAMPLE_FMT_FLT, src_rate, dst_layout, AV_SAMPLE_FMT_FLTP, dst_rate, quality);
+}
+
+void SampleConverter::configure(int src_ch, int in_rate, int dst_ch, int out_rate, SampleFormat sample_format)
+{
+    close();
+    src_channels = src_ch;
+    src_rate = in_rate;
+    dst_channels = dst_ch;
+    dst_rate = out_rate;
+    format = sample_format;
+    kernel = find_converter(format, needs_resampler() ? LAYOUT_INTERLEAVED : LAYOUT_PLANAR, src_channels);
+}
+
+int SampleConverter::init(int src_ch, int in_rate, int dst_ch, int out_rate, ResamplerQuality quality,
+                          SampleFormat sample_format)
+{
+    configure(src_ch, in_rate, dst_ch, out_rate, sample_format);
+    if (!needs_resampler())
+        return 0;
+    swr_ctx = create(quality);
+    return swr_ctx ? 0 : FAILED_TO_INIT_RESMPL_CONTEXT;
+}
+
+int SampleConverter::adopt(struct SwrContext *ctx, int src_ch, int in_rate, int dst_ch, int out_rate)
+{
+    configure(src_ch, in_rate, dst_ch, out_rate, SAMPLE_S16);
+    if (!needs_resampler()) {
+        swr_free(&ctx);
+        return 0;
+    }
+    swr_ctx = ctx ? ctx : create(RESAMPLER_DEFAULT);
+    return swr_ctx ? 0 : FAILED_TO_INIT_RESMPL_CONTEXT;
+}
+
+struct SwrContext *SampleConverter::detach()
+{
+    struct SwrContext *ctx = swr_ctx;
+    swr_ctx = NULL;
+    close();
+    return ctx;
+}
+
+int SampleConverter::max_output(int frames) const
+{
+    return swr_ctx ? swr_get_out_samples(swr_ctx, frames) : frames;
+}
+
+int SampleConverter::reserve(int frames)
+{
+    /* Headroom for the filter's delay line, which varies a little from call to call */
+    int needed = max_output(frames) + (swr_ctx ? 256 : 0);
+    if (needed <= capacity)
+        return 0;
+
+    if (out)
+        av_freep(&out[0]);
+    av_freep(&out);
+    if (av_samples_alloc_array_and_samples(&out, NULL, dst_channels, needed, AV_SAMPLE_FMT_FLTP, 0) < 0) {
+        capacity = 0;
+        return -ENOMEM;
+    }
+    capacity = needed;
+    if (swr_ctx && format != SAMPLE_S16)
+        interleaved.resize((size_t) frames * src_channels);
+    return 0;
+}
+
+int SampleConverter::convert(const void *samples, int frames, SignalLevel *level)
+{
+    /* Sized for the worst case of this call, so swr never has to hold output back */
+    if (max_output(frames) > capacity && reserve(frames))
+        return -ENOMEM;
+    return convert_frames((float **) out, capacity, samples, frames, level);
+}
+
+int SampleConverter::convert_to(float **planes, const void *samples, int frames)
+{
+    return convert_frames(planes, max_output(frames), samples, frames, NULL);
+}
+
+int SampleConverter::convert_frames(float **planes, int room, const void *samples, int frames, SignalLevel *level)
+{
+    if (!swr_ctx) {
+        if (!samples)
+            return 0;
+        if (level && format == SAMPLE_S16)
+            convert_s16_to_fltp((const int16_t *) samples, planes, frames, src_channels, level);
+        else
+            kernel((const uint8_t *) samples, planes, frames, src_channels);
+        return frames;
+    }
+
+    const uint8_t *in = (const uint8_t *) samples;
+    if (samples && level && format == SAMPLE_S16)
+        measure_s16((const int16_t *) samples, (long) frames * src_channels, level);
+    if (samples && format != SAMPLE_S16) {
+        if (interleaved.size() < (size_t) frames * src_channels)
+            interleaved.resize((size_t) frames * src_channels);
+        float *scratch = interleaved.data();
+        kernel(in, &scratch, frames, src_channels);
+        in = (const uint8_t *) scratch;
+    }
+    return swr_convert(swr_ctx, (uint8_t **) planes, room, samples ? &in : NULL, frames);
+}
+
+int64_t SampleConverter::reset()
+{
+    if (!swr_ctx)
+        return 0;
+
+    /* A resampler is reset by initializing it again, which drops its delay line */
+    int64_t held = swr_get_delay(swr_ctx, dst_rate);
+    if (held > 0)
+        swr_init(swr_ctx);
+    return held;
+}
+
+int SampleConverter::set_quality(ResamplerQuality quality)
+{
+    if (!swr_ctx)
+        return 0;
+    struct SwrContext *ctx = create(quality);
+    if (!ctx)
+        return FAILED_TO_INIT_RESMPL_CONTEXT;
+    int drained = drain();
+    if (drained < 0) {
+        swr_free(&ctx);
+        return drained;
+    }
+    swr_free(&swr_ctx);
+    swr_ctx = ctx;
+    return drained;
+}
+
+FrameAssembler::FrameAssembler()
+{
+    fifo = NULL;
+    size = 0;
+}
+
+FrameAssembler::~FrameAssembler()
+{
+    release();
+}
+
+void FrameAssembler::release()
+{
+    for (float *plane: planes)
+        av_free(plane);
+    planes.clear();
+    if (fifo)
+        av_audio_fifo_free(fifo);
+    fifo = NULL;
+}
+
+int FrameAssembler::init(int channels, int frame_size)
+{
+    release();
+    size = frame_size;
+    fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, channels, frame_size * 2);
+    if (!fifo)
+        return -ENOMEM;
+    for (int c = 0; c < channels; c++) {
+        float *plane = (float *) av_mallocz(frame_size * sizeof(float));
+        if (!plane)
+            return -ENOMEM;
+        planes.push_back(plane);
+    }
+    return 0;
+}
+
+int FrameAssembler::write(float **samples, int frames)
+{
+    if (!fifo)
+        return -EINVAL;
+    return av_audio_fifo_write(fifo, (void **) samples, frames) < frames ? -ENOMEM : 0;
+}
+
+int FrameAssembler::write_silence(int frames)
+{
+    if (!fifo)
+        return -EINVAL;
+    for (float *plane: planes)
+        memset(plane, 0, size * sizeof(float));
+    while (frames > 0) {
+        int n = frames < size ? frames : size;
+        if (av_audio_fifo_write(fifo, (void **) planes.data(), n) < n)
+            return -ENOMEM;
+        frames -= n;
+    }
+    return 0;
+}
+
+bool FrameAssembler::next()
+{
+    if (!fifo || av_audio_fifo_size(fifo) < size)
+        return false;
+    av_audio_fifo_read(fifo, (void **) planes.data(), size);
+    return true;
+}
+
+bool FrameAssembler::flush()
+{
+    int left = pending();
+    if (!left)
+        return false;
+    if (left > size)
+        left = size;
+    av_audio_fifo_read(fifo, (void **) planes.data(), left);
+    for (float *plane: planes)
+        memset(plane + left, 0, (size - left) * sizeof(float));
+    return true;
+}
+
+void FrameAssembler::clear()
+{
+    if (fifo)
+        av_audio_fifo_reset(fifo);
+}
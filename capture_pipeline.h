@@ -0,0 +1,173 @@
+#ifndef CAPTURE_PIPELINE_H
+#define CAPTURE_PIPELINE_H
+
+extern "C"
+{
+#include <libavutil/audio_fifo.h>
+#include <libswresample/swresample.h>
+}
+#include <stdint.h>
+#include <vector>
+#include "capture_source.h"
+#include "resampler.h"
+#include "sample_convert.h"
+
+/*
+ * Stages shared by the tools and the addon, each owning what it allocates:
+ *
+ *   CaptureInput -> SampleConverter -> FrameAssembler -> AudioEncoder -> sink
+ *
+ * The encoder is AudioEncoder (audio_encoder.h) and the sinks are in tee_sink.h,
+ * wav_sink.h and async_file_sink.h.
+ */
+
+/* A capture source and a buffer of one period */
+class CaptureInput
+{
+    public:
+        CaptureInput();
+        ~CaptureInput();
+
+        /* Takes ownership of an unopened source, closing any previous one */
+        void reset(CaptureSource *source);
+
+        /* Opens the source with a period of about frames and allocates the buffer; returns 0 or an error */
+        int open(unsigned long frames);
+        int open(CaptureSource *source, unsigned long frames) { reset(source); return open(frames); }
+
+        /* Takes ownership of a source that is already open with periods of frames, e.g. a warm one */
+        int adopt(CaptureSource *source, unsigned long frames);
+
+        /* Gives the source back still open, e.g. to the pipeline pool, and frees the buffer */
+        CaptureSource *detach();
+
+        /* Closes and deletes the source */
+        void close();
+
+        /* Reads up to one period into buffer(); returns frames read or a negative error */
+        long read() { return src->read(buf, period_frames); }
+
+        CaptureSource *source() const { return src; }
+        char *buffer() const { return buf; }
+        unsigned long frames() const { return period_frames; }
+        int size() const { return period_frames * src->bytes_per_frame(); }
+
+    private:
+        int allocate();
+
+        CaptureSource *src;
+        char *buf;
+        unsigned long period_frames;
+        bool opened;
+};
+
+/*
+ * Interleaved samples at the capture format to planar float at the encoder's. Matching
+ * channels and rates need no resampler, only the format conversion kernel; other input
+ * formats than S16 are converted to interleaved float before resampling.
+ */
+class SampleConverter
+{
+    public:
+        SampleConverter();
+        ~SampleConverter();
+
+        int init(int src_channels, int src_rate, int dst_channels, int dst_rate,
+                 ResamplerQuality quality = RESAMPLER_DEFAULT, SampleFormat format = SAMPLE_S16);
+
+        /* Takes over a default quality S16 resampler for these formats, e.g. a warm one; ctx may be NULL */
+        int adopt(struct SwrContext *ctx, int src_channels, int src_rate, int dst_channels, int dst_rate);
+
+        /* Gives the resampler back, e.g. to the pipeline pool; NULL when there is none */
+        struct SwrContext *detach();
+
+        /* Frees the resampler and the planes */
+        void close();
+
+        /* Sizes planes() for calls of up to frames, so convert() allocates nothing while running */
+        int reserve(int frames);
+
+        /*
+         * Converts frames frames into planes(); returns the number converted or a negative error.
+         * level, for S16 input, is measured on the way: in the conversion pass itself when there
+         * is no resampler.
+         */
+        int convert(const void *samples, int frames, SignalLevel *level = NULL);
+
+        /* Same, into the caller's planes, which have room for max_output(frames) */
+        int convert_to(float **planes, const void *samples, int frames);
+
+        /* Converts what the filter still holds; call once at the end */
+        int drain() { return convert(NULL, 0); }
+
+        /* Empties the resampler's delay line; returns the frames it held, at the output rate */
+        int64_t reset();
+
+        /*
+         * Replaces the resampler with one of another tier. What the old one still held is drained
+         * into planes() first; returns that frame count or a negative error.
+         */
+        int set_quality(ResamplerQuality quality);
+
+        /* Upper bound of what the next convert() of frames gives out */
+        int max_output(int frames) const;
+
+        float **planes() const { return (float **) out; }
+        int channels() const { return dst_channels; }
+        bool resampling() const { return swr_ctx != NULL; }
+
+    private:
+        void configure(int src_channels, int src_rate, int dst_channels, int dst_rate, SampleFormat format);
+        bool needs_resampler() const { return src_channels != dst_channels || src_rate != dst_rate; }
+        struct SwrContext *create(ResamplerQuality quality) const;
+        int convert_frames(float **planes, int room, const void *samples, int frames, SignalLevel *level);
+
+        struct SwrContext *swr_ctx;     // NULL when the formats match
+        ConvertFunction kernel;         // to planar float without a resampler, to interleaved float before one
+        SampleFormat format;
+        std::vector<float> interleaved; // resampler input for formats other than S16
+        uint8_t **out;
+        int capacity;
+        int src_channels;
+        int src_rate;
+        int dst_channels;
+        int dst_rate;
+};
+
+/* Regroups planar float into the fixed frames an encoder takes, whatever the period size */
+class FrameAssembler
+{
+    public:
+        FrameAssembler();
+        ~FrameAssembler();
+
+        int init(int channels, int frame_size);
+
+        /* Queues frames samples per channel; returns 0 or a negative error */
+        int write(float **planes, int frames);
+
+        /* Queues frames of silence; overwrites frame() */
+        int write_silence(int frames);
+
+        /* Takes the next whole frame into frame(); false when there is not one yet */
+        bool next();
+
+        /* Takes what is left, padded with silence, into frame(); false when nothing is left */
+        bool flush();
+
+        /* Forgets what is queued */
+        void clear();
+
+        float **frame() { return planes.data(); }
+        int frame_size() const { return size; }
+        int pending() const { return fifo ? av_audio_fifo_size(fifo) : 0; }
+
+    private:
+        void release();
+
+        AVAudioFifo *fifo;
+        std::vector<float *> planes;
+        int size;
+};
+
+#endif
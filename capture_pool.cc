@@ -0,0 +1,197 @@
+#include "capture_pool.h"
+
+CapturePool &CapturePool::instance()
+{
+    static CapturePool pool;
+    return pool;
+}
+
+CapturePool::CapturePool()
+{
+    stopping = false;
+    refill_thread = std::thread(&CapturePool::refill, this);
+}
+
+CapturePool::~CapturePool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    refill_thread.join();
+
+    for (auto &entry : idle)
+        for (WarmPipeline *pipeline : entry.second)
+            close_pipeline(pipeline);
+    for (auto &entry : returned)
+        for (WarmPipeline *pipeline : entry.second)
+            close_pipeline(pipeline);
+}
+
+WarmPipeline *CapturePool::open_pipeline(const std::string &spec)
+{
+    WarmPipeline *pipeline = new WarmPipeline();
+    pipeline->frames = 1024;
+    pipeline->source = create_mixing_capture_source(spec.c_str());
+    if (!pipeline->source || pipeline->source->open(&pipeline->frames)) {
+        close_pipeline(pipeline);
+        return NULL;
+    }
+    /* An idle pipeline captures nothing; acquire() resumes it */
+    pipeline->source->suspend();
+
+    bool resampling = pipeline->source->channels() != DEFAULT_AUD_CHANNELS ||
+        pipeline->source->sample_rate() != DEFAULT_AUD_SAMPLE_RATE;
+    if (resampling)
+        pipeline->swr_ctx = create_resampler(av_get_default_channel_layout(pipeline->source->channels()),
+                                             pipeline->source->sample_rate(),
+                                             AV_CH_LAYOUT_STEREO, DEFAULT_AUD_SAMPLE_RATE);
+    if ((resampling && !pipeline->swr_ctx) || open_encoder(pipeline)) {
+        close_pipeline(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+int CapturePool::open_encoder(WarmPipeline *pipeline)
+{
+    pipeline->encoder = new AudioEncoder();
+    int ret = pipeline->encoder->init(NULL, DEFAULT_AUD_BIT_RATE, DEFAULT_AUD_SAMPLE_RATE, AV_CH_LAYOUT_STEREO, NULL);
+    if (ret) {
+        delete pipeline->encoder;
+        pipeline->encoder = NULL;
+    }
+    return ret;
+}
+
+void CapturePool::close_pipeline(WarmPipeline *pipeline)
+{
+    delete pipeline->encoder;
+    swr_free(&pipeline->swr_ctx);
+    if (pipeline->source)
+        pipeline->source->close();
+    delete pipeline->source;
+    delete pipeline;
+}
+
+int CapturePool::prewarm(const std::string &spec, int count)
+{
+    std::vector<WarmPipeline *> surplus;
+    std::unique_lock<std::mutex> guard(lock);
+
+    targets[spec] = count;
+    std::vector<WarmPipeline *> &ready = idle[spec];
+    while ((int) ready.size() > count) {
+        surplus.push_back(ready.back());
+        ready.pop_back();
+    }
+    wake.notify_all();
+
+    /* The refill thread gives up on a spec it cannot open by lowering its target */
+    refilled.wait(guard, [&] {
+        return stopping || (int) idle[spec].size() >= targets[spec];
+    });
+    int ready_count = idle[spec].size();
+    guard.unlock();
+
+    for (WarmPipeline *pipeline : surplus)
+        close_pipeline(pipeline);
+    return ready_count >= count ? 0 : -1;
+}
+
+WarmPipeline *CapturePool::acquire(const std::string &spec)
+{
+    WarmPipeline *pipeline;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<WarmPipeline *> &ready = idle[spec];
+        if (ready.empty())
+            return NULL;
+
+        pipeline = ready.back();
+        ready.pop_back();
+        wake.notify_all();
+    }
+
+    if (pipeline->source->resume()) {
+        close_pipeline(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+void CapturePool::release(const std::string &spec, WarmPipeline *pipeline)
+{
+    /* A resampler is reset by initializing it again, which drops its delay line; the source stays suspended */
+    if (pipeline->source->reset() || (pipeline->swr_ctx && swr_init(pipeline->swr_ctx) < 0)) {
+        close_pipeline(pipeline);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    returned[spec].push_back(pipeline);
+    wake.notify_all();
+}
+
+int CapturePool::idle_count(const std::string &spec)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return idle[spec].size();
+}
+
+void CapturePool::refill()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (!stopping) {
+        std::string spec;
+        WarmPipeline *pipeline = NULL;
+
+        for (auto &entry : returned) {
+            if (!entry.second.empty()) {
+                spec = entry.first;
+                pipeline = entry.second.back();
+                entry.second.pop_back();
+                break;
+            }
+        }
+
+        if (pipeline) {
+            /* Encoders are opened outside the lock so acquire() never waits on avcodec_open2 */
+            guard.unlock();
+            int ret = open_encoder(pipeline);
+            guard.lock();
+            if (ret)
+                close_pipeline(pipeline);
+            else
+                idle[spec].push_back(pipeline);
+            refilled.notify_all();
+            continue;
+        }
+
+        for (auto &entry : targets) {
+            if ((int) idle[entry.first].size() < entry.second) {
+                spec = entry.first;
+                break;
+            }
+        }
+
+        if (!spec.empty()) {
+            guard.unlock();
+            pipeline = open_pipeline(spec);
+            guard.lock();
+            if (pipeline) {
+                idle[spec].push_back(pipeline);
+            } else {
+                fprintf(stderr, "Could not pre-warm capture pipeline for %s\n", spec.c_str());
+                targets[spec] = idle[spec].size();
+            }
+            refilled.notify_all();
+            continue;
+        }
+
+        wake.wait(guard);
+    }
+    refilled.notify_all();
+}
@@ -0,0 +1,68 @@
+#ifndef CAPTURE_POOL_H
+#define CAPTURE_POOL_H
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "audio_encoder.h"
+#include "capture_mixer.h"
+#include "capture_source.h"
+#include "resampler.h"
+
+/* An opened and configured source with its resampler and an opened encoder */
+struct WarmPipeline
+{
+    CaptureSource *source;
+    unsigned long frames;
+    struct SwrContext *swr_ctx;     // NULL when the source already has the encoder's format
+    AudioEncoder *encoder;
+};
+
+/*
+ * Process-wide pool of pre-warmed pipelines, keyed by source spec.
+ *
+ * Sources and resamplers are reset and reused between sessions; sources stay suspended
+ * while idle, so a pooled mixer does not keep capturing. Encoders cannot be
+ * reused once drained, so a background thread opens a fresh one for every pipeline
+ * returned to the pool, and opens whole pipelines until each spec has its target
+ * number idle.
+ */
+class CapturePool
+{
+    public:
+        static CapturePool &instance();
+
+        /* Sets the number of idle pipelines kept for spec and blocks until it is reached */
+        int prewarm(const std::string &spec, int count);
+
+        /* Takes an idle pipeline for spec and resumes its source, or returns NULL when none is ready */
+        WarmPipeline *acquire(const std::string &spec);
+
+        /* Resets a pipeline after its session; pipeline->encoder must already be closed */
+        void release(const std::string &spec, WarmPipeline *pipeline);
+
+        int idle_count(const std::string &spec);
+
+    private:
+        CapturePool();
+        ~CapturePool();
+
+        void refill();
+        static WarmPipeline *open_pipeline(const std::string &spec);
+        static int open_encoder(WarmPipeline *pipeline);
+        static void close_pipeline(WarmPipeline *pipeline);
+
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable refilled;
+        std::map<std::string, std::vector<WarmPipeline *> > idle;       // ready to use
+        std::map<std::string, std::vector<WarmPipeline *> > returned;   // reset, waiting for an encoder
+        std::map<std::string, int> targets;
+        std::thread refill_thread;
+        bool stopping;
+};
+
+#endif
@@ -0,0 +1,542 @@
+// Use the newer ALSA API
+#define ALSA_PCM_NEW_HW_PARAMS_API
+
+#include "capture_source.h"
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+CaptureSource::CaptureSource()
+{
+    rate = 44100; // CD Quality
+    number_of_channels = 2; // stereo
+    paced = true;
+    clock_started = false;
+}
+
+int CaptureSource::reset()
+{
+    clock_started = false;
+    return 0;
+}
+
+void CaptureSource::pace(unsigned long frames)
+{
+    if (!paced)
+        return;
+
+    if (!clock_started) {
+        clock_gettime(CLOCK_MONOTONIC, &next_period);
+        clock_started = true;
+    }
+
+    /* Advance the deadline by one period and sleep until it, so drift does not accumulate */
+    long long ns = next_period.tv_nsec + (long long) frames * 1000000000LL / rate;
+    next_period.tv_sec += ns / 1000000000LL;
+    next_period.tv_nsec = ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_period, NULL) == EINTR)
+        ;
+}
+
+class AlsaCaptureSource: public CaptureSource
+{
+    public:
+        AlsaCaptureSource(const std::string &device): device(device), handle(NULL) {}
+        ~AlsaCaptureSource() { close(); }
+
+        int open(unsigned long *frames);
+        long read(char *buffer, unsigned long frames) { return snd_pcm_readi(handle, buffer, frames); }
+        int recover(int err) { return snd_pcm_recover(handle, err, 0); }
+        void close();
+        int reset();
+        bool live() const { return true; }
+        const char *name() const { return device.c_str(); }
+
+        /* A channel count of 0 captures every channel the device has */
+        void set_format(unsigned int capture_rate, unsigned int capture_channels)
+        {
+            rate = capture_rate;
+            number_of_channels = capture_channels;
+        }
+
+    private:
+        std::string device;
+        snd_pcm_t *handle;
+};
+
+int AlsaCaptureSource::open(unsigned long *frames)
+{
+    int err, dir = 0;
+    snd_pcm_hw_params_t *params;
+    snd_pcm_uframes_t period_frames = *frames;
+
+    printf("Capture device is %s\n", device.c_str());
+
+    /* Open PCM device for recording (capture). */
+    err = snd_pcm_open(&handle, device.c_str(), SND_PCM_STREAM_CAPTURE, 0);
+    if (err) {
+        fprintf(stderr, "Unable to open PCM device: %s\n", snd_strerror(err));
+        handle = NULL;
+        return err;
+    }
+
+    /* Allocate a hardware parameters object. */
+    snd_pcm_hw_params_alloca(&params);
+
+    /* Fill it in with default values. */
+    snd_pcm_hw_params_any(handle, params);
+
+    /* ### Set the desired hardware parameters. ### */
+
+    /* Interleaved mode */
+    err = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    if (err) {
+        fprintf(stderr, "Error setting interleaved mode: %s\n", snd_strerror(err));
+        close();
+        return err;
+    }
+
+    /* Signed capture format (16-bit little-endian format) */
+    err = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
+    if (err) {
+        fprintf(stderr, "Error setting format: %s\n", snd_strerror(err));
+        close();
+        return err;
+    }
+
+    /* Setting number of channels, all of them for multichannel interfaces */
+    if (!number_of_channels) {
+        err = snd_pcm_hw_params_get_channels_max(params, &number_of_channels);
+        if (err) {
+            fprintf(stderr, "Error reading channel count: %s\n", snd_strerror(err));
+            close();
+            return err;
+        }
+    }
+    err = snd_pcm_hw_params_set_channels(handle, params, number_of_channels);
+    if (err) {
+        fprintf(stderr, "Error setting channels: %s\n", snd_strerror(err));
+        close();
+        return err;
+    }
+
+    /* Setting sampling rate */
+    err = snd_pcm_hw_params_set_rate_near(handle, params, &rate, &dir);
+    if (err) {
+        fprintf(stderr, "Error setting sampling rate (%d): %s\n", rate, snd_strerror(err));
+        close();
+        return err;
+    }
+
+    /* Set period size*/
+    err = snd_pcm_hw_params_set_period_size_near(handle, params, &period_frames, &dir);
+    if (err) {
+        fprintf(stderr, "Error setting period size: %s\n", snd_strerror(err));
+        close();
+        return err;
+    }
+
+    /* Write the parameters to the driver */
+    err = snd_pcm_hw_params(handle, params);
+    if (err < 0) {
+        fprintf(stderr, "Unable to set HW parameters: %s\n", snd_strerror(err));
+        close();
+        return err;
+    }
+
+    /* Find number of frames in one period */
+    err = snd_pcm_hw_params_get_period_size(params, &period_frames, &dir);
+    if (err) {
+        fprintf(stderr, "Error retrieving period size: %s\n", snd_strerror(err));
+        close();
+        return err;
+    }
+
+    *frames = period_frames;
+    return 0;
+}
+
+void AlsaCaptureSource::close()
+{
+    if (!handle)
+        return;
+
+    snd_pcm_drop(handle);
+    snd_pcm_close(handle);
+    handle = NULL;
+}
+
+int AlsaCaptureSource::reset()
+{
+    /* Drop whatever was captured while idle and get ready to start again on the next read */
+    CaptureSource::reset();
+    snd_pcm_drop(handle);
+    return snd_pcm_prepare(handle);
+}
+
+/*
+ * Reads PCM from a WAV file or, when there is no RIFF header, from a raw S16_LE file.
+ */
+class FileCaptureSource: public CaptureSource
+{
+    public:
+        FileCaptureSource(const std::string &path, bool loop): path(path), loop(loop), file(NULL),
+                                                               data_offset(0), data_size(0), remaining(0),
+                                                               finished(false), error(0) {}
+        ~FileCaptureSource() { close(); }
+
+        int open(unsigned long *frames);
+        long read(char *buffer, unsigned long frames);
+        void close();
+        int reset();
+        bool at_end() const { return finished; }
+        const char *name() const { return path.c_str(); }
+
+        void set_raw_format(unsigned int raw_rate, unsigned int raw_channels)
+        {
+            rate = raw_rate;
+            number_of_channels = raw_channels;
+        }
+        void set_paced(bool value) { paced = value; }
+
+    private:
+        int parse_wav_header();
+
+        std::string path;
+        bool loop;
+        FILE *file;
+        long data_offset;
+        uint64_t data_size;
+        uint64_t remaining;
+        bool finished;
+        int error;          // a read error held back while the frames before it are returned
+};
+
+static uint32_t read_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint16_t read_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/* Returns 1 for a raw file, 0 when a usable WAV header was parsed, negative errno otherwise */
+int FileCaptureSource::parse_wav_header()
+{
+    unsigned char riff[12], chunk[8], fmt[16];
+    bool have_fmt = false;
+
+    /* RF64 keeps its real sizes in a ds64 chunk; the data size is taken from the file length anyway */
+    if (fread(riff, 1, sizeof(riff), file) != sizeof(riff) ||
+        (memcmp(riff, "RIFF", 4) && memcmp(riff, "RF64", 4)) || memcmp(riff + 8, "WAVE", 4))
+        return 1;
+
+    while (fread(chunk, 1, sizeof(chunk), file) == sizeof(chunk)) {
+        uint32_t chunk_size = read_le32(chunk + 4);
+
+        if (!memcmp(chunk, "fmt ", 4)) {
+            if (chunk_size < sizeof(fmt) || fread(fmt, 1, sizeof(fmt), file) != sizeof(fmt))
+                return -EINVAL;
+            if (read_le16(fmt) != 1 || read_le16(fmt + 14) != 16) {
+                fprintf(stderr, "%s: only 16 bit PCM WAV files are supported\n", path.c_str());
+                return -EINVAL;
+            }
+            number_of_channels = read_le16(fmt + 2);
+            rate = read_le32(fmt + 4);
+            if (!number_of_channels || !rate)
+                return -EINVAL;
+            have_fmt = true;
+            fseek(file, chunk_size - sizeof(fmt) + (chunk_size & 1), SEEK_CUR);
+        } else if (!memcmp(chunk, "data", 4)) {
+            if (!have_fmt)
+                return -EINVAL;
+            data_offset = ftell(file);
+            /* Recorders that never patched the header leave 0 or garbage here, so trust the file length */
+            fseek(file, 0, SEEK_END);
+            data_size = ftell(file) - data_offset;
+            if (chunk_size && chunk_size < data_size)
+                data_size = chunk_size;
+            return 0;
+        } else {
+            fseek(file, chunk_size + (chunk_size & 1), SEEK_CUR);
+        }
+    }
+    return -EINVAL;
+}
+
+int FileCaptureSource::open(unsigned long *frames)
+{
+    int ret;
+
+    file = fopen(path.c_str(), "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open source file %s\n", path.c_str());
+        return -errno;
+    }
+
+    ret = parse_wav_header();
+    if (ret < 0) {
+        fprintf(stderr, "Invalid WAV file %s\n", path.c_str());
+        close();
+        return ret;
+    }
+    if (ret == 1) {
+        /* A raw file has only the spec's format to go by */
+        if (!number_of_channels || !rate) {
+            fprintf(stderr, "Raw source file %s needs a rate and a channel count above 0\n", path.c_str());
+            close();
+            return -EINVAL;
+        }
+        data_offset = 0;
+        fseek(file, 0, SEEK_END);
+        data_size = ftell(file);
+    }
+
+    fseek(file, data_offset, SEEK_SET);
+    remaining = data_size - data_size % bytes_per_frame();
+    finished = false;
+    error = 0;
+
+    printf("Capture file is %s (%s, %u Hz, %u channels, %lu frames per period)\n",
+           path.c_str(), ret == 1 ? "raw" : "wav", rate, number_of_channels, *frames);
+    return 0;
+}
+
+long FileCaptureSource::read(char *buffer, unsigned long frames)
+{
+    size_t wanted = frames * bytes_per_frame();
+    size_t filled = 0;
+
+    if (error) {
+        int err = error;
+        error = 0;
+        return err;
+    }
+
+    while (filled < wanted) {
+        if (!remaining) {
+            if (!loop || !data_size)
+                break;
+            fseek(file, data_offset, SEEK_SET);
+            remaining = data_size - data_size % bytes_per_frame();
+        }
+
+        size_t chunk = wanted - filled;
+        if (chunk > remaining)
+            chunk = remaining;
+        size_t got = fread(buffer + filled, 1, chunk, file);
+        if (!got) {
+            /* What was read so far still goes out; the error, or the end, comes with the next call */
+            if (ferror(file)) {
+                clearerr(file);
+                error = -EIO;
+            }
+            break;
+        }
+        filled += got;
+        remaining -= got;
+    }
+
+    if (!filled) {
+        if (error) {
+            int err = error;
+            error = 0;
+            return err;
+        }
+        finished = true;
+        return 0;
+    }
+
+    /* A short final period is padded with silence so every period has the same size */
+    memset(buffer + filled, 0, wanted - filled);
+    pace(frames);
+    return frames;
+}
+
+int FileCaptureSource::reset()
+{
+    CaptureSource::reset();
+    fseek(file, data_offset, SEEK_SET);
+    remaining = data_size - data_size % bytes_per_frame();
+    finished = false;
+    error = 0;
+    return 0;
+}
+
+void FileCaptureSource::close()
+{
+    if (file)
+        fclose(file);
+    file = NULL;
+}
+
+/*
+ * Generates a sine tone, or white noise from a fixed seed, so runs are reproducible.
+ */
+class GeneratorCaptureSource: public CaptureSource
+{
+    public:
+        GeneratorCaptureSource(bool noise, double frequency, double amplitude, uint32_t seed):
+            noise(noise), frequency(frequency), amplitude(amplitude), seed(seed), state(seed), phase(0) {}
+
+        int open(unsigned long *frames);
+        long read(char *buffer, unsigned long frames);
+        void close() {}
+        int reset();
+        const char *name() const { return noise ? "noise" : "tone"; }
+
+        void set_format(unsigned int generated_rate, unsigned int generated_channels)
+        {
+            rate = generated_rate;
+            number_of_channels = generated_channels;
+        }
+        void set_paced(bool value) { paced = value; }
+
+    private:
+        bool noise;
+        double frequency;
+        double amplitude;
+        uint32_t seed;
+        uint32_t state;
+        double phase;
+};
+
+int GeneratorCaptureSource::open(unsigned long *frames)
+{
+    state = seed ? seed : 1;
+    phase = 0;
+    if (noise)
+        printf("Capture source is white noise (seed %u, %lu frames per period)\n", seed, *frames);
+    else
+        printf("Capture source is a %.1f Hz tone (%lu frames per period)\n", frequency, *frames);
+    return 0;
+}
+
+int GeneratorCaptureSource::reset()
+{
+    CaptureSource::reset();
+    state = seed ? seed : 1;
+    phase = 0;
+    return 0;
+}
+
+long GeneratorCaptureSource::read(char *buffer, unsigned long frames)
+{
+    int16_t *samples = (int16_t *) buffer;
+    double scale = amplitude * 32767.0;
+    double step = 2.0 * M_PI * frequency / rate;
+
+    for (unsigned long i = 0; i < frames; i++) {
+        int16_t value;
+        if (noise) {
+            /* xorshift32 */
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            value = (int16_t) (((int32_t) (state >> 16) - 32768) * amplitude);
+        } else {
+            value = (int16_t) (sin(phase) * scale);
+            phase += step;
+            if (phase >= 2.0 * M_PI)
+                phase -= 2.0 * M_PI;
+        }
+        for (unsigned int c = 0; c < number_of_channels; c++)
+            samples[i * number_of_channels + c] = value;
+    }
+
+    pace(frames);
+    return frames;
+}
+
+/* Splits "type:first,key=value,flag" into its parts */
+static void parse_spec(const std::string &spec, std::string *type, std::string *first, std::string *options)
+{
+    size_t colon = spec.find(':');
+    size_t comma = spec.find(',');
+
+    /* ALSA options go before the device: alsa,channels=8:hw:1,0 */
+    if (spec.compare(0, 5, "alsa,") == 0) {
+        *type = "alsa";
+        *options = spec.substr(4, colon == std::string::npos ? std::string::npos : colon - 4);
+        *first = colon == std::string::npos ? "" : spec.substr(colon + 1);
+        *options += ",";
+        return;
+    }
+
+    if (colon != std::string::npos && (comma == std::string::npos || colon < comma)) {
+        *type = spec.substr(0, colon);
+        std::string rest = spec.substr(colon + 1);
+        /* ALSA device names such as "hw:0,0" contain commas themselves */
+        comma = *type == "alsa" ? std::string::npos : rest.find(',');
+        *first = rest.substr(0, comma);
+        *options = comma == std::string::npos ? "" : rest.substr(comma);
+    } else {
+        *type = spec.substr(0, comma);
+        *first = "";
+        *options = comma == std::string::npos ? "" : spec.substr(comma);
+    }
+    *options += ",";
+}
+
+static bool has_flag(const std::string &options, const char *flag)
+{
+    return options.find(std::string(",") + flag + ",") != std::string::npos;
+}
+
+static double option_value(const std::string &options, const char *key, double fallback)
+{
+    size_t pos = options.find(std::string(",") + key + "=");
+    if (pos == std::string::npos)
+        return fallback;
+    return atof(options.c_str() + pos + strlen(key) + 2);
+}
+
+CaptureSource *create_capture_source(const char *spec)
+{
+    std::string type, first, options;
+
+    parse_spec(spec && *spec ? spec : "alsa", &type, &first, &options);
+
+    if (type == "alsa") {
+        AlsaCaptureSource *source = new AlsaCaptureSource(first.empty() ? "default" : first);
+        /* channels=all captures the device's full channel count */
+        source->set_format(option_value(options, "rate", 44100),
+                           has_flag(options, "channels=all") ? 0 : option_value(options, "channels", 2));
+        return source;
+    }
+
+    if (type == "file") {
+        if (first.empty()) {
+            fprintf(stderr, "Capture source '%s' needs a file name\n", spec);
+            return NULL;
+        }
+        FileCaptureSource *source = new FileCaptureSource(first, has_flag(options, "loop"));
+        source->set_raw_format(option_value(options, "rate", 44100), option_value(options, "channels", 2));
+        source->set_paced(!has_flag(options, "fast"));
+        return source;
+    }
+
+    if (type == "tone" || type == "noise") {
+        double frequency = first.empty() ? 440.0 : atof(first.c_str());
+        if (option_value(options, "rate", 44100) <= 0 || option_value(options, "channels", 2) <= 0) {
+            fprintf(stderr, "Capture source '%s' needs a rate and a channel count above 0\n", spec);
+            return NULL;
+        }
+        GeneratorCaptureSource *source = new GeneratorCaptureSource(type == "noise", frequency,
+                                                                    option_value(options, "amplitude", 0.5),
+                                                                    option_value(options, "seed", 1));
+        source->set_format(option_value(options, "rate", 44100), option_value(options, "channels", 2));
+        source->set_paced(!has_flag(options, "fast"));
+        return source;
+    }
+
+    fprintf(stderr, "Unknown capture source '%s'\n", spec);
+    return NULL;
+}
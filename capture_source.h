@@ -0,0 +1,83 @@
+#ifndef CAPTURE_SOURCE_H
+#define CAPTURE_SOURCE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A capture source delivers interleaved signed 16 bit PCM one period at a time.
+ *
+ * Sources are created from a spec string so the addon and the CLI programs can
+ * all be pointed at something other than a sound card:
+ *
+ *   alsa[,rate=44100][,channels=2][:device] - ALSA capture device (default: "default");
+ *                                            channels=all opens every channel the device has
+ *   file:path[,fast][,loop]                - WAV file, or raw S16_LE PCM when the file has no RIFF header
+ *        [,rate=44100][,channels=2]          (rate/channels only apply to raw PCM)
+ *   tone[:frequency][,amplitude=0.5][,fast] - sine wave generator
+ *   noise[,seed=1][,amplitude=0.5][,fast]   - white noise generator (deterministic for a given seed)
+ *
+ * Generators also take rate= and channels= (44100 and 2 by default).
+ *
+ * File and generated sources are paced to real time unless "fast" is given, in
+ * which case read() returns as soon as the period is filled.
+ */
+class CaptureSource
+{
+    public:
+        CaptureSource();
+        virtual ~CaptureSource() {}
+
+        /* Opens the source. *frames is the requested period size and is updated to the one in use. */
+        virtual int open(unsigned long *frames) = 0;
+
+        /* Reads one period of interleaved frames. Returns frames read, 0 at end of input or a negative errno. */
+        virtual long read(char *buffer, unsigned long frames) = 0;
+
+        /* Called after read() failed; returns 0 when capturing can continue. */
+        virtual int recover(int err) { return err; }
+
+        virtual void close() = 0;
+
+        /* Discards buffered input and rewinds an opened source so it can serve a new session */
+        virtual int reset();
+
+        /*
+         * For sources that capture on threads of their own: suspend() stops them while the source
+         * waits unused, e.g. in the pipeline pool, and resume() starts them again with nothing
+         * buffered. reset() leaves such a source suspended.
+         */
+        virtual void suspend() {}
+        virtual int resume() { return 0; }
+
+        /* True once a finite source (a non looping file) has delivered all its data. */
+        virtual bool at_end() const { return false; }
+
+        /* True when the source keeps producing whether it is read or not, so a reader that stalls loses audio */
+        virtual bool live() const { return false; }
+
+        virtual const char *name() const = 0;
+
+        unsigned int sample_rate() const { return rate; }
+        unsigned int channels() const { return number_of_channels; }
+        unsigned int bits_per_sample() const { return 16; }
+        unsigned int bytes_per_frame() const { return bits_per_sample() / 8 * number_of_channels; }
+
+    protected:
+        /* Sleeps until the period that was just produced is due when pacing to real time */
+        void pace(unsigned long frames);
+
+        unsigned int rate;
+        unsigned int number_of_channels;
+        bool paced;
+
+    private:
+        struct timespec next_period;
+        bool clock_started;
+};
+
+/* Returns a new, unopened source for the spec, or NULL when the spec is invalid */
+CaptureSource *create_capture_source(const char *spec);
+
+#endif
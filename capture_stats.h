@@ -0,0 +1,153 @@
+#ifndef CAPTURE_STATS_H
+#define CAPTURE_STATS_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+static inline int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Wall-clock time, for timestamps that have to line up with the outside world */
+static inline int64_t realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline int64_t thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Log-linear histogram of microsecond values: exact below 8us, then 8 buckets per
+ * power of two, so percentiles are within 12.5% over the whole range.
+ */
+class LatencyHistogram
+{
+    public:
+        enum { BUCKETS = 8 + 8 * 40 };
+
+        LatencyHistogram() { reset(); }
+
+        void reset()
+        {
+            for (int i = 0; i < BUCKETS; i++)
+                counts[i].store(0, std::memory_order_relaxed);
+            total.store(0, std::memory_order_relaxed);
+            max_us.store(0, std::memory_order_relaxed);
+        }
+
+        void record(uint64_t us)
+        {
+            counts[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(1, std::memory_order_relaxed);
+            uint64_t seen = max_us.load(std::memory_order_relaxed);
+            while (us > seen && !max_us.compare_exchange_weak(seen, us, std::memory_order_relaxed))
+                ;
+        }
+
+        /* Lower bound of the bucket holding the given percentile (0-100) */
+        uint64_t percentile(double p) const
+        {
+            uint64_t n = total.load(std::memory_order_relaxed);
+            if (!n)
+                return 0;
+            uint64_t rank = (uint64_t) (n * p / 100.0), seen = 0;
+            for (int i = 0; i < BUCKETS; i++) {
+                seen += counts[i].load(std::memory_order_relaxed);
+                if (seen > rank)
+                    return lower_bound(i);
+            }
+            return max_us.load(std::memory_order_relaxed);
+        }
+
+        uint64_t count() const { return total.load(std::memory_order_relaxed); }
+        uint64_t max() const { return max_us.load(std::memory_order_relaxed); }
+
+    private:
+        static int bucket(uint64_t us)
+        {
+            if (us < 8)
+                return us;
+            int e = 63 - __builtin_clzll(us);
+            int index = 8 + (e - 3) * 8 + ((us >> (e - 3)) & 7);
+            return index < BUCKETS ? index : BUCKETS - 1;
+        }
+
+        static uint64_t lower_bound(int index)
+        {
+            if (index < 8)
+                return index;
+            int e = (index - 8) / 8 + 3;
+            return (uint64_t) (8 + (index - 8) % 8) << (e - 3);
+        }
+
+        std::atomic<uint64_t> counts[BUCKETS];
+        std::atomic<uint64_t> total;
+        std::atomic<uint64_t> max_us;
+};
+
+/*
+ * Counters for one capture pipeline. The native thread writes them, getStats() reads
+ * them from the JS thread, so everything is a relaxed atomic.
+ */
+struct CaptureStats
+{
+    std::atomic<uint64_t> periods;          // periods read from the source
+    std::atomic<uint64_t> deadline_misses;  // periods whose processing took longer than the period
+    std::atomic<uint64_t> overruns;         // reads that failed and needed recovery
+    std::atomic<uint64_t> dispatched;       // packets queued to the tsfn
+    std::atomic<uint64_t> delivered;        // packets handed to the JS callback
+    std::atomic<uint64_t> max_pending;      // highest dispatched - delivered seen
+    std::atomic<uint64_t> credit_dropped;   // packets dropped under flow control while too many waited for credits
+    std::atomic<int64_t> cpu_ns;            // CPU time of the native thread
+    std::atomic<uint64_t> silent_periods;   // periods the silence gate held back
+    std::atomic<uint64_t> silent_frames;    // encoder frames skipped or replaced by silence
+    std::atomic<uint64_t> resampler_downgrades; // automatic steps down to a cheaper resampler tier
+    std::atomic<int64_t> started_ns;
+    std::atomic<int64_t> first_packet_ns;   // startListener() to first packet queued, -1 until then
+    LatencyHistogram latency;               // capture to JS callback, microseconds
+    LatencyHistogram processing;            // convert + encode + dispatch per period, microseconds
+
+    CaptureStats() { reset(); }
+
+    void reset()
+    {
+        periods.store(0);
+        deadline_misses.store(0);
+        overruns.store(0);
+        dispatched.store(0);
+        delivered.store(0);
+        max_pending.store(0);
+        credit_dropped.store(0);
+        cpu_ns.store(0);
+        silent_periods.store(0);
+        silent_frames.store(0);
+        resampler_downgrades.store(0);
+        started_ns.store(monotonic_ns());
+        first_packet_ns.store(-1);
+        latency.reset();
+        processing.reset();
+    }
+
+    void packet_dispatched()
+    {
+        uint64_t pending = dispatched.fetch_add(1, std::memory_order_relaxed) + 1 -
+                           delivered.load(std::memory_order_relaxed);
+        uint64_t seen = max_pending.load(std::memory_order_relaxed);
+        while (pending > seen && !max_pending.compare_exchange_weak(seen, pending, std::memory_order_relaxed))
+            ;
+    }
+};
+
+#endif
@@ -0,0 +1,55 @@
+// Readable stream over a capturer, with the stream's demand driving the native side.
+//
+//   const { createCaptureStream } = require('./capture_stream');
+//   createCaptureStream(capturer, { format: 'adts' }).pipe(fs.createWriteStream('out.aac'));
+//
+// format 'packets' (default) is an object mode stream of { data, pts }; 'adts' and 'mp4'
+// (fragmented) are byte streams. Every _read() grants the native thread one more packet, so
+// when the consumer stops reading the capture thread stops dispatching instead of queueing
+// without limit. A live source keeps capturing meanwhile, holds up to 64 packets for the
+// consumer and reports the rest as creditDropped in getStats(); file and generator sources
+// simply pause.
+
+const { Readable } = require('stream');
+
+class CaptureStream extends Readable {
+    constructor(capturer, options = {}) {
+        const format = options.format || 'packets';
+        super({ objectMode: format === 'packets', highWaterMark: options.highWaterMark });
+        this.capturer = capturer;
+        this.format = format;
+        this.started = null;
+    }
+
+    _read() {
+        if (!this.started) {
+            this.started = this.capturer.startListener((event, data, pts) => this._onEvent(event, data, pts),
+                { format: this.format, flowControl: true });
+            this.started.catch((err) => this.destroy(err));
+        }
+        this.capturer.requestPackets(1);
+    }
+
+    _onEvent(event, data, pts) {
+        if (event === 'end') {
+            this.capturer.stopListener().then(() => this.push(null), (err) => this.destroy(err));
+        } else if (this.format === 'packets') {
+            this.push({ data, pts });
+        } else {
+            this.push(data);
+        }
+    }
+
+    _destroy(err, callback) {
+        if (!this.started) return callback(err);
+        this.started
+            .then(() => this.capturer.stopListener())
+            .then(() => callback(err), (stopErr) => callback(err || stopErr));
+    }
+}
+
+function createCaptureStream(capturer, options) {
+    return new CaptureStream(capturer, options);
+}
+
+module.exports = { CaptureStream, createCaptureStream };
@@ -0,0 +1,48 @@
+#include "channel_remix.h"
+#include <string.h>
+
+int ChannelRemix::init(int inputs, const std::vector<std::vector<float> > &matrix)
+{
+    for (size_t o = 0; o < matrix.size(); o++) {
+        if ((int) matrix[o].size() != inputs)
+            return -1;
+    }
+
+    nb_inputs = inputs;
+    this->matrix = matrix;
+    copy_of.assign(matrix.size(), -1);
+    for (size_t o = 0; o < matrix.size(); o++) {
+        int used = 0, last = -1;
+        for (int i = 0; i < inputs; i++) {
+            if (matrix[o][i] != 0.0f) {
+                used++;
+                last = i;
+            }
+        }
+        if (used == 1 && matrix[o][last] == 1.0f)
+            copy_of[o] = last;
+    }
+    return 0;
+}
+
+void ChannelRemix::process(const float * const *in, float **out, int frames) const
+{
+    for (size_t o = 0; o < matrix.size(); o++) {
+        float *dst = out[o];
+        if (copy_of[o] >= 0) {
+            memcpy(dst, in[copy_of[o]], frames * sizeof(float));
+            continue;
+        }
+
+        /* One multiply-add pass per contributing input; the compiler vectorizes these loops */
+        memset(dst, 0, frames * sizeof(float));
+        for (int i = 0; i < nb_inputs; i++) {
+            float gain = matrix[o][i];
+            if (gain == 0.0f)
+                continue;
+            const float *src = in[i];
+            for (int n = 0; n < frames; n++)
+                dst[n] += gain * src[n];
+        }
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef CHANNEL_REMIX_H
+#define CHANNEL_REMIX_H
+
+#include <vector>
+
+/*
+ * Mixes planar input channels into planar output channels with a gain matrix, one row
+ * per output channel. Rows that just pick one input at unity gain are copied, and zero
+ * gains are skipped, so splitting a multichannel interface costs little more than memcpy.
+ */
+class ChannelRemix
+{
+    public:
+        ChannelRemix(): nb_inputs(0) {}
+
+        /* Every row must have one gain per input; returns -1 otherwise */
+        int init(int inputs, const std::vector<std::vector<float> > &matrix);
+
+        int inputs() const { return nb_inputs; }
+        int outputs() const { return matrix.size(); }
+
+        void process(const float * const *in, float **out, int frames) const;
+
+    private:
+        int nb_inputs;
+        std::vector<std::vector<float> > matrix;
+        std::vector<int> copy_of;       // per output, the input it copies, or -1 when it mixes
+};
+
+#endif
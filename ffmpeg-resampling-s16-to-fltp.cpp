@@ -2,159 +2,323 @@ extern "C"
 {
 #include <libavutil/opt.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
 #include <libavutil/samplefmt.h>
-#include <libswresample/swresample.h>
 }
 
 #include <stdio.h>
 #include <stdint.h>
-
-int main(int argc, char** argv) {
-    struct SwrContext *swr_ctx;
-
-    int64_t src_ch_layout = AV_CH_LAYOUT_STEREO;
-    int src_rate = 44100;
-    enum AVSampleFormat src_sample_fmt = AV_SAMPLE_FMT_S16;
-    
-    int64_t dst_ch_layout = AV_CH_LAYOUT_STEREO;
-    int dst_rate = 44100;
-    enum AVSampleFormat dst_sample_fmt = AV_SAMPLE_FMT_FLTP;
-
-    int ret;
-
-    int src_nb_channels = 0;
-    int src_linesize;
-    uint8_t **src_data = NULL;
-    int src_nb_samples = 7000*32; // Vary based on number of samples in input
-
-    int dst_nb_samples, max_dst_nb_samples;
-    int dst_nb_channels = 0;
-    int dst_linesize;
-    uint8_t **dst_data = NULL;
-
-    char* src_filename = NULL;
-    FILE *src_file;
-    int src_bufsize;
-
-    char* dst_filename = NULL;
-    FILE *dst_file;
-    int dst_bufsize;
-
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s input_file output_file\n"
-                "API example program to show how to resample an audio stream with libswresample.\n"
-                "This program generates a series of audio frames, resamples them to a specified "
-                "output format and rate and saves them to an output file named output_file.\n",
-            argv[0]);
-        exit(1);
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "capture_stats.h"
+#include "capture_pipeline.h"
+#include "mapped_file.h"
+#include "resampler.h"
+#include "sample_convert.h"
+#include "stage_pipeline.h"
+
+/*
+ * Streams a file of interleaved samples of any length through fixed chunks, so memory
+ * stays constant: a chunk's input, its float output and the resampler's state fit in L2.
+ * A reader thread fills one of two buffers while the other is converted.
+ */
+#define DEFAULT_CHUNK_FRAMES 4096
+
+/* With --mmap, the input is prefetched and released, and the output written back, in windows of this size */
+#define MAPPED_WINDOW (4 << 20)
+
+struct Conversion
+{
+    SampleConverter converter;      // format conversion, and resampling when the rates differ
+    int channels;
+    size_t frame_bytes;             // input
+    int chunk_frames;
+    int64_t src_frames;
+    int64_t dst_frames;
+    int64_t chunks;
+};
+
+/*
+ * Converts frames from in into planes, which have room for the converter's max_output(frames),
+ * or into the converter's own planes() when planes is NULL. in == NULL drains the resampler.
+ * Returns the frames written or a negative error.
+ */
+static int convert_chunk(Conversion *conv, const uint8_t *in, int frames, float **planes)
+{
+    int written = planes ? conv->converter.convert_to(planes, in, frames) : conv->converter.convert(in, frames);
+    if (written < 0) {
+        fprintf(stderr, "Error while converting\n");
+        return written;
     }
-
-    src_filename = argv[1];
-    src_file = fopen(src_filename, "r");
-    if (!src_file) {
-        fprintf(stderr, "Could not open source file %s\n", src_filename);
-        exit(1);
+    if (in) {
+        conv->src_frames += frames;
+        conv->chunks++;
     }
+    conv->dst_frames += written;
+    return written;
+}
 
-    dst_filename = argv[2];
+struct ReadBuffer
+{
+    std::vector<uint8_t> data;
+    int frames;
+};
 
-    dst_file = fopen(dst_filename, "wb");
-    if (!dst_file) {
-        fprintf(stderr, "Could not open destination file %s\n", dst_filename);
-        exit(1);
+/* Reader thread: fills whichever buffer is free and hands it over, until the input ends */
+static void read_chunks(FILE *file, size_t frame_bytes, SpscQueue<ReadBuffer *> *free_buffers,
+                        SpscQueue<ReadBuffer *> *filled)
+{
+    ReadBuffer *buffer;
+    while (free_buffers->pop_wait(&buffer)) {
+        size_t capacity = buffer->data.size() / frame_bytes;
+        buffer->frames = fread(buffer->data.data(), frame_bytes, capacity, file);
+        if (buffer->frames > 0)
+            filled->push(buffer);   // never full: there are only two buffers
+        if ((size_t) buffer->frames < capacity)
+            break;
     }
+    filled->close();
+}
 
-    /* create resampler context */
-    swr_ctx = swr_alloc();
-    if (!swr_ctx) {
-        fprintf(stderr, "Could not allocate resampler context\n");
-        return -1;
+static int write_planes(std::vector<FILE *> &outputs, float **planes, int frames)
+{
+    for (size_t c = 0; c < outputs.size(); c++) {
+        if (fwrite(planes[c], sizeof(float), frames, outputs[c]) != (size_t) frames) {
+            fprintf(stderr, "Could not write channel %zu\n", c);
+            return -1;
+        }
     }
+    return 0;
+}
 
-    /* set options */
-    av_opt_set_int(swr_ctx, "in_channel_layout",    src_ch_layout, 0);
-    av_opt_set_int(swr_ctx, "in_sample_rate",       src_rate, 0);
-    av_opt_set_sample_fmt(swr_ctx, "in_sample_fmt", src_sample_fmt, 0);
+static std::string channel_filename(const char *dst_filename, int channel)
+{
+    return std::string(dst_filename) + "." + std::to_string(channel);
+}
 
-    av_opt_set_int(swr_ctx, "out_channel_layout",    dst_ch_layout, 0);
-    av_opt_set_int(swr_ctx, "out_sample_rate",       dst_rate, 0);
-    av_opt_set_sample_fmt(swr_ctx, "out_sample_fmt", dst_sample_fmt, 0);
+/* Double-buffered fread() in, fwrite() of each plane out */
+static int convert_stdio(Conversion *conv, const char *src_filename, const char *dst_filename)
+{
+    int err = 0;
 
-    /* initialize the resampling context */
-    if ((ret = swr_init(swr_ctx)) < 0) {
-        fprintf(stderr, "Failed to initialize the resampling context\n");
+    FILE *src_file = fopen(src_filename, "r");
+    if (!src_file) {
+        fprintf(stderr, "Could not open source file %s\n", src_filename);
         return -1;
     }
 
-    /* allocate source and destination samples buffers 
-        - For S16, 2 channels 16 bits per sample. So, each sample takes 4 bytes.
-        - Linesize is the total bytes allocated in multiples of 128. 
-        - Based on src_nb_samples, src_linesize is decided and space allocated in src_data
-    */
-
-    src_nb_channels = av_get_channel_layout_nb_channels(src_ch_layout);
-    ret = av_samples_alloc_array_and_samples(&src_data, &src_linesize, src_nb_channels,
-                                             src_nb_samples, src_sample_fmt, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate source samples\n");
-        return -1;
+    std::vector<FILE *> dst_files(conv->channels);
+    for (int c = 0; c < conv->channels; c++) {
+        std::string name = channel_filename(dst_filename, c);
+        dst_files[c] = fopen(name.c_str(), "wb");
+        if (!dst_files[c]) {
+            fprintf(stderr, "Could not open destination file %s\n", name.c_str());
+            err = -1;
+        }
     }
 
-    printf("Line size : %d\n", src_linesize);
-
-    fread(src_data[0], 1, src_linesize, src_file);
-
-    /* compute the number of converted samples: buffering is avoided
-     * ensuring that the output buffer will contain at least all the
-     * converted input samples */
-    max_dst_nb_samples = dst_nb_samples =
-        av_rescale_rnd(src_nb_samples, dst_rate, src_rate, AV_ROUND_UP);
+    ReadBuffer buffers[2];
+    SpscQueue<ReadBuffer *> free_buffers(2), filled(2);
+    for (ReadBuffer &buffer: buffers) {
+        buffer.data.resize(conv->chunk_frames * conv->frame_bytes);
+        free_buffers.push(&buffer);
+    }
 
-    printf("Number of samples in dest: %d\n", dst_nb_samples);
+    std::thread reader(read_chunks, src_file, conv->frame_bytes, &free_buffers, &filled);
+    if (err)
+        free_buffers.close();
+
+    ReadBuffer *buffer;
+    while (filled.pop_wait(&buffer)) {
+        if (!err) {
+            int frames = convert_chunk(conv, buffer->data.data(), buffer->frames, NULL);
+            err = frames < 0 ? frames : write_planes(dst_files, conv->converter.planes(), frames);
+        }
+        /* After an error the reader is stopped and what it already read is dropped */
+        if (err)
+            free_buffers.close();
+        else
+            free_buffers.push(buffer);
+    }
+    free_buffers.close();
+    reader.join();
 
-    /* buffer is going to be directly written to a rawaudio file, no alignment */
-    dst_nb_channels = av_get_channel_layout_nb_channels(dst_ch_layout);
-    ret = av_samples_alloc_array_and_samples(&dst_data, &dst_linesize, dst_nb_channels,
-                                             dst_nb_samples, dst_sample_fmt, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate destination samples\n");
-        return -1;
+    if (!err && ferror(src_file)) {
+        fprintf(stderr, "Could not read source file %s\n", src_filename);
+        err = -1;
     }
 
-    ret = swr_convert(swr_ctx, dst_data, dst_nb_samples, (const uint8_t **)src_data, src_nb_samples);
-    printf("Number of samples converted %d\nDest Line size %d\n", ret, dst_linesize);
-    if (ret < 0) {
-        fprintf(stderr, "Error while converting\n");
-        return -1;
+    /* Flush the samples still inside the resampler's filter */
+    if (!err && conv->converter.resampling()) {
+        int frames = convert_chunk(conv, NULL, 0, NULL);
+        err = frames < 0 ? frames : write_planes(dst_files, conv->converter.planes(), frames);
     }
 
-    dst_bufsize = av_samples_get_buffer_size(&dst_linesize, dst_nb_channels, ret, dst_sample_fmt, 1);
+    fclose(src_file);
+    for (FILE *dst_file: dst_files) {
+        if (dst_file && fclose(dst_file) && !err) {
+            fprintf(stderr, "Could not write destination file %s\n", dst_filename);
+            err = -1;
+        }
+    }
+    return err;
+}
 
-    if (dst_bufsize < 0) {
-        fprintf(stderr, "Could not get sample buffer size\n");
-        return -1;
+/*
+ * The input is mapped and the kernels read it in place; each channel's output file is
+ * preallocated, mapped and written in place too. Nothing is copied through the page cache.
+ */
+static int convert_mapped(Conversion *conv, int src_rate, int dst_rate, const char *src_filename,
+                          const char *dst_filename)
+{
+    MappedFile input;
+    int err = input.open(src_filename, true);
+    if (err)
+        return err;
+
+    int64_t total = input.size() / conv->frame_bytes;
+    int64_t expected = conv->converter.resampling() ?
+        av_rescale_rnd(total, dst_rate, src_rate, AV_ROUND_UP) + conv->converter.max_output(conv->chunk_frames) : total;
+    std::vector<MappedOutput> outputs(conv->channels);
+    for (int c = 0; c < conv->channels && !err; c++)
+        err = outputs[c].open(channel_filename(dst_filename, c).c_str(), expected * sizeof(float));
+
+    std::vector<float *> planes(conv->channels);
+    size_t prefetched = 0, released = 0, written_back = 0;
+    for (int64_t pos = 0; !err; pos += conv->chunk_frames) {
+        int frames = total - pos < conv->chunk_frames ? total - pos : conv->chunk_frames;
+        if (frames <= 0 && !conv->converter.resampling())
+            break;
+
+        /* The resampler can give out a little more than the estimate; grow the files when it does */
+        size_t needed = (conv->dst_frames + conv->converter.max_output(frames > 0 ? frames : 0)) * sizeof(float);
+        for (int c = 0; c < conv->channels && !err; c++) {
+            if (outputs[c].size() < needed)
+                err = outputs[c].resize(needed + MAPPED_WINDOW);
+            planes[c] = (float *) outputs[c].data() + conv->dst_frames;
+        }
+        if (err)
+            break;
+
+        /* Keep a window read ahead of the chunk, and drop the windows behind it */
+        size_t offset = pos * conv->frame_bytes;
+        if (frames > 0 && offset + frames * conv->frame_bytes + MAPPED_WINDOW > prefetched) {
+            input.prefetch(prefetched, MAPPED_WINDOW);
+            prefetched += MAPPED_WINDOW;
+            size_t behind = offset > (size_t) MAPPED_WINDOW ? (offset - MAPPED_WINDOW) / MAPPED_WINDOW * MAPPED_WINDOW : 0;
+            if (behind > released) {
+                input.release(released, behind - released);
+                released = behind;
+            }
+        }
+
+        int out = convert_chunk(conv, frames > 0 ? input.data() + offset : NULL, frames > 0 ? frames : 0,
+                                planes.data());
+        if (out < 0)
+            err = out;
+        else if (frames <= 0 && !out)
+            break;              // resampler flushed
+
+        size_t done = conv->dst_frames * sizeof(float);
+        if (done - written_back >= (size_t) MAPPED_WINDOW) {
+            for (MappedOutput &output: outputs)
+                output.writeback(written_back, done - written_back);
+            written_back = done;
+        }
     }
-    
-    printf("in:%d out:%d bufSize:%d\n", src_nb_samples, ret, dst_bufsize);
 
-    fwrite(dst_data[0], 1, dst_bufsize, dst_file);
+    for (int c = 0; c < conv->channels; c++) {
+        int close_err = outputs[c].close(conv->dst_frames * sizeof(float));
+        if (close_err && !err) {
+            fprintf(stderr, "Could not write destination file %s\n", channel_filename(dst_filename, c).c_str());
+            err = close_err;
+        }
+    }
+    return err;
+}
 
-    fprintf(stderr, "Resampling succeeded. Play the output file with the command:\n"
-        "aplay --format=FLOAT_LE -r %d -c %d %s\n",
-        dst_rate, dst_nb_channels, dst_filename);
+int main(int argc, char** argv) {
+    Conversion conv;
+    int src_format = SAMPLE_S16;
+    int src_rate = 44100;
+    int dst_rate = 0;
+    int quality = RESAMPLER_DEFAULT;
+    bool mapped = false;
+    std::vector<const char *> args;
+    bool usage = false;
+    int err;
+
+    conv.channels = 2;
+    conv.chunk_frames = DEFAULT_CHUNK_FRAMES;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--in-rate") && i + 1 < argc)
+            src_rate = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--out-rate") && i + 1 < argc)
+            dst_rate = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--channels") && i + 1 < argc)
+            conv.channels = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--chunk") && i + 1 < argc)
+            conv.chunk_frames = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--quality") && i + 1 < argc)
+            usage |= (quality = parse_resampler_quality(argv[++i])) < 0;
+        else if (!strcmp(argv[i], "--mmap"))
+            mapped = true;
+        else if (argv[i][0] == '-')
+            usage = true;
+        else
+            args.push_back(argv[i]);
+    }
 
-    fclose(src_file);
-    fclose(dst_file);
-    
-    if (src_data)
-        av_freep(&src_data[0]);
-    av_freep(&src_data);
+    if (usage || (args.size() != 2 && args.size() != 3) || src_rate <= 0 || dst_rate < 0 || conv.channels < 1
+        || conv.channels > 8 || conv.chunk_frames < 64) {
+        fprintf(stderr, "Usage: %s [--in-rate 44100] [--out-rate rate] [--channels 2] [--quality fast|default|high]\n"
+                "        [--chunk %d] [--mmap] input_file output_file [u8|s16|s24|s32|f32]\n"
+                "Converts interleaved samples (S16 unless another input format is given) to planar float,\n"
+                "resampling when --out-rate differs from --in-rate, and writes one file per channel,\n"
+                "output_file.0, output_file.1 and so on. --chunk sets the frames converted at a time;\n"
+                "--mmap maps the input and output files instead of reading and writing them.\n",
+            argv[0], DEFAULT_CHUNK_FRAMES);
+        exit(1);
+    }
+    if (!dst_rate)
+        dst_rate = src_rate;
 
-    if (dst_data)
-        av_freep(&dst_data[0]);
-    av_freep(&dst_data);
+    if (args.size() == 3 && (src_format = parse_sample_format(args[2])) < 0) {
+        fprintf(stderr, "Unknown input format %s\n", args[2]);
+        exit(1);
+    }
 
-    swr_free(&swr_ctx);
+    /* Matching rates only need the format conversion kernel, straight into the planes */
+    if (conv.converter.init(conv.channels, src_rate, conv.channels, dst_rate, (ResamplerQuality) quality,
+                            (SampleFormat) src_format) || conv.converter.reserve(conv.chunk_frames)) {
+        fprintf(stderr, "Could not set up the conversion\n");
+        exit(1);
+    }
+    conv.frame_bytes = conv.channels * sample_format_size((SampleFormat) src_format);
+    conv.src_frames = 0;
+    conv.dst_frames = 0;
+    conv.chunks = 0;
+
+    int64_t started_ns = monotonic_ns();
+    if (mapped)
+        err = convert_mapped(&conv, src_rate, dst_rate, args[0], args[1]);
+    else
+        err = convert_stdio(&conv, args[0], args[1]);
+    double seconds = (monotonic_ns() - started_ns) / 1e9;
+
+    printf("Converted %lld frames at %d Hz to %lld frames at %d Hz in %lld chunks of %d%s: %.2f s, %.1f MB/s\n",
+           (long long) conv.src_frames, src_rate, (long long) conv.dst_frames, dst_rate, (long long) conv.chunks,
+           conv.chunk_frames, mapped ? ", mapped" : "", seconds,
+           seconds > 0 ? conv.src_frames * conv.frame_bytes / seconds / 1e6 : 0);
+
+    if (err)
+        return -1;
 
+    fprintf(stderr, "Resampling succeeded. Play a channel with the command:\n"
+        "aplay --format=FLOAT_LE -r %d -c 1 %s.0\n",
+        dst_rate, args[1]);
     return 0;
-}
\ No newline at end of file
+}
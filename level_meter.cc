@@ -0,0 +1,149 @@
+#include "level_meter.h"
+#include <math.h>
+#include <string.h>
+
+#define SILENCE_DB -INFINITY
+
+static float to_db(double power)
+{
+    return power > 0 ? 10.0 * log10(power) : SILENCE_DB;
+}
+
+LevelMeter::LevelMeter()
+{
+    init(44100, 2);
+}
+
+void LevelMeter::init(int sample_rate, int channels)
+{
+    this->channels = channels < LEVEL_METER_MAX_CHANNELS ? channels : LEVEL_METER_MAX_CHANNELS;
+    block_frames = sample_rate / 10;
+
+    /* K-weighting coefficients for any sample rate, ITU-R BS.1770 */
+    double f0 = 1681.974450955533, gain = 3.999843853973347, q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / sample_rate);
+    double vh = pow(10.0, gain / 20.0), vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    shelf_b[0] = (vh + vb * k / q + k * k) / a0;
+    shelf_b[1] = 2.0 * (k * k - vh) / a0;
+    shelf_b[2] = (vh - vb * k / q + k * k) / a0;
+    shelf_a[1] = 2.0 * (k * k - 1.0) / a0;
+    shelf_a[2] = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / sample_rate);
+    a0 = 1.0 + k / q + k * k;
+    highpass_b[0] = 1.0;
+    highpass_b[1] = -2.0;
+    highpass_b[2] = 1.0;
+    highpass_a[1] = 2.0 * (k * k - 1.0) / a0;
+    highpass_a[2] = (1.0 - k / q + k * k) / a0;
+
+    vec4 zero = splat(0);
+    shelf_z1 = shelf_z2 = highpass_z1 = highpass_z2 = zero;
+    block_energy = zero;
+    block_fill = 0;
+    memset(blocks, 0, sizeof(blocks));
+    blocks_filled = 0;
+    block_index = 0;
+
+    for (int c = 0; c < LEVEL_METER_MAX_CHANNELS; c++) {
+        peak_db[c].store(SILENCE_DB, std::memory_order_relaxed);
+        rms_db[c].store(SILENCE_DB, std::memory_order_relaxed);
+    }
+    momentary_lufs.store(SILENCE_DB, std::memory_order_relaxed);
+    short_term_lufs.store(SILENCE_DB, std::memory_order_relaxed);
+    published_channels.store(this->channels, std::memory_order_relaxed);
+    last_peak = 0;
+}
+
+void LevelMeter::process(const float * const *planes, int frames)
+{
+    vec4 peak = splat(0), energy = splat(0);
+    vec4 sb0 = splat(shelf_b[0]), sb1 = splat(shelf_b[1]), sb2 = splat(shelf_b[2]);
+    vec4 sa1 = splat(shelf_a[1]), sa2 = splat(shelf_a[2]);
+    vec4 ha1 = splat(highpass_a[1]), ha2 = splat(highpass_a[2]);
+
+    for (int i = 0; i < frames; i++) {
+        vec4 x = splat(0);
+        for (int c = 0; c < channels; c++)
+            x[c] = planes[c][i];
+
+        vec4 magnitude = x < 0 ? -x : x;
+        peak = magnitude > peak ? magnitude : peak;
+        energy += x * x;
+
+        vec4 shelved = sb0 * x + shelf_z1;
+        shelf_z1 = sb1 * x - sa1 * shelved + shelf_z2;
+        shelf_z2 = sb2 * x - sa2 * shelved;
+
+        /* The high pass numerator is 1, -2, 1 */
+        vec4 weighted = shelved + highpass_z1;
+        highpass_z1 = -2 * shelved - ha1 * weighted + highpass_z2;
+        highpass_z2 = shelved - ha2 * weighted;
+
+        block_energy += weighted * weighted;
+        if (++block_fill == block_frames)
+            finish_block();
+    }
+
+    publish(peak, energy, frames);
+}
+
+void LevelMeter::skip(int frames)
+{
+    vec4 zero = splat(0);
+    for (int i = 0; i < frames; i++) {
+        if (++block_fill == block_frames)
+            finish_block();
+    }
+    publish(zero, zero, frames);
+}
+
+void LevelMeter::finish_block()
+{
+    double sum = 0;
+    for (int c = 0; c < channels; c++)
+        sum += block_energy[c] / block_frames;
+
+    blocks[block_index] = sum;
+    block_index = (block_index + 1) % LEVEL_METER_SHORT_TERM_BLOCKS;
+    if (blocks_filled < LEVEL_METER_SHORT_TERM_BLOCKS)
+        blocks_filled++;
+    block_energy = splat(0);
+    block_fill = 0;
+
+    /* Windows are averaged over the blocks seen so far until they fill up */
+    double momentary = 0, short_term = 0;
+    int momentary_blocks = blocks_filled < LEVEL_METER_MOMENTARY_BLOCKS ? blocks_filled : LEVEL_METER_MOMENTARY_BLOCKS;
+    for (int b = 1; b <= blocks_filled; b++) {
+        double value = blocks[(block_index - b + LEVEL_METER_SHORT_TERM_BLOCKS) % LEVEL_METER_SHORT_TERM_BLOCKS];
+        short_term += value;
+        if (b <= momentary_blocks)
+            momentary += value;
+    }
+    momentary_lufs.store(-0.691f + to_db(momentary / momentary_blocks), std::memory_order_relaxed);
+    short_term_lufs.store(-0.691f + to_db(short_term / blocks_filled), std::memory_order_relaxed);
+}
+
+void LevelMeter::publish(vec4 peak, vec4 energy, int frames)
+{
+    last_peak = 0;
+    for (int c = 0; c < channels; c++) {
+        last_peak = peak[c] > last_peak ? peak[c] : last_peak;
+        peak_db[c].store(to_db(peak[c] * peak[c]), std::memory_order_relaxed);
+        rms_db[c].store(frames ? to_db(energy[c] / frames) : SILENCE_DB, std::memory_order_relaxed);
+    }
+}
+
+void LevelMeter::read(Levels *levels) const
+{
+    levels->channels = published_channels.load(std::memory_order_relaxed);
+    for (int c = 0; c < levels->channels; c++) {
+        levels->peak_db[c] = peak_db[c].load(std::memory_order_relaxed);
+        levels->rms_db[c] = rms_db[c].load(std::memory_order_relaxed);
+    }
+    levels->momentary_lufs = momentary_lufs.load(std::memory_order_relaxed);
+    levels->short_term_lufs = short_term_lufs.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,76 @@
+#ifndef LEVEL_METER_H
+#define LEVEL_METER_H
+
+#include <atomic>
+#include <stdint.h>
+
+/*
+ * Per-channel peak and RMS of the latest period plus EBU R128 momentary (400 ms) and
+ * short-term (3 s) loudness, updated incrementally on the capture thread and published
+ * through atomics so any thread can read them without locking.
+ *
+ * Channels are processed together in one SIMD vector, which also carries the
+ * K-weighting filter state, so at most LEVEL_METER_MAX_CHANNELS are metered.
+ */
+#define LEVEL_METER_MAX_CHANNELS 4
+#define LEVEL_METER_SHORT_TERM_BLOCKS 30       // 100 ms blocks in the short-term window
+#define LEVEL_METER_MOMENTARY_BLOCKS 4
+
+struct Levels
+{
+    int channels;
+    float peak_db[LEVEL_METER_MAX_CHANNELS];   // dBFS
+    float rms_db[LEVEL_METER_MAX_CHANNELS];    // dBFS
+    float momentary_lufs;
+    float short_term_lufs;
+};
+
+class LevelMeter
+{
+    public:
+        LevelMeter();
+
+        void init(int sample_rate, int channels);
+
+        /* Capture thread: meters one period of planar float samples */
+        void process(const float * const *planes, int frames);
+
+        /* Capture thread: accounts for frames that were not converted, e.g. skipped silence */
+        void skip(int frames);
+
+        /* Capture thread: the highest magnitude in the latest period over all channels, full scale = 1.0 */
+        float period_peak() const { return last_peak; }
+
+        /* Any thread */
+        void read(Levels *levels) const;
+
+    private:
+        typedef float vec4 __attribute__((vector_size(16)));
+
+        static vec4 splat(float value) { vec4 v = { value, value, value, value }; return v; }
+
+        void finish_block();
+        void publish(vec4 peak, vec4 energy, int frames);
+
+        int channels;
+        int block_frames;
+
+        // K-weighting: high shelf then high pass, transposed direct form II
+        float shelf_b[3], shelf_a[3], highpass_b[3], highpass_a[3];
+        vec4 shelf_z1, shelf_z2, highpass_z1, highpass_z2;
+
+        vec4 block_energy;
+        int block_fill;
+        double blocks[LEVEL_METER_SHORT_TERM_BLOCKS];   // mean square per block, summed over channels
+        int blocks_filled;
+        int block_index;
+
+        std::atomic<float> peak_db[LEVEL_METER_MAX_CHANNELS];
+        std::atomic<float> rms_db[LEVEL_METER_MAX_CHANNELS];
+        std::atomic<float> momentary_lufs;
+        std::atomic<float> short_term_lufs;
+        std::atomic<int> published_channels;
+        float last_peak;
+};
+
+#endif
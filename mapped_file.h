@@ -0,0 +1,82 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A whole file mapped read-only, for tools that walk large PCM files without copying them.
+ * Opened for sequential access, the kernel reads ahead aggressively and drops pages behind
+ * the reader; prefetch() and release() steer it further for a reader that walks in windows.
+ */
+class MappedFile
+{
+    public:
+        MappedFile();
+        ~MappedFile();
+
+        /* Returns 0 or a negative errno */
+        int open(const char *path, bool sequential = false);
+        void close();
+
+        /* Starts reading [offset, offset + bytes) in the background */
+        void prefetch(size_t offset, size_t bytes);
+        /* Done with [offset, offset + bytes): unmaps its pages and lets the page cache drop them */
+        void release(size_t offset, size_t bytes);
+
+        const uint8_t *data() const { return map; }
+        size_t size() const { return length; }
+
+    private:
+        int fd;
+        uint8_t *map;
+        size_t length;
+};
+
+/*
+ * A new file preallocated to its expected size and mapped shared and writable, so output is
+ * written in place instead of copied through write(). close() cuts it to the length written.
+ */
+class MappedOutput
+{
+    public:
+        MappedOutput();
+        ~MappedOutput();
+
+        /* Creates or truncates path with size bytes reserved; returns 0 or a negative errno */
+        int open(const char *path, size_t size);
+        /* Grows the file and its mapping, which may move; returns 0 or a negative errno */
+        int resize(size_t size);
+        /* Starts writeback of [offset, offset + bytes) so dirty pages do not pile up */
+        void writeback(size_t offset, size_t bytes);
+        /* Unmaps, truncates the file to length and closes it; returns 0 or a negative errno */
+        int close(size_t length);
+
+        uint8_t *data() const { return map; }
+        size_t size() const { return capacity; }
+
+    private:
+        int fd;
+        uint8_t *map;
+        size_t capacity;
+};
+
+/* Where the samples of a mapped WAV or raw S16_LE file are */
+struct PcmLayout
+{
+    size_t offset;          // first sample byte
+    size_t bytes;           // whole frames only
+    unsigned int rate;
+    unsigned int channels;
+    bool wav;
+};
+
+/*
+ * Reads the WAV (or RF64) header at data, or takes the file as raw PCM with the rate and
+ * channels already in layout when there is none. Like the file capture source, only 16 bit
+ * PCM is accepted and an unpatched data size is taken from the file length. Returns 0 or a
+ * negative errno, -EINVAL also for a rate or channel count of 0.
+ */
+int parse_pcm_layout(const uint8_t *data, size_t size, PcmLayout *layout);
+
+#endif
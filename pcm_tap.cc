@@ -0,0 +1,105 @@
+#include "pcm_tap.h"
+#include <string.h>
+
+PcmTap::PcmTap()
+{
+    header = NULL;
+    memory = NULL;
+    length = 0;
+    ring_format = PCM_TAP_S16;
+    capacity = 0;
+    channels = 0;
+}
+
+void PcmTap::attach(uint8_t *memory, size_t length, int format)
+{
+    this->memory = memory;
+    this->length = length;
+    this->header = (int32_t *) memory;
+    ring_format = format;
+}
+
+void PcmTap::detach()
+{
+    memory = NULL;
+    header = NULL;
+    length = 0;
+}
+
+int PcmTap::start(int channels, int sample_rate, int period_frames)
+{
+    if (!memory || length < PCM_TAP_HEADER_BYTES)
+        return -1;
+
+    size_t bytes_per_frame = channels * (ring_format == PCM_TAP_FLTP ? sizeof(float) : sizeof(int16_t));
+    size_t fit = (length - PCM_TAP_HEADER_BYTES) / bytes_per_frame;
+    capacity = 1;
+    while ((size_t) capacity * 2 <= fit && capacity < (1u << 30))
+        capacity *= 2;
+    if (capacity > fit || (int) capacity < period_frames)
+        return -1;
+    this->channels = channels;
+
+    __atomic_store_n(&header[PCM_TAP_RUNNING], 0, __ATOMIC_RELEASE);
+    header[PCM_TAP_WRITE] = 0;
+    header[PCM_TAP_READ] = 0;
+    header[PCM_TAP_CAPACITY] = capacity;
+    header[PCM_TAP_CHANNELS] = channels;
+    header[PCM_TAP_FORMAT] = ring_format;
+    header[PCM_TAP_SAMPLE_RATE] = sample_rate;
+    header[PCM_TAP_DROPPED] = 0;
+    __atomic_store_n(&header[PCM_TAP_RUNNING], 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void PcmTap::stop()
+{
+    if (header)
+        __atomic_store_n(&header[PCM_TAP_RUNNING], 0, __ATOMIC_RELEASE);
+}
+
+long PcmTap::reserve(int frames)
+{
+    uint32_t write = __atomic_load_n((uint32_t *) &header[PCM_TAP_WRITE], __ATOMIC_RELAXED);
+    uint32_t read = __atomic_load_n((uint32_t *) &header[PCM_TAP_READ], __ATOMIC_ACQUIRE);
+
+    if (capacity - (write - read) < (uint32_t) frames) {
+        __atomic_fetch_add(&header[PCM_TAP_DROPPED], frames, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return write & (capacity - 1);
+}
+
+void PcmTap::publish(int frames)
+{
+    uint32_t write = __atomic_load_n((uint32_t *) &header[PCM_TAP_WRITE], __ATOMIC_RELAXED);
+    __atomic_store_n((uint32_t *) &header[PCM_TAP_WRITE], write + frames, __ATOMIC_RELEASE);
+}
+
+void PcmTap::write_s16(const int16_t *interleaved, int frames)
+{
+    long index = reserve(frames);
+    if (index < 0)
+        return;
+
+    int16_t *ring = (int16_t *) (memory + PCM_TAP_HEADER_BYTES);
+    long first = frames < (long) capacity - index ? frames : capacity - index;
+    memcpy(ring + index * channels, interleaved, first * channels * sizeof(int16_t));
+    memcpy(ring, interleaved + first * channels, (frames - first) * channels * sizeof(int16_t));
+    publish(frames);
+}
+
+void PcmTap::write_fltp(const float * const *planes, int frames)
+{
+    long index = reserve(frames);
+    if (index < 0)
+        return;
+
+    long first = frames < (long) capacity - index ? frames : capacity - index;
+    for (uint32_t ch = 0; ch < channels; ch++) {
+        float *plane = (float *) (memory + PCM_TAP_HEADER_BYTES) + (size_t) ch * capacity;
+        memcpy(plane + index, planes[ch], first * sizeof(float));
+        memcpy(plane, planes[ch] + first, (frames - first) * sizeof(float));
+    }
+    publish(frames);
+}
@@ -0,0 +1,72 @@
+#ifndef PCM_TAP_H
+#define PCM_TAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Single producer, single consumer ring of PCM frames in memory owned by JS, normally a
+ * SharedArrayBuffer, so JS or a worker_thread can pull audio without a callback per period.
+ *
+ * The memory starts with a header of PCM_TAP_HEADER_BYTES, read as an Int32Array:
+ *
+ *   [PCM_TAP_WRITE]        frames written so far, wrapping at 2^32 (native thread, release)
+ *   [PCM_TAP_READ]         frames consumed so far, wrapping at 2^32 (reader, release)
+ *   [PCM_TAP_CAPACITY]     ring size in frames, a power of two
+ *   [PCM_TAP_CHANNELS]
+ *   [PCM_TAP_FORMAT]       PCM_TAP_S16 or PCM_TAP_FLTP
+ *   [PCM_TAP_SAMPLE_RATE]
+ *   [PCM_TAP_DROPPED]      frames dropped because the reader fell behind
+ *   [PCM_TAP_RUNNING]      1 while capturing; set last when a session starts
+ *
+ * S16 is the captured audio, interleaved. FLTP is the resampled encoder input, one plane of
+ * CAPACITY floats per channel, back to back. Frame n lives at index n & (CAPACITY - 1).
+ * When the reader is too far behind for a whole period to fit, the period is dropped rather
+ * than overwriting unread frames.
+ */
+#define PCM_TAP_WRITE 0
+#define PCM_TAP_READ 1
+#define PCM_TAP_CAPACITY 2
+#define PCM_TAP_CHANNELS 3
+#define PCM_TAP_FORMAT 4
+#define PCM_TAP_SAMPLE_RATE 5
+#define PCM_TAP_DROPPED 6
+#define PCM_TAP_RUNNING 7
+#define PCM_TAP_HEADER_BYTES 64
+
+#define PCM_TAP_S16 0
+#define PCM_TAP_FLTP 1
+
+class PcmTap
+{
+    public:
+        PcmTap();
+
+        /* Uses memory (not owned) for the ring; it must stay valid until detach() */
+        void attach(uint8_t *memory, size_t length, int format);
+        void detach();
+        bool attached() const { return memory != NULL; }
+        int format() const { return ring_format; }
+
+        /* Lays out the ring for a session; returns -1 if not even one period fits */
+        int start(int channels, int sample_rate, int period_frames);
+        void stop();
+
+        /* Native thread only */
+        void write_s16(const int16_t *interleaved, int frames);
+        void write_fltp(const float * const *planes, int frames);
+
+    private:
+        /* Returns the ring index to write frames at, or -1 after counting them as dropped */
+        long reserve(int frames);
+        void publish(int frames);
+
+        int32_t *header;
+        uint8_t *memory;
+        size_t length;
+        int ring_format;
+        uint32_t capacity;
+        uint32_t channels;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#include "resampler.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *quality_names[RESAMPLER_QUALITY_COUNT] = { "fast", "default", "high" };
+
+struct SwrContext *create_resampler(int64_t src_ch_layout, int src_rate,
+                                    int64_t dst_ch_layout, int dst_rate,
+                                    ResamplerQuality quality)
+{
+    return create_format_resampler(src_ch_layout, AV_SAMPLE_FMT_S16, src_rate,
+                                   dst_ch_layout, AV_SAMPLE_FMT_FLTP, dst_rate, quality);
+}
+
+static struct SwrContext *alloc_resampler(int64_t src_ch_layout, enum AVSampleFormat src_sample_fmt, int src_rate,
+                                          int64_t dst_ch_layout, enum AVSampleFormat dst_sample_fmt, int dst_rate)
+{
+    /* create resampler context */
+    struct SwrContext *swr_ctx = swr_alloc();
+    if (!swr_ctx) {
+        fprintf(stderr, "Could not allocate resampler context\n");
+        return NULL;
+    }
+
+    /* set options */
+    av_opt_set_int(swr_ctx, "in_channel_layout",    src_ch_layout, 0);
+    av_opt_set_int(swr_ctx, "in_sample_rate",       src_rate, 0);
+    av_opt_set_sample_fmt(swr_ctx, "in_sample_fmt", src_sample_fmt, 0);
+
+    av_opt_set_int(swr_ctx, "out_channel_layout",    dst_ch_layout, 0);
+    av_opt_set_int(swr_ctx, "out_sample_rate",       dst_rate, 0);
+    av_opt_set_sample_fmt(swr_ctx, "out_sample_fmt", dst_sample_fmt, 0);
+    return swr_ctx;
+}
+
+struct SwrContext *create_format_resampler(int64_t src_ch_layout, enum AVSampleFormat src_sample_fmt, int src_rate,
+                                           int64_t dst_ch_layout, enum AVSampleFormat dst_sample_fmt, int dst_rate,
+                                           ResamplerQuality quality)
+{
+    struct SwrContext *swr_ctx;
+
+    if (quality == RESAMPLER_HIGH) {
+        /* soxr at its very high quality precision, when libswresample has it */
+        swr_ctx = alloc_resampler(src_ch_layout, src_sample_fmt, src_rate, dst_ch_layout, dst_sample_fmt, dst_rate);
+        if (!swr_ctx)
+            return NULL;
+        av_opt_set_int(swr_ctx, "resampler", SWR_ENGINE_SOXR, 0);
+        av_opt_set_double(swr_ctx, "precision", 28, 0);
+        if (swr_init(swr_ctx) >= 0)
+            return swr_ctx;
+        swr_free(&swr_ctx);
+
+        static bool warned = false;
+        if (!warned)
+            fprintf(stderr, "soxr is not available, using swresample's long filter for high quality resampling\n");
+        warned = true;
+    }
+
+    swr_ctx = alloc_resampler(src_ch_layout, src_sample_fmt, src_rate, dst_ch_layout, dst_sample_fmt, dst_rate);
+    if (!swr_ctx)
+        return NULL;
+
+    if (quality == RESAMPLER_FAST) {
+        av_opt_set_int(swr_ctx, "filter_size", 8, 0);
+        av_opt_set_int(swr_ctx, "phase_shift", 6, 0);
+        av_opt_set_int(swr_ctx, "linear_interp", 1, 0);
+    } else if (quality == RESAMPLER_HIGH) {
+        av_opt_set_int(swr_ctx, "filter_size", 64, 0);
+        av_opt_set_int(swr_ctx, "phase_shift", 12, 0);
+        av_opt_set_double(swr_ctx, "cutoff", 0.98, 0);
+    }
+
+    /* initialize the resampling context */
+    if (swr_init(swr_ctx) < 0) {
+        fprintf(stderr, "Failed to initialize the resampling context\n");
+        swr_free(&swr_ctx);
+        return NULL;
+    }
+    return swr_ctx;
+}
+
+int parse_resampler_quality(const char *name)
+{
+    for (int q = 0; q < RESAMPLER_QUALITY_COUNT; q++) {
+        if (!strcmp(name, quality_names[q]))
+            return q;
+    }
+    return -1;
+}
+
+const char *resampler_quality_name(ResamplerQuality quality)
+{
+    return quality_names[quality];
+}
@@ -0,0 +1,38 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+extern "C"
+{
+#include <libavutil/opt.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+#include <stdint.h>
+
+/*
+ * Rate conversion quality tiers, cheapest first. FAST is a short filter with linear
+ * interpolation between phases, DEFAULT is swresample's defaults and HIGH is soxr when
+ * libswresample was built with it, otherwise a longer swresample filter.
+ */
+enum ResamplerQuality { RESAMPLER_FAST, RESAMPLER_DEFAULT, RESAMPLER_HIGH, RESAMPLER_QUALITY_COUNT };
+
+/*
+ * Creates and initializes the interleaved S16 to planar float resampler used between
+ * capture and encoding. Returns NULL when the context cannot be set up.
+ */
+struct SwrContext *create_resampler(int64_t src_ch_layout, int src_rate,
+                                    int64_t dst_ch_layout, int dst_rate,
+                                    ResamplerQuality quality = RESAMPLER_DEFAULT);
+
+/* Same, for any pair of sample formats */
+struct SwrContext *create_format_resampler(int64_t src_ch_layout, enum AVSampleFormat src_sample_fmt, int src_rate,
+                                           int64_t dst_ch_layout, enum AVSampleFormat dst_sample_fmt, int dst_rate,
+                                           ResamplerQuality quality = RESAMPLER_DEFAULT);
+
+/* Parses "fast", "default" or "high"; returns -1 for anything else */
+int parse_resampler_quality(const char *name);
+
+const char *resampler_quality_name(ResamplerQuality quality);
+
+#endif
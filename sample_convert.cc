@@ -0,0 +1,76 @@
+#include "sample_convert.h"
+#include <string.h>
+
+#define S16_SCALE (1.0f / 32768.0f)
+
+void convert_s16_to_fltp(const int16_t *in, float **out, int frames, int channels, SignalLevel *level)
+{
+    int peak = 0;
+    int64_t energy = 0;
+
+    for (int i = 0; i < frames; i++) {
+        for (int c = 0; c < channels; c++) {
+            int sample = in[i * channels + c];
+            int magnitude = sample < 0 ? -sample : sample;
+            peak = magnitude > peak ? magnitude : peak;
+            energy += sample * sample;
+            out[c][i] = sample * S16_SCALE;
+        }
+    }
+
+    level->peak = peak * S16_SCALE;
+    level->energy = energy * (double) S16_SCALE * S16_SCALE;
+    level->samples = (long) frames * channels;
+}
+
+void measure_s16(const int16_t *in, long samples, SignalLevel *level)
+{
+    int peak = 0;
+    int64_t energy = 0;
+
+    for (long i = 0; i < samples; i++) {
+        int sample = in[i];
+        int magnitude = sample < 0 ? -sample : sample;
+        peak = magnitude > peak ? magnitude : peak;
+        energy += sample * sample;
+    }
+
+    level->peak = peak * S16_SCALE;
+    level->energy = energy * (double) S16_SCALE * S16_SCALE;
+    level->samples = samples;
+}
+
+#define CONVERTERS(format, layout) \
+    { convert_samples<format, layout, 0>, convert_samples<format, layout, 1>, convert_samples<format, layout, 2> }
+#define CONVERTERS_FOR(format) \
+    { CONVERTERS(format, LAYOUT_PLANAR), CONVERTERS(format, LAYOUT_INTERLEAVED) }
+
+/* [format][layout][0 = any channel count, 1 = mono, 2 = stereo] */
+static const ConvertFunction converters[SAMPLE_FORMAT_COUNT][LAYOUT_COUNT][3] = {
+    CONVERTERS_FOR(SAMPLE_U8),
+    CONVERTERS_FOR(SAMPLE_S16),
+    CONVERTERS_FOR(SAMPLE_S24),
+    CONVERTERS_FOR(SAMPLE_S32),
+    CONVERTERS_FOR(SAMPLE_F32),
+};
+
+ConvertFunction find_converter(SampleFormat format, SampleLayout layout, int channels)
+{
+    return converters[format][layout][channels <= 2 ? channels : 0];
+}
+
+int sample_format_size(SampleFormat format)
+{
+    static const int sizes[SAMPLE_FORMAT_COUNT] = { 1, 2, 3, 4, 4 };
+    return sizes[format];
+}
+
+int parse_sample_format(const char *name)
+{
+    static const char *names[SAMPLE_FORMAT_COUNT] = { "u8", "s16", "s24", "s32", "f32" };
+    for (int f = 0; f < SAMPLE_FORMAT_COUNT; f++) {
+        if (!strcmp(name, names[f]))
+            return f;
+    }
+    return -1;
+}
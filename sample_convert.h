@@ -0,0 +1,118 @@
+#ifndef SAMPLE_CONVERT_H
+#define SAMPLE_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Peak and sum of squares of the samples a conversion passed over, full scale = 1.0 */
+struct SignalLevel
+{
+    float peak;
+    double energy;
+    long samples;
+};
+
+/*
+ * Deinterleaves S16 into planar float and measures the signal in the same pass, for
+ * the common case where capture and encoder rates and channel counts already match.
+ */
+void convert_s16_to_fltp(const int16_t *in, float **out, int frames, int channels, SignalLevel *level);
+
+/* Measures interleaved S16 without converting it, for periods that go through swr_convert() */
+void measure_s16(const int16_t *in, long samples, SignalLevel *level);
+
+/*
+ * Format conversion without resampling, specialized at compile time on the source format,
+ * destination layout and channel count so the common mono and stereo loops are fully
+ * unrolled. find_converter() picks the instantiation once, at init.
+ *
+ * Sources are interleaved; S24 is packed little endian (S24_3LE). Destinations are planar
+ * float (out[c] per channel) or interleaved float (out[0]).
+ */
+enum SampleFormat { SAMPLE_U8, SAMPLE_S16, SAMPLE_S24, SAMPLE_S32, SAMPLE_F32, SAMPLE_FORMAT_COUNT };
+enum SampleLayout { LAYOUT_PLANAR, LAYOUT_INTERLEAVED, LAYOUT_COUNT };
+
+typedef void (*ConvertFunction)(const uint8_t *in, float **out, int frames, int channels);
+
+/* Input may sit at any byte offset, so wider samples are read with memcpy; it compiles to a plain load */
+template <int Format> struct SampleReader;
+
+template <> struct SampleReader<SAMPLE_U8>
+{
+    enum { SIZE = 1 };
+    static float read(const uint8_t *p) { return (p[0] - 128) * (1.0f / 128.0f); }
+};
+
+template <> struct SampleReader<SAMPLE_S16>
+{
+    enum { SIZE = 2 };
+    static float read(const uint8_t *p)
+    {
+        int16_t v;
+        memcpy(&v, p, sizeof(v));
+        return v * (1.0f / 32768.0f);
+    }
+};
+
+template <> struct SampleReader<SAMPLE_S24>
+{
+    enum { SIZE = 3 };
+    static float read(const uint8_t *p)
+    {
+        int32_t v = (int32_t) ((uint32_t) p[0] << 8 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 24) >> 8;
+        return v * (1.0f / 8388608.0f);
+    }
+};
+
+template <> struct SampleReader<SAMPLE_S32>
+{
+    enum { SIZE = 4 };
+    static float read(const uint8_t *p)
+    {
+        int32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v * (1.0f / 2147483648.0f);
+    }
+};
+
+template <> struct SampleReader<SAMPLE_F32>
+{
+    enum { SIZE = 4 };
+    static float read(const uint8_t *p)
+    {
+        float v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+};
+
+/* Channels == 0 takes the channel count at run time */
+template <int Format, int Layout, int Channels>
+void convert_samples(const uint8_t *in, float **out, int frames, int channels)
+{
+    typedef SampleReader<Format> Reader;
+    const int nb_channels = Channels ? Channels : channels;
+
+    for (int i = 0; i < frames; i++) {
+        const uint8_t *frame = in + (size_t) i * nb_channels * Reader::SIZE;
+        for (int c = 0; c < nb_channels; c++) {
+            float sample = Reader::read(frame + c * Reader::SIZE);
+            if (Layout == LAYOUT_PLANAR)
+                out[c][i] = sample;
+            else
+                out[0][(size_t) i * nb_channels + c] = sample;
+        }
+    }
+}
+
+/* Returns the converter for the combination; never NULL for valid enum values */
+ConvertFunction find_converter(SampleFormat format, SampleLayout layout, int channels);
+
+/* Bytes per interleaved sample of a source format */
+int sample_format_size(SampleFormat format);
+
+/* Parses "u8", "s16", "s24", "s32" or "f32"; returns -1 for anything else */
+int parse_sample_format(const char *name);
+
+#endif
@@ -0,0 +1,142 @@
+#include "seek_index.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+/*
+ * Cuts a time range out of a long recording through its seek index, reading only the index
+ * pages a binary search touches and the bytes of the range itself.
+ */
+
+/* Parses [[h:]m:]s[.frac] into seconds; returns -1 when it is not a time */
+static double parse_time(const char *text)
+{
+    double seconds = 0;
+    const char *p = text;
+    for (;;) {
+        char *end;
+        double part = strtod(p, &end);
+        if (end == p || part < 0)
+            return -1;
+        seconds = seconds * 60 + part;
+        if (!*end)
+            return seconds;
+        if (*end != ':')
+            return -1;
+        p = end + 1;
+    }
+}
+
+static std::string format_time(int64_t pts, unsigned int rate)
+{
+    char text[32];
+    double seconds = pts > 0 ? (double) pts / rate : 0;
+    int64_t whole = (int64_t) seconds;
+    snprintf(text, sizeof(text), "%lld:%02lld:%06.3f", (long long) (whole / 3600), (long long) (whole / 60 % 60),
+             seconds - whole / 60 * 60);
+    return text;
+}
+
+static std::string format_wall(int64_t wall_ns)
+{
+    char text[64];
+    time_t seconds = wall_ns / 1000000000LL;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    size_t length = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &local);
+    snprintf(text + length, sizeof(text) - length, ".%03lld", (long long) (wall_ns / 1000000 % 1000));
+    return text;
+}
+
+static const char *format_names[] = { "raw", "wav", "adts", "fmp4" };
+
+int main(int argc, char *argv[])
+{
+    const char *media = NULL;
+    const char *index_path = NULL;
+    const char *output = NULL;
+    const char *from_text = NULL;
+    const char *to_text = NULL;
+    bool wall = false;
+    bool info = false;
+    bool usage = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--index") && i + 1 < argc)
+            index_path = argv[++i];
+        else if (!strcmp(argv[i], "--from") && i + 1 < argc)
+            from_text = argv[++i];
+        else if (!strcmp(argv[i], "--to") && i + 1 < argc)
+            to_text = argv[++i];
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else if (!strcmp(argv[i], "--wall"))
+            wall = true;
+        else if (!strcmp(argv[i], "--info"))
+            info = true;
+        else if (argv[i][0] == '-' || media)
+            usage = true;
+        else
+            media = argv[i];
+    }
+    if (usage || !media || (!info && (!output || !from_text))) {
+        fprintf(stderr, "Usage: %s [--index recording.idx] --from time [--to time] -o clip recording\n"
+                "       %s [--index recording.idx] --wall --from unix_seconds [--to unix_seconds] -o clip recording\n"
+                "       %s [--index recording.idx] --info recording\n"
+                "Copies a range of a recording made with a seek index into clip, in the same format. Times\n"
+                "are [[h:]m:]s into the recording, or with --wall when it was captured. The index defaults\n"
+                "to recording.idx.\n", argv[0], argv[0], argv[0]);
+        return -1;
+    }
+
+    std::string default_index = std::string(media) + ".idx";
+    SeekIndex index;
+    int err = index.open(index_path ? index_path : default_index.c_str());
+    if (err)
+        return err;
+    const SeekIndexHeader &header = index.header();
+    unsigned int rate = header.sample_rate;
+
+    if (info) {
+        const SeekIndexEntry &first = index[0], &last = index[index.size() - 1];
+        printf("%s: %s, %u Hz, %u channels, %zu entries\n", media,
+               header.format < sizeof(format_names) / sizeof(format_names[0]) ? format_names[header.format] : "?",
+               rate, header.channels, index.size());
+        printf("  from %s (%s) at byte %llu\n", format_time(first.pts, rate).c_str(),
+               format_wall(first.wall_ns).c_str(), (unsigned long long) first.offset);
+        printf("  to   %s (%s) at byte %llu\n", format_time(last.pts, rate).c_str(),
+               format_wall(last.wall_ns).c_str(), (unsigned long long) last.offset);
+        return 0;
+    }
+
+    int64_t from, to = INT64_MAX;
+    if (wall) {
+        double from_seconds = atof(from_text), to_seconds = to_text ? atof(to_text) : 0;
+        from = index.wall_to_pts((int64_t) (from_seconds * 1e9));
+        if (to_text)
+            to = index.wall_to_pts((int64_t) (to_seconds * 1e9));
+    } else {
+        double from_seconds = parse_time(from_text), to_seconds = to_text ? parse_time(to_text) : 0;
+        if (from_seconds < 0 || to_seconds < 0) {
+            fprintf(stderr, "Times are [[h:]m:]s, e.g. 3:57:00 or 14220.5\n");
+            return -1;
+        }
+        from = (int64_t) (from_seconds * rate);
+        if (to_text)
+            to = (int64_t) (to_seconds * rate);
+    }
+    if (to < from) {
+        fprintf(stderr, "The range ends before it starts\n");
+        return -1;
+    }
+
+    err = seek_extract(index, media, output, &from, &to);
+    if (err)
+        return err;
+    printf("Copied %s to %s of %s into %s\n", format_time(from, rate).c_str(),
+           to < 0 ? "the end" : format_time(to, rate).c_str(), media, output);
+    return 0;
+}
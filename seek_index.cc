@@ -0,0 +1,251 @@
+#include "seek_index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "capture_stats.h"
+#include "wav_sink.h"
+
+SeekIndexWriter::SeekIndexWriter()
+{
+    fd = -1;
+    sample_rate = 0;
+    interval = 0;
+    last_pts = 0;
+    entries = 0;
+    clock_pts = 0;
+    clock_wall_ns = 0;
+}
+
+SeekIndexWriter::~SeekIndexWriter()
+{
+    close();
+}
+
+/* Entries and the header are a few bytes, so a short write is an error rather than something to retry */
+static int write_record(int fd, const void *data, size_t size)
+{
+    ssize_t written = ::write(fd, data, size);
+    if (written == (ssize_t) size)
+        return 0;
+    return written < 0 ? -errno : -EIO;
+}
+
+int SeekIndexWriter::open(const char *path, SeekIndexFormat format, unsigned int rate, unsigned int channels,
+                          unsigned int bits_per_sample, double interval_seconds)
+{
+    close();
+
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        int err = -errno;
+        fprintf(stderr, "Could not create %s: %s\n", path, strerror(errno));
+        return err;
+    }
+
+    sample_rate = rate;
+    interval = interval_seconds * rate;
+    if (interval < 1)
+        interval = 1;
+    entries = 0;
+    clock_wall_ns = 0;
+
+    SeekIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEEK_INDEX_MAGIC, 4);
+    header.version = SEEK_INDEX_VERSION;
+    header.format = format;
+    header.sample_rate = rate;
+    header.channels = channels;
+    header.bits_per_sample = bits_per_sample;
+
+    int err = write_record(fd, &header, sizeof(header));
+    if (err) {
+        fprintf(stderr, "Could not write the header of %s: %s\n", path, strerror(-err));
+        ::close(fd);
+        fd = -1;
+    }
+    return err;
+}
+
+void SeekIndexWriter::set_clock(int64_t pts, int64_t wall_ns)
+{
+    clock_pts = pts;
+    clock_wall_ns = wall_ns;
+}
+
+int SeekIndexWriter::add(int64_t pts, uint64_t offset)
+{
+    if (fd < 0)
+        return -EBADF;
+
+    SeekIndexEntry entry;
+    entry.pts = pts;
+    entry.wall_ns = clock_wall_ns ? clock_wall_ns + (pts - clock_pts) * 1000000000LL / sample_rate : realtime_ns();
+    entry.offset = offset;
+
+    int err = write_record(fd, &entry, sizeof(entry));
+    if (err) {
+        fprintf(stderr, "Could not write a seek index entry: %s\n", strerror(-err));
+        return err;
+    }
+    last_pts = pts;
+    entries++;
+    return 0;
+}
+
+int SeekIndexWriter::close()
+{
+    if (fd < 0)
+        return 0;
+    int err = ::close(fd) < 0 ? -errno : 0;
+    fd = -1;
+    return err;
+}
+
+SeekIndex::SeekIndex()
+{
+    head = NULL;
+    entries = NULL;
+    count = 0;
+}
+
+int SeekIndex::open(const char *path)
+{
+    int err = file.open(path);
+    if (err)
+        return err;
+
+    /* A recording still being written may end in a partial entry, which is left out */
+    head = (const SeekIndexHeader *) file.data();
+    if (file.size() < sizeof(SeekIndexHeader) || memcmp(head->magic, SEEK_INDEX_MAGIC, 4) ||
+        head->version != SEEK_INDEX_VERSION || !head->sample_rate) {
+        fprintf(stderr, "%s is not a seek index\n", path);
+        return -EINVAL;
+    }
+    entries = (const SeekIndexEntry *) (file.data() + sizeof(SeekIndexHeader));
+    count = (file.size() - sizeof(SeekIndexHeader)) / sizeof(SeekIndexEntry);
+    if (!count) {
+        fprintf(stderr, "%s has no entries yet\n", path);
+        return -ENODATA;
+    }
+    return 0;
+}
+
+size_t SeekIndex::find_pts(int64_t pts) const
+{
+    size_t low = 0, high = count;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (entries[mid].pts <= pts)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* Assumes the wall clock did not step backwards during the recording */
+size_t SeekIndex::find_wall(int64_t wall_ns) const
+{
+    size_t low = 0, high = count;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (entries[mid].wall_ns <= wall_ns)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+int64_t SeekIndex::wall_to_pts(int64_t wall_ns) const
+{
+    const SeekIndexEntry &entry = entries[find_wall(wall_ns)];
+    int64_t pts = entry.pts + ((wall_ns - entry.wall_ns) * head->sample_rate + 500000000LL) / 1000000000LL;
+    return pts > 0 ? pts : 0;
+}
+
+static int write_bytes(FILE *out, const uint8_t *data, size_t size)
+{
+    return fwrite(data, 1, size, out) == size ? 0 : -EIO;
+}
+
+int seek_extract(const SeekIndex &index, const char *media, const char *out, int64_t *from, int64_t *to)
+{
+    const SeekIndexHeader &header = index.header();
+    MappedFile input;
+    int err = input.open(media, true);
+    if (err)
+        return err;
+    if (input.size() < index[0].offset) {
+        fprintf(stderr, "%s is shorter than its index says\n", media);
+        return -EINVAL;
+    }
+
+    if (header.format == SEEK_INDEX_RAW || header.format == SEEK_INDEX_WAV) {
+        /* Every frame is a seek point; the index only places the data and times it */
+        size_t block_align = header.channels * header.bits_per_sample / 8;
+        if (!block_align)
+            return -EINVAL;
+        size_t data_start = index[0].offset - index[0].pts * block_align;
+        size_t data_bytes = input.size() - data_start;
+        if (header.format == SEEK_INDEX_WAV) {
+            PcmLayout layout;
+            if (!parse_pcm_layout(input.data(), input.size(), &layout) && layout.offset == data_start)
+                data_bytes = layout.bytes;
+        }
+        int64_t total = data_bytes / block_align;
+        *from = *from < 0 ? 0 : *from > total ? total : *from;
+        *to = *to < *from ? *from : *to > total ? total : *to;
+        const uint8_t *start = input.data() + data_start + *from * block_align;
+        size_t size = (*to - *from) * block_align;
+
+        if (header.format == SEEK_INDEX_WAV) {
+            WavSink sink;
+            err = sink.open(out, header.sample_rate, header.channels, header.bits_per_sample);
+            if (!err)
+                err = sink.write(start, size);
+            int close_err = sink.close();
+            return err ? err : close_err;
+        }
+        FILE *file = fopen(out, "wb");
+        if (!file) {
+            fprintf(stderr, "Could not create %s: %s\n", out, strerror(errno));
+            return -errno;
+        }
+        err = write_bytes(file, start, size);
+        if (fclose(file) && !err)
+            err = -EIO;
+        return err;
+    }
+
+    /* Compressed audio starts at the entry at or before from and ends at the first one at or after to */
+    size_t first = index.find_pts(*from);
+    size_t last = index.find_pts(*to);
+    if (index[last].pts < *to)
+        last++;
+    uint64_t start = index[first].offset;
+    uint64_t end = last < index.size() ? index[last].offset : input.size();
+    if (end > input.size())
+        end = input.size();
+    *from = index[first].pts;
+    *to = last < index.size() ? index[last].pts : -1;
+
+    FILE *file = fopen(out, "wb");
+    if (!file) {
+        fprintf(stderr, "Could not create %s: %s\n", out, strerror(errno));
+        return -errno;
+    }
+    /* The init segment, ftyp and moov, comes before the first fragment */
+    if (header.format == SEEK_INDEX_FMP4)
+        err = write_bytes(file, input.data(), index[0].offset);
+    if (!err && end > start)
+        err = write_bytes(file, input.data() + start, end - start);
+    if (fclose(file) && !err)
+        err = -EIO;
+    if (err)
+        fprintf(stderr, "Could not write %s\n", out);
+    return err;
+}
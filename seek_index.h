@@ -0,0 +1,110 @@
+#ifndef SEEK_INDEX_H
+#define SEEK_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mapped_file.h"
+
+/*
+ * A sidecar index for long recordings, so a clip from hour three is a binary search and
+ * two seeks instead of a scan. The file is a header followed by fixed-size entries, each
+ * mapping a pts (in samples) and the wall-clock time it was captured to the byte offset of
+ * a point where reading can start: a frame for raw PCM and WAV, an ADTS header, or the moof
+ * of a fragment for fragmented MP4. Entries are appended as the recording is written, so
+ * the index of a live or crashed recording is usable up to its last whole entry.
+ *
+ * Fields are in native byte order, like the float outputs.
+ */
+#define SEEK_INDEX_MAGIC "CSIX"
+#define SEEK_INDEX_VERSION 1
+
+enum SeekIndexFormat { SEEK_INDEX_RAW, SEEK_INDEX_WAV, SEEK_INDEX_ADTS, SEEK_INDEX_FMP4 };
+
+struct SeekIndexHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t format;                // SeekIndexFormat
+    uint32_t sample_rate;           // pts are in 1 / sample_rate
+    uint32_t channels;
+    uint32_t bits_per_sample;       // of the PCM formats, 0 otherwise
+    uint64_t reserved;
+};
+
+struct SeekIndexEntry
+{
+    int64_t pts;
+    int64_t wall_ns;                // CLOCK_REALTIME
+    uint64_t offset;                // in the media file; the first entry's marks the end of any header or init segment
+};
+
+/* Appends entries to an index while its recording is written */
+class SeekIndexWriter
+{
+    public:
+        SeekIndexWriter();
+        ~SeekIndexWriter();
+
+        /* Creates path and writes the header; entries are at least interval seconds of pts apart */
+        int open(const char *path, SeekIndexFormat format, unsigned int sample_rate, unsigned int channels,
+                 unsigned int bits_per_sample, double interval);
+
+        /* The sample at pts was captured at wall_ns; later entries are timed from here */
+        void set_clock(int64_t pts, int64_t wall_ns);
+
+        /* Whether an entry at pts is due: the first one, or an interval after the last */
+        bool due(int64_t pts) const { return fd >= 0 && (!entries || pts >= last_pts + interval); }
+
+        /* Writes an entry straight out; returns 0 or a negative errno */
+        int add(int64_t pts, uint64_t offset);
+
+        int close();
+
+        bool is_open() const { return fd >= 0; }
+
+    private:
+        int fd;
+        unsigned int sample_rate;
+        int64_t interval;
+        int64_t last_pts;
+        uint64_t entries;
+        int64_t clock_pts;
+        int64_t clock_wall_ns;          // 0 until set_clock(), when entries take the time they are added
+};
+
+/* A mapped index, searched in O(log n) */
+class SeekIndex
+{
+    public:
+        SeekIndex();
+
+        /* Returns 0 or a negative errno; an index without a single entry is an error */
+        int open(const char *path);
+
+        const SeekIndexHeader &header() const { return *head; }
+        size_t size() const { return count; }
+        const SeekIndexEntry &operator[](size_t i) const { return entries[i]; }
+
+        /* The last entry at or before pts, or wall_ns; the first one when all are later */
+        size_t find_pts(int64_t pts) const;
+        size_t find_wall(int64_t wall_ns) const;
+
+        /* pts of the sample captured at wall_ns, interpolated from the entry before it */
+        int64_t wall_to_pts(int64_t wall_ns) const;
+
+    private:
+        MappedFile file;
+        const SeekIndexHeader *head;
+        const SeekIndexEntry *entries;
+        size_t count;
+};
+
+/*
+ * Copies pts [from, to) of media to out, in media's format: PCM is cut to the sample and
+ * a WAV gets a header of its own, compressed audio is cut at the index entries around the
+ * range and a fragmented MP4 keeps its init segment. The range actually copied is returned
+ * in from and to. Returns 0 or a negative errno.
+ */
+int seek_extract(const SeekIndex &index, const char *media, const char *out, int64_t *from, int64_t *to);
+
+#endif
@@ -0,0 +1,267 @@
+#include "shared_encoder_pool.h"
+#include <stdio.h>
+#include "stage_pipeline.h"
+
+/* Jobs a stream runs in one turn before the other streams on its worker go first */
+#define JOBS_PER_TURN 4
+
+struct EncoderPoolJob
+{
+    std::function<void()> run;
+    int64_t deadline_ns;
+    int64_t submitted_ns;
+};
+
+struct EncoderPoolStream
+{
+    std::string name;
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::deque<EncoderPoolJob> jobs;
+    bool scheduled;                 // in a deque or running, which keeps it on one worker at a time
+
+    std::atomic<uint64_t> completed;
+    std::atomic<uint64_t> misses;
+    std::atomic<int64_t> max_late_ns;
+    std::atomic<int64_t> busy_ns;
+    LatencyHistogram turnaround;
+};
+
+struct EncoderPoolWorker
+{
+    std::thread thread;
+    std::mutex mutex;
+    std::deque<EncoderPoolStream *> ready;
+};
+
+/* Index of the worker running on this thread, -1 elsewhere */
+static thread_local int current_worker = -1;
+
+SharedEncoderPool &SharedEncoderPool::instance()
+{
+    static SharedEncoderPool pool;
+    return pool;
+}
+
+SharedEncoderPool::SharedEncoderPool()
+{
+    configured = 0;
+    stopping = false;
+    ready = 0;
+    sleepers = 0;
+    next_worker = 0;
+    steal_count = 0;
+}
+
+SharedEncoderPool::~SharedEncoderPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (EncoderPoolWorker *worker: workers) {
+        worker->thread.join();
+        delete worker;
+    }
+    for (EncoderPoolStream *stream: streams)
+        delete stream;
+}
+
+void SharedEncoderPool::configure(int threads)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    configured = threads > 0 ? threads : 0;
+}
+
+int SharedEncoderPool::threads()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!workers.empty())
+        return workers.size();
+    int cores = std::thread::hardware_concurrency();
+    return configured ? configured : cores > 0 ? cores : 1;
+}
+
+/* Called with lock held; the worker list never changes once the threads run */
+void SharedEncoderPool::start()
+{
+    int cores = std::thread::hardware_concurrency();
+    int count = configured ? configured : cores > 0 ? cores : 1;
+    for (int i = 0; i < count; i++)
+        workers.push_back(new EncoderPoolWorker());
+    for (int i = 0; i < count; i++)
+        workers[i]->thread = std::thread(&SharedEncoderPool::work, this, i);
+}
+
+EncoderPoolStream *SharedEncoderPool::add(const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (workers.empty())
+        start();
+
+    EncoderPoolStream *stream = new EncoderPoolStream();
+    stream->name = name;
+    stream->scheduled = false;
+    stream->completed = 0;
+    stream->misses = 0;
+    stream->max_late_ns = 0;
+    stream->busy_ns = 0;
+    streams.push_back(stream);
+    return stream;
+}
+
+void SharedEncoderPool::remove(EncoderPoolStream *stream)
+{
+    wait(stream);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = 0; i < streams.size(); i++) {
+            if (streams[i] == stream) {
+                streams.erase(streams.begin() + i);
+                break;
+            }
+        }
+    }
+    delete stream;
+}
+
+void SharedEncoderPool::submit(EncoderPoolStream *stream, std::function<void()> job, int64_t deadline_ns)
+{
+    {
+        std::lock_guard<std::mutex> guard(stream->mutex);
+        stream->jobs.push_back(EncoderPoolJob { std::move(job), deadline_ns, monotonic_ns() });
+        if (stream->scheduled)
+            return;
+        stream->scheduled = true;
+    }
+    schedule(stream);
+}
+
+/* Puts a stream with work at the back of the calling worker's deque, or of the next one in turn */
+void SharedEncoderPool::schedule(EncoderPoolStream *stream)
+{
+    int index = current_worker >= 0 ? current_worker : next_worker.fetch_add(1) % workers.size();
+    {
+        std::lock_guard<std::mutex> guard(workers[index]->mutex);
+        workers[index]->ready.push_back(stream);
+    }
+
+    /* Paired with work(): either a parking worker sees ready or we see it parked */
+    ready.fetch_add(1);
+    if (sleepers.load()) {
+        std::lock_guard<std::mutex> guard(lock);
+        wake.notify_one();
+    }
+}
+
+/* The oldest stream of the worker's own deque, else the newest of another's */
+EncoderPoolStream *SharedEncoderPool::take(int index)
+{
+    int count = workers.size();
+    if (!ready.load())
+        return NULL;
+
+    for (int i = 0; i < count; i++) {
+        EncoderPoolWorker *worker = workers[(index + i) % count];
+        std::lock_guard<std::mutex> guard(worker->mutex);
+        if (worker->ready.empty())
+            continue;
+        EncoderPoolStream *stream;
+        if (i == 0) {
+            stream = worker->ready.front();
+            worker->ready.pop_front();
+        } else {
+            stream = worker->ready.back();
+            worker->ready.pop_back();
+            steal_count.fetch_add(1, std::memory_order_relaxed);
+        }
+        ready.fetch_sub(1);
+        return stream;
+    }
+    return NULL;
+}
+
+void SharedEncoderPool::run(EncoderPoolStream *stream)
+{
+    for (int turn = 0; ; turn++) {
+        EncoderPoolJob job;
+        {
+            std::lock_guard<std::mutex> guard(stream->mutex);
+            if (stream->jobs.empty()) {
+                stream->scheduled = false;
+                stream->idle.notify_all();
+                return;
+            }
+            if (turn == JOBS_PER_TURN)
+                break;
+            job = std::move(stream->jobs.front());
+            stream->jobs.pop_front();
+        }
+
+        int64_t started_ns = monotonic_ns();
+        job.run();
+        int64_t done_ns = monotonic_ns();
+        stream->busy_ns.fetch_add(done_ns - started_ns, std::memory_order_relaxed);
+        stream->completed.fetch_add(1, std::memory_order_relaxed);
+        stream->turnaround.record((done_ns - job.submitted_ns) / 1000);
+        if (job.deadline_ns && done_ns > job.deadline_ns) {
+            stream->misses.fetch_add(1, std::memory_order_relaxed);
+            if (done_ns - job.deadline_ns > stream->max_late_ns.load(std::memory_order_relaxed))
+                stream->max_late_ns.store(done_ns - job.deadline_ns, std::memory_order_relaxed);
+        }
+    }
+
+    /* More work left: still scheduled, back of the line */
+    schedule(stream);
+}
+
+void SharedEncoderPool::work(int index)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "encoder-%d", index);
+    enter_stage(name, -1);
+    current_worker = index;
+
+    for (;;) {
+        EncoderPoolStream *stream = take(index);
+        if (stream) {
+            run(stream);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        sleepers.fetch_add(1);
+        wake.wait(guard, [this] { return stopping || ready.load() > 0; });
+        sleepers.fetch_sub(1);
+        if (stopping)
+            return;
+    }
+}
+
+void SharedEncoderPool::wait(EncoderPoolStream *stream)
+{
+    std::unique_lock<std::mutex> guard(stream->mutex);
+    stream->idle.wait(guard, [stream] { return !stream->scheduled; });
+}
+
+void SharedEncoderPool::stats(EncoderPoolStream *stream, EncoderPoolStreamStats *out)
+{
+    out->name = stream->name;
+    out->jobs = stream->completed.load(std::memory_order_relaxed);
+    out->deadline_misses = stream->misses.load(std::memory_order_relaxed);
+    out->max_late_ns = stream->max_late_ns.load(std::memory_order_relaxed);
+    out->busy_ns = stream->busy_ns.load(std::memory_order_relaxed);
+    out->turnaround_p99_us = stream->turnaround.percentile(99);
+    std::lock_guard<std::mutex> guard(stream->mutex);
+    out->queued = stream->jobs.size();
+}
+
+std::vector<EncoderPoolStreamStats> SharedEncoderPool::stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<EncoderPoolStreamStats> all(streams.size());
+    for (size_t i = 0; i < streams.size(); i++)
+        stats(streams[i], &all[i]);
+    return all;
+}
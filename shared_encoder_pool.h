@@ -0,0 +1,88 @@
+#ifndef SHARED_ENCODER_POOL_H
+#define SHARED_ENCODER_POOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "capture_stats.h"
+
+struct EncoderPoolStream;
+struct EncoderPoolWorker;
+
+/* What one stream's jobs did since it was added */
+struct EncoderPoolStreamStats
+{
+    std::string name;
+    uint64_t jobs;
+    uint64_t deadline_misses;       // jobs that finished after their deadline
+    int64_t max_late_ns;            // worst finish past a deadline
+    int64_t busy_ns;                // time its jobs ran
+    uint64_t queued;                // submitted and not yet started
+    uint64_t turnaround_p99_us;     // submit to finish
+};
+
+/*
+ * Process-wide encoder threads shared by every capturer, one per core by default, instead
+ * of a thread per capturer or stream.
+ *
+ * Jobs are submitted to a stream. A stream's jobs run one at a time in submission order,
+ * which is what an encoder needs, but any worker may run them. Each worker keeps a deque
+ * of streams that have work: it takes from the front of its own and, once that is empty,
+ * steals from the back of the others'. A stream runs a few jobs and then goes to the back
+ * of the deque, so a busy stream cannot starve the rest.
+ */
+class SharedEncoderPool
+{
+    public:
+        static SharedEncoderPool &instance();
+
+        /* Sets the number of workers, 0 for one per core; applies when they start, on the first add() */
+        void configure(int threads);
+        int threads();
+
+        /* Adds a stream, starting the workers on first use; name is for the stats only */
+        EncoderPoolStream *add(const std::string &name);
+
+        /* Waits for the stream's jobs and removes it */
+        void remove(EncoderPoolStream *stream);
+
+        /* Queues job on stream without blocking; deadline_ns is a monotonic_ns() time, 0 for none */
+        void submit(EncoderPoolStream *stream, std::function<void()> job, int64_t deadline_ns);
+
+        /* Waits until every job submitted to stream so far has run */
+        void wait(EncoderPoolStream *stream);
+
+        void stats(EncoderPoolStream *stream, EncoderPoolStreamStats *out);
+        std::vector<EncoderPoolStreamStats> stats();
+        uint64_t steals() const { return steal_count.load(std::memory_order_relaxed); }
+
+    private:
+        SharedEncoderPool();
+        ~SharedEncoderPool();
+
+        void start();
+        void work(int index);
+        void schedule(EncoderPoolStream *stream);
+        EncoderPoolStream *take(int index);
+        void run(EncoderPoolStream *stream);
+
+        std::mutex lock;                    // streams, workers, configured and parking
+        std::condition_variable wake;
+        std::vector<EncoderPoolStream *> streams;
+        std::vector<EncoderPoolWorker *> workers;
+        int configured;
+        bool stopping;
+
+        std::atomic<uint64_t> ready;        // streams waiting in the deques
+        std::atomic<int> sleepers;
+        std::atomic<uint64_t> next_worker;  // round robin for submits from outside the pool
+        std::atomic<uint64_t> steal_count;
+};
+
+#endif
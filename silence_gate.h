@@ -0,0 +1,52 @@
+#ifndef SILENCE_GATE_H
+#define SILENCE_GATE_H
+
+#include <math.h>
+#include "sample_convert.h"
+
+#define SILENCE_OFF 0
+#define SILENCE_SKIP 1      // silent periods are not encoded, leaving a gap in the timestamps
+#define SILENCE_ZERO 2      // silent periods are encoded as digital silence; once the gate is closed they are not converted
+
+/*
+ * Decides per period whether the input is silent: the peak has to stay below the threshold
+ * for longer than the hangover, so quiet tails and short pauses in speech are still encoded.
+ */
+class SilenceGate
+{
+    public:
+        SilenceGate() { configure(SILENCE_OFF, -60, 0); }
+
+        void configure(int mode, double threshold_db, long hangover_frames)
+        {
+            this->mode = mode;
+            threshold = pow(10.0, threshold_db / 20.0);
+            hangover = hangover_frames;
+            reset();
+        }
+
+        void reset() { quiet_frames = 0; }
+
+        bool enabled() const { return mode != SILENCE_OFF; }
+        bool closed() const { return mode != SILENCE_OFF && quiet_frames > hangover; }
+        int gate_mode() const { return mode; }
+
+        /* Returns true when a period of frames with this level should be treated as silence */
+        bool update(const SignalLevel &level, long frames)
+        {
+            if (level.peak >= threshold) {
+                quiet_frames = 0;
+                return false;
+            }
+            quiet_frames += frames;
+            return quiet_frames > hangover;
+        }
+
+    private:
+        int mode;
+        double threshold;
+        long hangover;
+        long quiet_frames;
+};
+
+#endif
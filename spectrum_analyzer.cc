@@ -0,0 +1,169 @@
+#include "spectrum_analyzer.h"
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#define SPECTRUM_LOWEST_HZ 20.0
+#define SPECTRUM_FLOOR_DB -120.0f
+
+SpectrumAnalyzer::SpectrumAnalyzer()
+{
+    rdft = NULL;
+    fft_buffer = NULL;
+    nb_bands = 0;
+    written = 0;
+    published = false;
+    running = false;
+}
+
+SpectrumAnalyzer::~SpectrumAnalyzer()
+{
+    stop();
+    cleanup();
+}
+
+void SpectrumAnalyzer::cleanup()
+{
+    if (rdft)
+        av_rdft_end(rdft);
+    rdft = NULL;
+    av_freep(&fft_buffer);
+}
+
+int SpectrumAnalyzer::init(int sample_rate, int fft_size, int bands, double rate)
+{
+    int nbits = 0;
+    while ((1 << nbits) < fft_size)
+        nbits++;
+    if ((1 << nbits) != fft_size || bands < 1 || rate <= 0)
+        return -EINVAL;
+
+    cleanup();
+    this->sample_rate = sample_rate;
+    this->fft_size = fft_size;
+    this->nb_bands = bands;
+    this->rate = rate;
+
+    rdft = av_rdft_init(nbits, DFT_R2C);
+    fft_buffer = (float *) av_malloc(fft_size * sizeof(float));
+    if (!rdft || !fft_buffer) {
+        cleanup();
+        nb_bands = 0;
+        return -ENOMEM;
+    }
+
+    /* Hann window; the scale makes a full scale sine read 0 dB in its band */
+    window.resize(fft_size);
+    double window_sum = 0;
+    for (int i = 0; i < fft_size; i++) {
+        window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / fft_size);
+        window_sum += window[i];
+    }
+    scale = 4.0 / (window_sum * window_sum);
+
+    /* Log-spaced bands from 20 Hz to Nyquist, at least one bin wide each */
+    int bins = fft_size / 2;
+    double ratio = pow(sample_rate / 2.0 / SPECTRUM_LOWEST_HZ, 1.0 / bands);
+    band_edges.resize(bands + 1);
+    int previous = 1;
+    for (int b = 0; b <= bands; b++) {
+        int bin = (int) ceil(SPECTRUM_LOWEST_HZ * pow(ratio, b) * fft_size / sample_rate);
+        bin = bin < previous + (b ? 1 : 0) ? previous + (b ? 1 : 0) : bin;
+        band_edges[b] = bin < bins ? bin : bins;
+        previous = band_edges[b];
+    }
+
+    int history_size = 1;
+    while (history_size < 4 * fft_size)
+        history_size *= 2;
+    history.assign(history_size, 0.0f);
+    written = 0;
+
+    snapshot.assign(bands, SPECTRUM_FLOOR_DB);
+    published = false;
+    return 0;
+}
+
+void SpectrumAnalyzer::start()
+{
+    if (!rdft || running)
+        return;
+    running = true;
+    thread = std::thread(&SpectrumAnalyzer::run, this);
+}
+
+void SpectrumAnalyzer::stop()
+{
+    running = false;
+    if (thread.joinable())
+        thread.join();
+}
+
+void SpectrumAnalyzer::push(const float * const *planes, int channels, int frames)
+{
+    std::lock_guard<std::mutex> lock(history_mutex);
+    size_t mask = history.size() - 1;
+    float gain = 1.0f / channels;
+
+    for (int i = 0; i < frames; i++) {
+        float sum = 0;
+        for (int c = 0; c < channels; c++)
+            sum += planes[c][i];
+        history[(written + i) & mask] = sum * gain;
+    }
+    written += frames;
+}
+
+void SpectrumAnalyzer::run()
+{
+    struct timespec next;
+    long interval_ns = 1e9 / rate;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (running) {
+        next.tv_nsec += interval_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        analyze();
+    }
+}
+
+void SpectrumAnalyzer::analyze()
+{
+    {
+        std::lock_guard<std::mutex> lock(history_mutex);
+        if (written < (uint64_t) fft_size)
+            return;
+        size_t mask = history.size() - 1;
+        for (int i = 0; i < fft_size; i++)
+            fft_buffer[i] = history[(written - fft_size + i) & mask];
+    }
+
+    for (int i = 0; i < fft_size; i++)
+        fft_buffer[i] *= window[i];
+    av_rdft_calc(rdft, fft_buffer);
+
+    /* Packed output: [0] is DC, [1] is Nyquist, then re, im pairs for bins 1 .. fft_size / 2 - 1 */
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    for (int b = 0; b < nb_bands; b++) {
+        double power = 0;
+        for (int k = band_edges[b]; k < band_edges[b + 1]; k++)
+            power += fft_buffer[2 * k] * fft_buffer[2 * k] + fft_buffer[2 * k + 1] * fft_buffer[2 * k + 1];
+        float db = power > 0 ? 10.0 * log10(power * scale) : SPECTRUM_FLOOR_DB;
+        snapshot[b] = db > SPECTRUM_FLOOR_DB ? db : SPECTRUM_FLOOR_DB;
+    }
+    published = true;
+}
+
+bool SpectrumAnalyzer::read(std::vector<float> *bands) const
+{
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    if (!published)
+        return false;
+    *bands = snapshot;
+    return true;
+}
@@ -0,0 +1,71 @@
+#ifndef SPECTRUM_ANALYZER_H
+#define SPECTRUM_ANALYZER_H
+
+extern "C"
+{
+#include <libavcodec/avfft.h>
+#include <libavutil/mem.h>
+}
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+/*
+ * Band energy spectrum of the captured audio, computed on its own thread.
+ *
+ * The capture thread only copies a mono downmix of each period into a history ring.
+ * Every 1/rate seconds the analysis thread copies out the latest fft_size samples,
+ * windows them, runs FFmpeg's SIMD real FFT with a plan made once in init(), sums the
+ * power into log-spaced bands and publishes them as a snapshot. The ring and the
+ * snapshot each have a mutex, held only for those copies.
+ */
+class SpectrumAnalyzer
+{
+    public:
+        SpectrumAnalyzer();
+        ~SpectrumAnalyzer();
+
+        /* Returns -EINVAL unless fft_size is a power of two and bands and rate are positive, -ENOMEM when the FFT cannot be set up */
+        int init(int sample_rate, int fft_size, int bands, double rate);
+        void start();
+        void stop();
+
+        /* Capture thread */
+        void push(const float * const *planes, int channels, int frames);
+
+        /* Any thread: copies the latest band levels in dB, returns false before the first one */
+        bool read(std::vector<float> *bands) const;
+
+        int band_count() const { return nb_bands; }
+
+    private:
+        void run();
+        void analyze();
+        void cleanup();
+
+        int sample_rate;
+        int fft_size;
+        int nb_bands;
+        double rate;
+
+        RDFTContext *rdft;
+        float *fft_buffer;                  // av_malloc'd for the SIMD kernel's alignment
+        std::vector<float> window;
+        std::vector<int> band_edges;        // first FFT bin of every band, plus one past the last
+        float scale;
+
+        std::vector<float> history;         // mono samples, a power of two long
+        uint64_t written;
+        std::mutex history_mutex;           // guards history and written
+
+        std::vector<float> snapshot;        // band levels in dB
+        bool published;                     // snapshot holds a first analysis
+        mutable std::mutex snapshot_mutex;  // guards snapshot and published
+
+        std::thread thread;
+        std::atomic<bool> running;
+};
+
+#endif
@@ -0,0 +1,20 @@
+#include "stage_pipeline.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+void enter_stage(const char *name, int cpu)
+{
+    /* Shows up in top -H and perf, at most 15 characters */
+    pthread_setname_np(pthread_self(), name);
+    if (cpu < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err)
+        fprintf(stderr, "Could not pin the %s stage to CPU %d: %s\n", name, cpu, strerror(err));
+}
@@ -0,0 +1,156 @@
+#ifndef STAGE_PIPELINE_H
+#define STAGE_PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+/*
+ * Bounded queue between two pipeline stages, one thread pushing and one popping. push()
+ * and pop() are lock-free and never block. pop_wait() spins briefly when the queue is
+ * empty and then parks; only then does the producer take a lock to wake it, so a busy
+ * pipeline never touches the mutex.
+ */
+template <typename T>
+class SpscQueue
+{
+    public:
+        /* capacity is rounded up to a power of two */
+        explicit SpscQueue(size_t capacity)
+        {
+            size_t size = 1;
+            while (size < capacity)
+                size <<= 1;
+            slots.resize(size);
+            mask = size - 1;
+            head = 0;
+            tail = 0;
+            waiting = false;
+            closed = false;
+        }
+
+        /* Producer: false when the queue is full */
+        bool push(const T &item)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) > mask)
+                return false;
+            slots[t & mask] = item;
+            tail.store(t + 1, std::memory_order_seq_cst);
+            if (waiting.load(std::memory_order_seq_cst)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                ready.notify_one();
+            }
+            return true;
+        }
+
+        /* Consumer: false when the queue is empty */
+        bool pop(T *item)
+        {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire))
+                return false;
+            *item = slots[h & mask];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        /* Consumer: waits for an item; false once the queue is closed and drained */
+        bool pop_wait(T *item)
+        {
+            for (int spin = 0; spin < 64; spin++) {
+                if (pop(item))
+                    return true;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                /* Paired with push(): either it sees the flag or we see its item */
+                waiting.store(true, std::memory_order_seq_cst);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (pop(item)) {
+                    waiting.store(false, std::memory_order_relaxed);
+                    return true;
+                }
+                if (closed) {
+                    waiting.store(false, std::memory_order_relaxed);
+                    return false;
+                }
+                ready.wait(lock);
+            }
+        }
+
+        /* Producer: no more items; the consumer drains what is queued and then sees false */
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            ready.notify_one();
+        }
+
+        size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+        size_t capacity() const { return mask + 1; }
+
+    private:
+        std::vector<T> slots;
+        size_t mask;
+        /* Padded onto their own cache lines; alignas would need C++17 aligned new */
+        char pad0[64];
+        std::atomic<size_t> head;           // written by the consumer only
+        char pad1[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> tail;           // written by the producer only
+        char pad2[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<bool> waiting;
+        std::atomic<bool> closed;
+        std::mutex mutex;
+        std::condition_variable ready;
+};
+
+/*
+ * What one stage did since the session started. Its own thread writes it, getStats()
+ * reads it, so everything is a relaxed atomic.
+ */
+struct StageMetrics
+{
+    const char *name;
+    int cpu;                                // pinned to, -1 when the scheduler decides
+    std::atomic<uint64_t> items;            // items the stage finished
+    std::atomic<uint64_t> dropped;          // items it had to drop because the next stage was full
+    std::atomic<int64_t> busy_ns;           // time spent working, not waiting for input
+    std::atomic<int64_t> cpu_ns;            // CPU time of the stage thread
+    std::atomic<uint64_t> queue_sum;        // input queue depth summed over items, for the average
+    std::atomic<uint64_t> queue_max;
+    size_t queue_capacity;                  // 0 for the first stage, which has no input queue
+
+    StageMetrics() { reset(NULL, -1, 0); }
+
+    void reset(const char *stage, int pinned_cpu, size_t capacity)
+    {
+        name = stage;
+        cpu = pinned_cpu;
+        queue_capacity = capacity;
+        items.store(0);
+        dropped.store(0);
+        busy_ns.store(0);
+        cpu_ns.store(0);
+        queue_sum.store(0);
+        queue_max.store(0);
+    }
+
+    /* Called once per item with the input queue depth seen when it was taken */
+    void record(int64_t busy, size_t queued)
+    {
+        items.fetch_add(1, std::memory_order_relaxed);
+        busy_ns.fetch_add(busy, std::memory_order_relaxed);
+        queue_sum.fetch_add(queued, std::memory_order_relaxed);
+        if (queued > queue_max.load(std::memory_order_relaxed))
+            queue_max.store(queued, std::memory_order_relaxed);
+    }
+};
+
+/* Names the calling thread after its stage and, when cpu >= 0, pins it there */
+void enter_stage(const char *name, int cpu);
+
+#endif
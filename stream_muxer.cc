@@ -0,0 +1,118 @@
+#include "stream_muxer.h"
+#include "capture_errors.h"
+#include <string.h>
+
+#define STREAM_IO_BUFFER_SIZE 4096
+
+StreamMuxer::StreamMuxer()
+{
+    outctx = NULL;
+    stream = NULL;
+    last_pts = 0;
+}
+
+StreamMuxer::~StreamMuxer()
+{
+    cleanup();
+}
+
+int StreamMuxer::write_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    StreamMuxer *muxer = (StreamMuxer *) opaque;
+    muxer->pending.insert(muxer->pending.end(), buf, buf + buf_size);
+    return buf_size;
+}
+
+int StreamMuxer::init(const char *format, AVCodecContext *codec_context)
+{
+    int ret;
+    AVDictionary *options = NULL;
+
+    ret = avformat_alloc_output_context2(&outctx, NULL, format, NULL);
+    if (ret < 0 || !outctx)
+        return COULD_NOT_OPEN_FILE;
+
+    stream = avformat_new_stream(outctx, codec_context->codec);
+    if (!stream)
+        return COULD_NOT_OPEN_FILE;
+    avcodec_parameters_from_context(stream->codecpar, codec_context);
+    stream->time_base = codec_context->time_base;
+
+    uint8_t *io_buffer = (uint8_t *) av_malloc(STREAM_IO_BUFFER_SIZE);
+    if (!io_buffer)
+        return COULD_NOT_OPEN_FILE;
+    outctx->pb = avio_alloc_context(io_buffer, STREAM_IO_BUFFER_SIZE, 1, this, NULL, write_packet, NULL);
+    if (!outctx->pb) {
+        av_free(io_buffer);
+        return COULD_NOT_OPEN_FILE;
+    }
+
+    /* A moov without samples up front, then one self-contained fragment per packet */
+    if (!strcmp(format, "mp4"))
+        av_dict_set(&options, "movflags", "empty_moov+default_base_moof+frag_every_frame", 0);
+
+    ret = avformat_write_header(outctx, &options);
+    av_dict_free(&options);
+    if (ret < 0)
+        return COULD_NOT_OPEN_FILE;
+    avio_flush(outctx->pb);
+    return 0;
+}
+
+AVPacket *StreamMuxer::mux(const AVPacket *pkt, AVRational time_base)
+{
+    AVPacket *ref = av_packet_clone(pkt);
+    if (!ref)
+        return NULL;
+    av_packet_rescale_ts(ref, time_base, stream->time_base);
+    ref->stream_index = stream->index;
+    int ret = av_write_frame(outctx, ref);
+    av_packet_free(&ref);
+    if (ret < 0)
+        return NULL;
+    avio_flush(outctx->pb);
+    last_pts = pkt->pts;
+    return take_pending(pkt->pts, pkt->dts);
+}
+
+AVPacket *StreamMuxer::finish()
+{
+    if (!outctx)
+        return NULL;
+    /* movenc holds the last fragment until the trailer */
+    if (av_write_trailer(outctx) < 0)
+        return NULL;
+    avio_flush(outctx->pb);
+    return take_pending(last_pts, last_pts);
+}
+
+AVPacket *StreamMuxer::take_pending(int64_t pts, int64_t dts)
+{
+    if (pending.empty())
+        return NULL;
+
+    AVPacket *chunk = av_packet_alloc();
+    if (!chunk || av_new_packet(chunk, pending.size()) < 0) {
+        av_packet_free(&chunk);
+        return NULL;
+    }
+    memcpy(chunk->data, pending.data(), pending.size());
+    chunk->pts = pts;
+    chunk->dts = dts;
+    pending.clear();
+    return chunk;
+}
+
+void StreamMuxer::cleanup()
+{
+    if (outctx) {
+        if (outctx->pb) {
+            av_freep(&outctx->pb->buffer);
+            avio_context_free(&outctx->pb);
+        }
+        avformat_free_context(outctx);
+        outctx = NULL;
+        stream = NULL;
+    }
+    pending.clear();
+}
@@ -0,0 +1,47 @@
+#ifndef STREAM_MUXER_H
+#define STREAM_MUXER_H
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Muxes encoded packets into an in-memory byte stream, ADTS or fragmented MP4, for
+ * consumers that want a playable stream instead of packets. Each call to mux() returns
+ * the bytes produced so far; with fragmented MP4 the first chunk carries the init segment.
+ */
+class StreamMuxer
+{
+    public:
+        StreamMuxer();
+        ~StreamMuxer();
+
+        /* format is "adts" or "mp4" */
+        int init(const char *format, AVCodecContext *codec_context);
+
+        /*
+         * Muxes pkt, whose timestamps are in time_base, and returns a new packet holding the
+         * bytes written since the last call, or NULL when the muxer has not written any yet.
+         */
+        AVPacket *mux(const AVPacket *pkt, AVRational time_base);
+
+        /* Writes the trailer and returns the bytes still unsent, e.g. the last MP4 fragment, or NULL */
+        AVPacket *finish();
+
+        void cleanup();
+
+    private:
+        static int write_packet(void *opaque, uint8_t *buf, int buf_size);
+        AVPacket *take_pending(int64_t pts, int64_t dts);
+
+        AVFormatContext *outctx;
+        AVStream *stream;
+        std::vector<uint8_t> pending;
+        int64_t last_pts;       // of the last packet muxed, in the caller's time base
+};
+
+#endif
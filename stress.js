@@ -0,0 +1,126 @@
+// Scalability stress harness: runs N capturers on synthetic sources in this process and ramps N up.
+//
+//   node stress.js [--max 64] [--step 4] [--seconds 10] [--source tone:440] [--label name]
+//                  [--option key=value ...] [--json curve.json]
+//   node stress.js --compare baseline.json candidate.json
+//
+// Every step reports per stream CPU, capture to callback latency percentiles, how far the tsfn
+// queue grew and how many periods missed their real-time deadline. The first step with misses is
+// reported as the saturation point. --option values are passed to every capturer's constructor,
+// so runs with different threading modes can be compared with --compare.
+
+const soundCaptureUtility = require('bindings')('linux_sound_capture_utility');
+const fs = require('fs');
+
+function parseArgs(argv) {
+    const args = { max: 64, step: 4, seconds: 10, source: 'tone:440', label: '', options: {}, json: null, compare: null };
+    for (let i = 0; i < argv.length; i++) {
+        const arg = argv[i];
+        if (arg === '--compare') args.compare = [argv[++i], argv[++i]];
+        else if (arg === '--option') {
+            const [key, value] = argv[++i].split('=');
+            args.options[key] = isNaN(Number(value)) ? value : Number(value);
+        }
+        else if (['--max', '--step', '--seconds'].includes(arg)) args[arg.slice(2)] = Number(argv[++i]);
+        else if (['--source', '--label', '--json'].includes(arg)) args[arg.slice(2)] = argv[++i];
+        else throw new Error(`Unknown argument ${arg}`);
+    }
+    return args;
+}
+
+const sleep = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
+
+function percentile(values, p) {
+    if (!values.length) return 0;
+    const sorted = [...values].sort((a, b) => a - b);
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p / 100))];
+}
+
+async function runStep(n, args) {
+    const capturers = [];
+    for (let i = 0; i < n; i++) {
+        const capturer = new soundCaptureUtility.SoundCaptureUtility({ ...args.options, source: args.source, output: '' });
+        await capturer.startListener(() => {});
+        capturers.push(capturer);
+    }
+
+    const start = process.cpuUsage();
+    await sleep(args.seconds * 1000);
+    const cpu = process.cpuUsage(start);
+
+    const stats = capturers.map((capturer) => capturer.getStats());
+    for (const capturer of capturers) await capturer.stopListener();
+
+    const periods = stats.reduce((sum, s) => sum + s.periods, 0);
+    const misses = stats.reduce((sum, s) => sum + s.deadlineMisses, 0);
+    return {
+        streams: n,
+        processCpuPercent: (cpu.user + cpu.system) / 1e4 / args.seconds,
+        streamCpuPercent: {
+            mean: stats.reduce((sum, s) => sum + s.cpuTimeMs / s.wallTimeMs * 100, 0) / n,
+            max: Math.max(...stats.map((s) => s.cpuTimeMs / s.wallTimeMs * 100)),
+        },
+        latencyMs: {
+            p50: percentile(stats.map((s) => s.latencyMs.p50), 50),
+            p99: Math.max(...stats.map((s) => s.latencyMs.p99)),
+            max: Math.max(...stats.map((s) => s.latencyMs.max)),
+        },
+        maxQueued: Math.max(...stats.map((s) => s.maxQueued)),
+        periods,
+        deadlineMisses: misses,
+        missRate: periods ? misses / periods : 0,
+    };
+}
+
+function printPoint(point) {
+    console.log(`${String(point.streams).padStart(5)} streams  cpu/stream ${point.streamCpuPercent.mean.toFixed(2).padStart(6)}%` +
+        `  process ${point.processCpuPercent.toFixed(1).padStart(6)}%` +
+        `  latency p50 ${point.latencyMs.p50.toFixed(2).padStart(7)}ms p99 ${point.latencyMs.p99.toFixed(2).padStart(7)}ms` +
+        `  queue max ${String(point.maxQueued).padStart(5)}  misses ${point.deadlineMisses}/${point.periods}`);
+}
+
+function compare(baselinePath, candidatePath) {
+    const baseline = JSON.parse(fs.readFileSync(baselinePath));
+    const candidate = JSON.parse(fs.readFileSync(candidatePath));
+    console.log(`baseline: ${baseline.label} (saturates at ${baseline.saturation || 'none'})`);
+    console.log(`candidate: ${candidate.label} (saturates at ${candidate.saturation || 'none'})`);
+    console.log('streams  cpu/stream %        p99 latency ms     deadline misses');
+    for (const point of candidate.points) {
+        const base = baseline.points.find((p) => p.streams === point.streams);
+        if (!base) continue;
+        console.log(`${String(point.streams).padStart(7)}  ${base.streamCpuPercent.mean.toFixed(2).padStart(6)} -> ${point.streamCpuPercent.mean.toFixed(2).padEnd(6)}` +
+            `  ${base.latencyMs.p99.toFixed(2).padStart(7)} -> ${point.latencyMs.p99.toFixed(2).padEnd(7)}` +
+            `  ${String(base.deadlineMisses).padStart(6)} -> ${point.deadlineMisses}`);
+    }
+}
+
+async function main() {
+    const args = parseArgs(process.argv.slice(2));
+    if (args.compare) return compare(...args.compare);
+
+    const curve = {
+        label: args.label || Object.entries(args.options).map(([k, v]) => `${k}=${v}`).join(',') || 'default',
+        source: args.source,
+        options: args.options,
+        secondsPerStep: args.seconds,
+        saturation: null,
+        points: [],
+    };
+
+    for (let n = args.step > 1 ? 1 : args.step; n <= args.max; n = n === 1 && args.step > 1 ? args.step : n + args.step) {
+        const point = await runStep(n, args);
+        printPoint(point);
+        curve.points.push(point);
+        if (point.deadlineMisses && curve.saturation === null) {
+            curve.saturation = n;
+            console.log(`real-time deadlines first missed at ${n} streams`);
+        }
+    }
+
+    if (args.json) fs.writeFileSync(args.json, JSON.stringify(curve, null, 2));
+}
+
+main().catch((err) => {
+    console.error(err);
+    process.exit(1);
+});
@@ -0,0 +1,332 @@
+#include "tee_sink.h"
+#include "capture_stats.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+int RawTeeSink::open(unsigned int sample_rate, unsigned int nb_channels)
+{
+    channels = nb_channels;
+    return sink.open(path.c_str());
+}
+
+int RawTeeSink::write(const int16_t *samples, unsigned long frames)
+{
+    return sink.write(samples, frames * channels * sizeof(int16_t));
+}
+
+int WavTeeSink::open(unsigned int sample_rate, unsigned int nb_channels)
+{
+    channels = nb_channels;
+    if (index)
+        sink.set_index((path + ".idx").c_str());
+    return sink.open(path.c_str(), sample_rate, channels, 16);
+}
+
+int WavTeeSink::write(const int16_t *samples, unsigned long frames)
+{
+    return sink.write(samples, frames * channels * sizeof(int16_t));
+}
+
+ResamplingTeeSink::ResamplingTeeSink()
+{
+    out_rate = DEFAULT_AUD_SAMPLE_RATE;
+    out_channels = DEFAULT_AUD_CHANNELS;
+    opened = false;
+}
+
+int ResamplingTeeSink::open(unsigned int sample_rate, unsigned int channels)
+{
+    int err = converter.init(channels, sample_rate, out_channels, out_rate);
+    if (err)
+        return err;
+    opened = true;
+    return open_output();
+}
+
+int ResamplingTeeSink::write(const int16_t *samples, unsigned long frames)
+{
+    int converted = converter.convert(samples, frames);
+    if (converted < 0)
+        return COULD_NOT_CONVERT_AUD;
+    return converted ? write_planes(converter.planes(), converted) : 0;
+}
+
+int ResamplingTeeSink::close()
+{
+    if (!opened)
+        return 0;
+    opened = false;
+
+    /* The resampler holds back a few samples for its filter */
+    int err = 0;
+    int converted = converter.drain();
+    if (converted < 0)
+        err = COULD_NOT_CONVERT_AUD;
+    else if (converted)
+        err = write_planes(converter.planes(), converted);
+    int close_err = close_output();
+    return err ? err : close_err;
+}
+
+FloatTeeSink::~FloatTeeSink()
+{
+    close_output();
+}
+
+int FloatTeeSink::open_output()
+{
+    for (int c = 0; c < out_channels; c++) {
+        AsyncFileSink *sink = new AsyncFileSink();
+        sinks.push_back(sink);
+        int err = sink->open((path + "." + std::to_string(c)).c_str());
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+int FloatTeeSink::write_planes(float **planes, int frames)
+{
+    for (int c = 0; c < out_channels; c++) {
+        int err = sinks[c]->write(planes[c], frames * sizeof(float));
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+int FloatTeeSink::close_output()
+{
+    int err = 0;
+
+    for (AsyncFileSink *sink: sinks) {
+        int close_err = sink->close();
+        if (!err)
+            err = close_err;
+        delete sink;
+    }
+    sinks.clear();
+    return err;
+}
+
+EncodeTeeSink::EncodeTeeSink(const char *path, const char *codec_name, int64_t bit_rate, bool index)
+    : path(path), codec_name(codec_name ? codec_name : ""), bit_rate(bit_rate), index(index)
+{
+    frames_in = 0;
+    opened = false;
+}
+
+int EncodeTeeSink::open_output()
+{
+    frames_in = 0;
+    if (index)
+        encoder.set_index((path + ".idx").c_str());
+    int err = encoder.init(codec_name.empty() ? NULL : codec_name.c_str(), bit_rate, out_rate,
+                           av_get_default_channel_layout(out_channels), path.c_str());
+    if (err)
+        return err;
+    if (assembler.init(out_channels, encoder.frame_size()))
+        return COULD_NOT_ALLOC_SAMPLES;
+    opened = true;
+    return 0;
+}
+
+int EncodeTeeSink::encode_frame()
+{
+    int err = 0;
+    AVPacket *pkt = encoder.encode((uint8_t **) assembler.frame());
+    for (; pkt; pkt = encoder.receive()) {
+        if (!err)
+            err = encoder.write(pkt);
+        av_packet_free(&pkt);
+    }
+    return err;
+}
+
+int EncodeTeeSink::write_planes(float **planes, int frames)
+{
+    if (assembler.write(planes, frames))
+        return COULD_NOT_ALLOC_SAMPLES;
+    frames_in += frames;
+
+    while (assembler.next()) {
+        int err = encode_frame();
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+int EncodeTeeSink::close_output()
+{
+    if (!opened)
+        return 0;
+    opened = false;
+
+    /* Pad the last partial frame with silence rather than lose it */
+    int err = assembler.flush() ? encode_frame() : 0;
+    int finish_err = encoder.finish();
+    return err ? err : finish_err;
+}
+
+struct TeeBranch
+{
+    TeeSink *sink;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::vector<int16_t> slots;         // queue_periods periods of period_frames each
+    std::vector<unsigned long> frames;
+    std::vector<int64_t> captured_ns;   // wall clock of each slot's first frame
+    size_t slot_samples;
+    int head;
+    int count;
+    bool opened;
+    bool stopping;
+    int error;
+    uint64_t dropped;
+};
+
+CaptureTee::CaptureTee()
+{
+    sample_rate = 0;
+    channels = 0;
+}
+
+CaptureTee::~CaptureTee()
+{
+    close();
+    for (TeeBranch *branch: branches) {
+        delete branch->sink;
+        delete branch;
+    }
+}
+
+void CaptureTee::add(TeeSink *sink)
+{
+    TeeBranch *branch = new TeeBranch();
+    branch->sink = sink;
+    branch->slot_samples = 0;
+    branch->head = 0;
+    branch->count = 0;
+    branch->opened = false;
+    branch->stopping = false;
+    branch->error = 0;
+    branch->dropped = 0;
+    branches.push_back(branch);
+}
+
+int CaptureTee::open(unsigned int rate, unsigned int nb_channels, unsigned long period_frames,
+                     int queue_periods)
+{
+    sample_rate = rate;
+    channels = nb_channels;
+    for (TeeBranch *branch: branches) {
+        int err = branch->sink->open(sample_rate, channels);
+        if (err) {
+            fprintf(stderr, "Could not open the %s output: %d\n", branch->sink->name(), err);
+            return err;
+        }
+        branch->opened = true;
+        if (branch->sink->nonblocking())
+            continue;
+
+        branch->slot_samples = period_frames * channels;
+        branch->slots.assign(branch->slot_samples * queue_periods, 0);
+        branch->frames.assign(queue_periods, 0);
+        branch->captured_ns.assign(queue_periods, 0);
+        branch->stopping = false;
+        branch->thread = std::thread(&CaptureTee::run, this, branch);
+    }
+    return 0;
+}
+
+void CaptureTee::run(TeeBranch *branch)
+{
+    int queue_periods = branch->frames.size();
+    std::unique_lock<std::mutex> lock(branch->mutex);
+
+    for (;;) {
+        branch->queued.wait(lock, [branch] { return branch->stopping || branch->count; });
+        if (!branch->count)
+            break;
+
+        /* The head slot stays out of the producer's reach until it is released below */
+        int slot = branch->head;
+        lock.unlock();
+        int err = 0;
+        if (!branch->error) {
+            branch->sink->captured_at(branch->captured_ns[slot]);
+            err = branch->sink->write(&branch->slots[slot * branch->slot_samples], branch->frames[slot]);
+        }
+        lock.lock();
+        if (err && !branch->error) {
+            fprintf(stderr, "Error writing the %s output: %d\n", branch->sink->name(), err);
+            branch->error = err;
+        }
+        branch->head = (branch->head + 1) % queue_periods;
+        branch->count--;
+    }
+}
+
+void CaptureTee::write(const int16_t *samples, unsigned long frames)
+{
+    /* The period has just been read, so it began its length ago */
+    int64_t captured_ns = realtime_ns() - (int64_t) frames * 1000000000LL / (sample_rate ? sample_rate : 1);
+
+    for (TeeBranch *branch: branches) {
+        if (branch->sink->nonblocking()) {
+            if (!branch->error) {
+                branch->sink->captured_at(captured_ns);
+                branch->error = branch->sink->write(samples, frames);
+            }
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(branch->mutex);
+        int queue_periods = branch->frames.size();
+        if (branch->count == queue_periods || frames * channels > branch->slot_samples) {
+            branch->dropped++;
+            continue;
+        }
+        int slot = (branch->head + branch->count) % queue_periods;
+        memcpy(&branch->slots[slot * branch->slot_samples], samples, frames * channels * sizeof(int16_t));
+        branch->frames[slot] = frames;
+        branch->captured_ns[slot] = captured_ns;
+        branch->count++;
+        branch->queued.notify_one();
+    }
+}
+
+int CaptureTee::close()
+{
+    int err = 0;
+
+    for (TeeBranch *branch: branches) {
+        if (!branch->opened)
+            continue;
+        if (branch->thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(branch->mutex);
+                branch->stopping = true;
+            }
+            branch->queued.notify_one();
+            branch->thread.join();
+        }
+        branch->opened = false;
+
+        int close_err = branch->sink->close();
+        if (!branch->error)
+            branch->error = close_err;
+        if (branch->dropped)
+            fprintf(stderr, "The %s output fell behind and lost %llu periods\n", branch->sink->name(),
+                    (unsigned long long) branch->dropped);
+        if (!err)
+            err = branch->error;
+    }
+    return err;
+}
@@ -0,0 +1,172 @@
+#ifndef TEE_SINK_H
+#define TEE_SINK_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "async_file_sink.h"
+#include "audio_encoder.h"
+#include "capture_pipeline.h"
+#include "wav_sink.h"
+
+/* One output of a capture, fed interleaved S16 periods at the capture rate and channel count */
+class TeeSink
+{
+    public:
+        virtual ~TeeSink() {}
+
+        virtual int open(unsigned int sample_rate, unsigned int channels) = 0;
+        virtual int write(const int16_t *samples, unsigned long frames) = 0;
+        virtual int close() = 0;
+        virtual const char *name() const = 0;
+
+        /* A sink whose write() never waits can run on the capture thread instead of its own */
+        virtual bool nonblocking() const { return false; }
+
+        /* Called before each write() with the wall-clock time its first frame was captured */
+        virtual void captured_at(int64_t wall_ns) {}
+};
+
+/* The captured samples as they are */
+class RawTeeSink: public TeeSink
+{
+    public:
+        RawTeeSink(const char *path): path(path), channels(0) {}
+
+        int open(unsigned int sample_rate, unsigned int channels);
+        int write(const int16_t *samples, unsigned long frames);
+        int close() { return sink.close(); }
+        const char *name() const { return "raw"; }
+        bool nonblocking() const { return true; }
+
+    private:
+        std::string path;
+        unsigned int channels;
+        AsyncFileSink sink;
+};
+
+/* The captured samples in a WAV (or RF64) file, with a seek index in <path>.idx when asked */
+class WavTeeSink: public TeeSink
+{
+    public:
+        WavTeeSink(const char *path, bool index = false): path(path), channels(0), index(index) {}
+
+        int open(unsigned int sample_rate, unsigned int channels);
+        int write(const int16_t *samples, unsigned long frames);
+        int close() { return sink.close(); }
+        const char *name() const { return "wav"; }
+        void captured_at(int64_t wall_ns) { sink.set_clock(wall_ns); }
+
+    private:
+        std::string path;
+        unsigned int channels;
+        bool index;
+        WavSink sink;
+};
+
+/* Converts to planar float at the encoder's rate and layout and hands the planes on */
+class ResamplingTeeSink: public TeeSink
+{
+    public:
+        ResamplingTeeSink();
+
+        int open(unsigned int sample_rate, unsigned int channels);
+        int write(const int16_t *samples, unsigned long frames);
+        int close();
+
+    protected:
+        virtual int open_output() = 0;
+        virtual int write_planes(float **planes, int frames) = 0;
+        virtual int close_output() = 0;
+
+        int out_rate;
+        int out_channels;
+
+    private:
+        SampleConverter converter;
+        bool opened;
+};
+
+/* One file of native-endian float per channel, named <path>.0, <path>.1, ... */
+class FloatTeeSink: public ResamplingTeeSink
+{
+    public:
+        FloatTeeSink(const char *path): path(path) {}
+        ~FloatTeeSink();
+
+        const char *name() const { return "fltp"; }
+
+    protected:
+        int open_output();
+        int write_planes(float **planes, int frames);
+        int close_output();
+
+    private:
+        std::string path;
+        std::vector<AsyncFileSink *> sinks;
+};
+
+/* Encoded audio muxed into a container guessed from the file name, with a seek index in <path>.idx when asked */
+class EncodeTeeSink: public ResamplingTeeSink
+{
+    public:
+        /* codec_name NULL selects the native AAC encoder */
+        EncodeTeeSink(const char *path, const char *codec_name, int64_t bit_rate, bool index = false);
+
+        const char *name() const { return "encode"; }
+        void captured_at(int64_t wall_ns) { encoder.set_clock(frames_in, wall_ns); }
+
+    protected:
+        int open_output();
+        int write_planes(float **planes, int frames);
+        int close_output();
+
+    private:
+        int encode_frame();
+
+        std::string path;
+        std::string codec_name;
+        int64_t bit_rate;
+        bool index;
+        AudioEncoder encoder;
+        FrameAssembler assembler;       // codec frames rarely line up with capture periods
+        int64_t frames_in;              // at the encoder's rate, the pts of the next sample
+        bool opened;
+};
+
+struct TeeBranch;
+
+/*
+ * Fans captured periods out to any number of sinks. Each sink that may block gets its own
+ * thread and a queue of periods; write() only copies into the queues, so a slow disk or
+ * encoder delays nothing but its own output and, once its queue is full, loses periods
+ * (counted and reported by close()) rather than making the capture overrun.
+ */
+class CaptureTee
+{
+    public:
+        CaptureTee();
+        ~CaptureTee();
+
+        /* Takes ownership of sink */
+        void add(TeeSink *sink);
+        bool empty() const { return branches.empty(); }
+
+        /* Opens every sink and starts their threads; queue_periods is the queue length of each */
+        int open(unsigned int sample_rate, unsigned int channels, unsigned long period_frames,
+                 int queue_periods = 64);
+
+        void write(const int16_t *samples, unsigned long frames);
+
+        /* Drains the queues, closes every sink and returns the first error */
+        int close();
+
+    private:
+        void run(TeeBranch *branch);
+
+        std::vector<TeeBranch *> branches;
+        unsigned int sample_rate;
+        unsigned int channels;
+};
+
+#endif
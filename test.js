@@ -3,7 +3,7 @@
 //import soundCaptureUtility from './index/soundCaptureUtility';
 
 const soundCaptureUtility = require('bindings')('linux_sound_capture_utility');
-const addon = new soundCaptureUtility.SoundCaptureUtility(); 
+const addon = new soundCaptureUtility.SoundCaptureUtility({ source: process.env.CAPTURE_SOURCE || 'alsa' });
 const eventEmitter = require('events').EventEmitter;
 
 const emitter = new eventEmitter();
@@ -13,9 +13,10 @@ emitter.on('data', (encoded_audio, pts) => {
 });
 
 console.log('starting listener');
-addon.startListener(emitter.emit.bind(emitter));
-
-setTimeout(() => {
-    console.log('stopping listener');
-    addon.closeListener();
-}, 5000);
+addon.startListener(emitter.emit.bind(emitter)).then(() => {
+    console.log('listener started');
+    setTimeout(() => {
+        console.log('stopping listener');
+        addon.stopListener().then(() => console.log('listener stopped'));
+    }, 5000);
+}, (err) => console.error('could not start listener:', err.message));
@@ -0,0 +1,330 @@
+#include "wav_sink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WAV_PAGE_SIZE 4096
+#define WAV_RIFF_LIMIT 0xFFFFFFFFULL
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+/* Header patches are a few bytes, so a short write is an error rather than something to retry */
+int WavSink::patch(const uint8_t *data, size_t size, uint64_t offset)
+{
+    if (mapped) {
+        memcpy(output.data() + offset, data, size);
+        return 0;
+    }
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written == (ssize_t) size)
+        return 0;
+    return written < 0 ? -errno : -EIO;
+}
+
+WavSink::WavSink()
+{
+    fd = -1;
+    mapped = false;
+    grow_size = 0;
+    written_back = 0;
+    index_interval = 1.0;
+    buffer = NULL;
+    capacity = 0;
+    used = 0;
+    flush_size = 0;
+    data_bytes = 0;
+    writes = 0;
+    sample_rate = 0;
+    channels = 0;
+    bits_per_sample = 0;
+}
+
+WavSink::~WavSink()
+{
+    close();
+}
+
+int WavSink::open(const char *path, unsigned int rate, unsigned int nb_channels, unsigned int bits,
+                  size_t buffer_size)
+{
+    sample_rate = rate;
+    channels = nb_channels;
+    bits_per_sample = bits;
+    data_bytes = 0;
+    writes = 0;
+    used = 0;
+
+    /* Whole pages, so every write after the first starts and ends on a page boundary */
+    capacity = (buffer_size + WAV_PAGE_SIZE - 1) / WAV_PAGE_SIZE * WAV_PAGE_SIZE;
+    if (capacity < WAV_PAGE_SIZE)
+        capacity = WAV_PAGE_SIZE;
+    flush_size = capacity - WAV_HEADER_SIZE;
+    if (posix_memalign((void **) &buffer, WAV_PAGE_SIZE, capacity)) {
+        buffer = NULL;
+        fprintf(stderr, "Could not allocate the WAV write buffer\n");
+        return -ENOMEM;
+    }
+
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        int err = -errno;
+        fprintf(stderr, "Could not create %s: %s\n", path, strerror(errno));
+        free(buffer);
+        buffer = NULL;
+        return err;
+    }
+
+    /* Sizes are placeholders until close() */
+    uint8_t header[WAV_HEADER_SIZE];
+    build_header(header);
+    ssize_t written = ::write(fd, header, WAV_HEADER_SIZE);
+    writes++;
+    if (written != WAV_HEADER_SIZE) {
+        int err = written < 0 ? -errno : -EIO;
+        fprintf(stderr, "Could not write the WAV header\n");
+        ::close(fd);
+        fd = -1;
+        free(buffer);
+        buffer = NULL;
+        return err;
+    }
+    open_index();
+    return 0;
+}
+
+int WavSink::open_mapped(const char *path, unsigned int rate, unsigned int nb_channels, unsigned int bits,
+                         uint64_t expected_bytes)
+{
+    sample_rate = rate;
+    channels = nb_channels;
+    bits_per_sample = bits;
+    data_bytes = 0;
+    writes = 0;
+    written_back = 0;
+
+    /* Whole pages, and at least one buffer's worth, so growing stays rare */
+    grow_size = (expected_bytes + WAV_PAGE_SIZE - 1) / WAV_PAGE_SIZE * WAV_PAGE_SIZE;
+    if (grow_size < WAV_DEFAULT_BUFFER_SIZE)
+        grow_size = WAV_DEFAULT_BUFFER_SIZE;
+
+    int err = output.open(path, WAV_HEADER_SIZE + grow_size);
+    if (err)
+        return err;
+    mapped = true;
+    build_header(output.data());
+    open_index();
+    return 0;
+}
+
+void WavSink::build_header(uint8_t *header)
+{
+    uint8_t *riff = header, *junk = header + 12, *fmt = header + 48, *data = header + 72;
+    uint16_t block_align = channels * bits_per_sample / 8;
+
+    memcpy(riff, "RIFF", 4);
+    put_le32(riff + 4, 0);
+    memcpy(riff + 8, "WAVE", 4);
+
+    memset(junk, 0, 36);
+    memcpy(junk, "JUNK", 4);
+    put_le32(junk + 4, 36 - 8);
+
+    memcpy(fmt, "fmt ", 4);
+    put_le32(fmt + 4, 16);
+    put_le16(fmt + 8, 1);               // PCM
+    put_le16(fmt + 10, channels);
+    put_le32(fmt + 12, sample_rate);
+    put_le32(fmt + 16, sample_rate * block_align);
+    put_le16(fmt + 20, block_align);
+    put_le16(fmt + 22, bits_per_sample);
+
+    memcpy(data, "data", 4);
+    put_le32(data + 4, 0);
+}
+
+int WavSink::write_all(const uint8_t *data, size_t size)
+{
+    while (size) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        writes++;
+        if (written <= 0) {
+            int err = written < 0 ? -errno : -EIO;
+            fprintf(stderr, "Error writing WAV data: %s\n", strerror(-err));
+            return err;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int WavSink::flush()
+{
+    int err = write_all(buffer, used);
+    used = 0;
+    flush_size = capacity;
+    return err;
+}
+
+void WavSink::set_index(const char *path, double interval)
+{
+    index_path = path ? path : "";
+    index_interval = interval;
+}
+
+void WavSink::set_clock(int64_t wall_ns)
+{
+    uint16_t block_align = channels * bits_per_sample / 8;
+    if (block_align)
+        index.set_clock(data_bytes / block_align, wall_ns);
+}
+
+/* A sink whose index fails still records; the index reports its own errors */
+void WavSink::open_index()
+{
+    if (!index_path.empty())
+        index.open(index_path.c_str(), SEEK_INDEX_WAV, sample_rate, channels, bits_per_sample, index_interval);
+}
+
+/* Adds an entry for the frame the next write starts with, when one is due */
+void WavSink::index_write()
+{
+    uint16_t block_align = channels * bits_per_sample / 8;
+    int64_t pts = block_align ? data_bytes / block_align : 0;
+    if (index.due(pts) && index.add(pts, WAV_HEADER_SIZE + data_bytes))
+        index.close();
+}
+
+/* Copies into the mapping, growing it when full, and starts writeback of each finished buffer's worth */
+int WavSink::write_mapped(const uint8_t *data, size_t size)
+{
+    uint64_t end = WAV_HEADER_SIZE + data_bytes + size;
+    if (end > output.size()) {
+        int err = output.resize(end + grow_size);
+        if (err) {
+            fprintf(stderr, "Could not grow the WAV file: %s\n", strerror(-err));
+            return err;
+        }
+    }
+    memcpy(output.data() + WAV_HEADER_SIZE + data_bytes, data, size);
+    data_bytes += size;
+
+    if (end - written_back >= WAV_DEFAULT_BUFFER_SIZE) {
+        output.writeback(written_back, end - written_back);
+        written_back = end;
+        writes++;
+    }
+    return 0;
+}
+
+int WavSink::write(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *) data;
+
+    if (fd < 0 && !mapped)
+        return -EBADF;
+    index_write();
+    if (mapped)
+        return write_mapped(p, size);
+
+    data_bytes += size;
+    while (size) {
+        size_t chunk = flush_size - used < size ? flush_size - used : size;
+        memcpy(buffer + used, p, chunk);
+        used += chunk;
+        p += chunk;
+        size -= chunk;
+        if (used == flush_size) {
+            int err = flush();
+            if (err)
+                return err;
+        }
+    }
+    return 0;
+}
+
+int WavSink::close()
+{
+    if (fd < 0 && !mapped)
+        return 0;
+
+    int err = mapped ? 0 : flush();
+
+    /* Chunks have an even size; the pad byte counts towards RIFF but not data */
+    uint64_t padded = data_bytes + (data_bytes & 1);
+    if (!err && (data_bytes & 1)) {
+        if (mapped) {
+            err = write_mapped((const uint8_t *) "", 1);
+            data_bytes--;
+        } else {
+            err = write_all((const uint8_t *) "", 1);
+        }
+    }
+
+    uint64_t riff_size = WAV_HEADER_SIZE - 8 + padded;
+    if (!err && riff_size <= WAV_RIFF_LIMIT) {
+        uint8_t size[4];
+        put_le32(size, riff_size);
+        err = patch(size, 4, 4);
+        put_le32(size, data_bytes);
+        if (!err)
+            err = patch(size, 4, WAV_HEADER_SIZE - 4);
+        writes += mapped ? 0 : 2;
+    } else if (!err) {
+        /* RF64: the 32 bit sizes are all ones and the real ones live in ds64, where JUNK was */
+        uint8_t head[48], size[4];
+        uint16_t block_align = channels * bits_per_sample / 8;
+        memcpy(head, "RF64", 4);
+        put_le32(head + 4, 0xFFFFFFFF);
+        memcpy(head + 8, "WAVE", 4);
+        memcpy(head + 12, "ds64", 4);
+        put_le32(head + 16, 28);
+        put_le64(head + 20, riff_size);
+        put_le64(head + 28, data_bytes);
+        put_le64(head + 36, block_align ? data_bytes / block_align : 0);
+        put_le32(head + 44, 0);         // no table
+        err = patch(head, sizeof(head), 0);
+        put_le32(size, 0xFFFFFFFF);
+        if (!err)
+            err = patch(size, 4, WAV_HEADER_SIZE - 4);
+        writes += mapped ? 0 : 2;
+    }
+    if (err)
+        fprintf(stderr, "Could not finalize the WAV header: %s\n", strerror(-err));
+    index.close();
+
+    if (mapped) {
+        /* Gives back the preallocated space that was not used */
+        int close_err = output.close(WAV_HEADER_SIZE + padded);
+        if (!err)
+            err = close_err;
+        mapped = false;
+        return err;
+    }
+    ::close(fd);
+    fd = -1;
+    free(buffer);
+    buffer = NULL;
+    return err;
+}
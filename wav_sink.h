@@ -0,0 +1,83 @@
+#ifndef WAV_SINK_H
+#define WAV_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include "mapped_file.h"
+#include "seek_index.h"
+
+/* Bytes before the audio: RIFF, a JUNK chunk that becomes ds64 for RF64, fmt and the data chunk header */
+#define WAV_HEADER_SIZE 80
+#define WAV_DEFAULT_BUFFER_SIZE (1 << 20)
+
+/*
+ * Writes PCM to a WAV file in large page-aligned writes instead of one write() per period.
+ *
+ * The header goes out in one write() with placeholder sizes, which close() patches with
+ * pwrite(). A recording that passes 4 GB is turned into RF64 (EBU Tech 3306) in place: the
+ * reserved JUNK chunk becomes the ds64 chunk holding the 64 bit sizes, so no data moves.
+ *
+ * open_mapped() instead preallocates the file for the expected length and maps it, and
+ * periods are copied straight into the page cache with no write() at all.
+ *
+ * With set_index(), a seek index (seek_index.h) is written next to the file as it grows.
+ */
+class WavSink
+{
+    public:
+        WavSink();
+        ~WavSink();
+
+        /* Creates or truncates path; returns 0 or a negative errno */
+        int open(const char *path, unsigned int sample_rate, unsigned int channels, unsigned int bits_per_sample,
+                 size_t buffer_size = WAV_DEFAULT_BUFFER_SIZE);
+
+        /* Same, mapped and preallocated for expected_bytes of samples; grows by as much again when they run out */
+        int open_mapped(const char *path, unsigned int sample_rate, unsigned int channels, unsigned int bits_per_sample,
+                        uint64_t expected_bytes);
+
+        /* Call before open(): the next file gets a seek index at index_path, an entry every interval seconds */
+        void set_index(const char *index_path, double interval = 1.0);
+
+        /* The samples of the next write() were captured from wall_ns on; times the seek index */
+        void set_clock(int64_t wall_ns);
+
+        /* Appends interleaved samples, writing whenever the buffer fills; returns 0 or a negative errno */
+        int write(const void *data, size_t size);
+
+        /* Writes what is buffered, finalizes the header and closes the file; safe to call twice */
+        int close();
+
+        uint64_t data_size() const { return data_bytes; }
+        uint64_t write_calls() const { return writes; }
+
+    private:
+        int flush();
+        int write_all(const uint8_t *data, size_t size);
+        int write_mapped(const uint8_t *data, size_t size);
+        int patch(const uint8_t *data, size_t size, uint64_t offset);
+        void build_header(uint8_t *header);
+        void open_index();
+        void index_write();
+
+        int fd;
+        bool mapped;
+        MappedOutput output;
+        uint64_t grow_size;
+        uint64_t written_back;  // mapped bytes handed to writeback so far
+        std::string index_path;
+        double index_interval;
+        SeekIndexWriter index;
+        uint8_t *buffer;
+        size_t capacity;
+        size_t used;
+        size_t flush_size;      // first write is shorter so later ones start on a page boundary
+        uint64_t data_bytes;
+        uint64_t writes;
+        unsigned int sample_rate;
+        unsigned int channels;
+        unsigned int bits_per_sample;
+};
+
+#endif
@@ -0,0 +1,76 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool()
+{
+    batch = NULL;
+    next_task = 0;
+    unfinished = 0;
+    stopping = false;
+}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+void WorkerPool::start(int count)
+{
+    stopping = false;
+    for (int i = 0; i < count; i++)
+        threads.push_back(std::thread(&WorkerPool::work, this));
+}
+
+void WorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    batch_ready.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    threads.clear();
+}
+
+/* Takes the next task of the current batch and runs it unlocked; false when there is none */
+bool WorkerPool::run_one(std::unique_lock<std::mutex> &lock)
+{
+    if (!batch || next_task >= batch->size())
+        return false;
+
+    std::function<void()> &task = (*batch)[next_task++];
+    lock.unlock();
+    task();
+    lock.lock();
+    if (--unfinished == 0)
+        batch_done.notify_all();
+    return true;
+}
+
+void WorkerPool::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        if (!run_one(lock))
+            batch_ready.wait(lock);
+    }
+}
+
+void WorkerPool::run(std::vector<std::function<void()> > &tasks)
+{
+    if (tasks.empty())
+        return;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    batch = &tasks;
+    next_task = 0;
+    unfinished = tasks.size();
+    lock.unlock();
+    batch_ready.notify_all();
+    lock.lock();
+
+    while (run_one(lock))
+        ;
+    batch_done.wait(lock, [this] { return unfinished == 0; });
+    batch = NULL;
+}
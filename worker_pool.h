@@ -0,0 +1,44 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed set of threads that runs a batch of independent tasks and returns when all of
+ * them are done. The calling thread works on the batch too, so a pool of N threads
+ * runs up to N + 1 tasks at once.
+ */
+class WorkerPool
+{
+    public:
+        WorkerPool();
+        ~WorkerPool();
+
+        void start(int threads);
+        void stop();
+
+        int size() const { return threads.size(); }
+
+        /* Runs every task once and blocks until the whole batch has finished */
+        void run(std::vector<std::function<void()> > &tasks);
+
+    private:
+        void work();
+        bool run_one(std::unique_lock<std::mutex> &lock);
+
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable batch_ready;
+        std::condition_variable batch_done;
+
+        std::vector<std::function<void()> > *batch;
+        size_t next_task;
+        size_t unfinished;
+        bool stopping;
+};
+
+#endif